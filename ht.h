@@ -70,7 +70,7 @@ struct timespec;
 BEGIN_DECLARATION
 
     /* some global constants */
-#define HT_KEY_MAX                  256
+#define HT_KEY_MAX                  16384 /* storage grows on demand */
 #define HT_ATFORK_MAX               128
 #define HT_DESTRUCTOR_ITERATIONS    4
 
@@ -98,8 +98,15 @@ BEGIN_DECLARATION
                                        HT_CTRL_GETTHREADS_DEAD)
 #define HT_CTRL_DUMPSTATE            _BIT(10)
 #define HT_CTRL_FAVOURNEW            _BIT(11)
-
-    /* the time value structure */
+#define HT_CTRL_LOCKPROF             _BIT(12)
+#define HT_CTRL_DUMPLOCKPROF         _BIT(13)
+#define HT_CTRL_TIMERSLACK           _BIT(14)
+
+    /* the time value structure; time points (ht_timeout(), the
+       HT_ATTR_TIME_SPAWN/LAST attributes, absolute HT_EVENT_TIME events
+       and deadlines) count on CLOCK_MONOTONIC, not on the wall clock,
+       so an absolute time built with ht_time() has to be taken from
+       clock_gettime(CLOCK_MONOTONIC) as well */
 typedef struct timeval ht_time_t;
 
     /* the unique thread id/handle */
@@ -144,7 +151,8 @@ enum {
     HT_ATTR_START_ARG,      /* RO [void *]            thread start argument             */
     HT_ATTR_STATE,          /* RO [ht_state_t]       scheduling state                  */
     HT_ATTR_EVENTS,         /* RO [ht_event_t]       events the thread is waiting for  */
-    HT_ATTR_BOUND           /* RO [int]               whether object is bound to thread */
+    HT_ATTR_BOUND,          /* RO [int]               whether object is bound to thread */
+    HT_ATTR_TIMER_SLACK     /* RW [int]               timer slack in usec, -1 global    */
 };
 
     /* default thread attribute */
@@ -226,29 +234,41 @@ struct ht_ring_st {
    /* mutex values */
 #define HT_MUTEX_INITIALIZED        _BIT(0)
 #define HT_MUTEX_LOCKED             _BIT(1)
-#define HT_MUTEX_INIT               { {NULL, NULL}, HT_MUTEX_INITIALIZED, NULL, 0 }
+#define HT_MUTEX_FIFO               _BIT(2)  /* hand over to the longest waiter */
+#define HT_MUTEX_INHERIT            _BIT(3)  /* owner inherits waiter priority  */
+#define HT_MUTEX_INIT               { {NULL, NULL}, HT_MUTEX_INITIALIZED, NULL, 0, \
+                                       0, 0, 0, NULL, NULL, NULL, 0 }
 
    /* read-write lock values */
 enum { HT_RWLOCK_RD, HT_RWLOCK_RW };
 #define HT_RWLOCK_INITIALIZED       _BIT(0)
-#define HT_RWLOCK_INIT              { HT_RWLOCK_INITIALIZED, HT_RWLOCK_RD, 0, \
-                                       HT_MUTEX_INIT, HT_MUTEX_INIT }
+#define HT_RWLOCK_INIT              { HT_RWLOCK_INITIALIZED, 0, 0, \
+                                       NULL, NULL, NULL, NULL, NULL, 0 }
 
    /* condition variable values */
 #define HT_COND_INITIALIZED         _BIT(0)
 #define HT_COND_SIGNALED            _BIT(1)
 #define HT_COND_BROADCAST           _BIT(2)
 #define HT_COND_HANDLED             _BIT(3)
-#define HT_COND_INIT                { HT_COND_INITIALIZED, 0 }
+#define HT_COND_INIT                { HT_COND_INITIALIZED, 0, 0, NULL, NULL, NULL }
+#define HT_COND_ALL                 (-1)  /* notify all waiters */
 
    /* barrier variable values */
 #define HT_BARRIER_INITIALIZED      _BIT(0)
 #define HT_BARRIER_INIT(threshold)  { HT_BARRIER_INITIALIZED, \
                                        (threshold), (threshold), FALSE, \
-                                       HT_COND_INIT, HT_MUTEX_INIT }
+                                       0, NULL, NULL }
 #define HT_BARRIER_HEADLIGHT        (-1)
 #define HT_BARRIER_TAILLIGHT        (-2)
 
+   /* semaphore values */
+#define HT_SEM_INITIALIZED          _BIT(0)
+#define HT_SEM_INIT(value)          { HT_SEM_INITIALIZED, (value), 0, 0, NULL, NULL }
+
+   /* wait group values */
+#define HT_WAITGROUP_INITIALIZED    _BIT(0)
+#define HT_WAITGROUP_INIT           { HT_WAITGROUP_INITIALIZED, 0, 0, NULL, NULL }
+
     /* the message port structure */
 typedef struct ht_msgport_st *ht_msgport_t;
 struct ht_msgport_st;
@@ -262,6 +282,23 @@ struct ht_message_st { /* not hidden to allow inclusion */
     void          *m_data;
 };
 
+    /* the cleanup handler frame */
+typedef struct ht_cleanup_st ht_cleanup_t;
+struct ht_cleanup_st { /* not hidden to allow frames on the stack */
+    ht_cleanup_t  *next;
+    void         (*func)(void *);
+    void          *arg;
+    int            heap;           /* allocated by ht_cleanup_push()      */
+};
+
+    /* push and pop a cleanup handler in a frame on the caller's stack;
+       like pthread_cleanup_push/pop they must pair up in one block */
+#define HT_CLEANUP_PUSH(func, arg) \
+    { ht_cleanup_t _ht_cleanup_frame; \
+      ht_cleanup_link(&_ht_cleanup_frame, (func), (arg));
+#define HT_CLEANUP_POP(execute) \
+      ht_cleanup_unlink(&_ht_cleanup_frame, (execute)); }
+
     /* the mutex structure */
 typedef struct ht_mutex_st ht_mutex_t;
 struct ht_mutex_st { /* not hidden to avoid destructor */
@@ -269,16 +306,27 @@ struct ht_mutex_st { /* not hidden to avoid destructor */
     int            mx_state;
     ht_t          mx_owner;
     unsigned long  mx_count;
+    int            mx_qlock;       /* spin lock of the waiter queue        */
+    int            mx_nwait;       /* threads queued or about to queue     */
+    int            mx_spins;       /* adaptive spin estimate               */
+    void          *mx_qhead;       /* queue of parked waiters              */
+    void          *mx_qtail;
+    void          *mx_prof;        /* contention profiler site             */
+    unsigned long long mx_since;   /* start of a sampled hold              */
 };
 
     /* the read-write lock structure */
 typedef struct ht_rwlock_st ht_rwlock_t;
 struct ht_rwlock_st { /* not hidden to avoid destructor */
     int            rw_state;
-    unsigned int   rw_mode;
-    unsigned long  rw_readers;
-    ht_mutex_t    rw_mutex_rd;
-    ht_mutex_t    rw_mutex_rw;
+    unsigned long  rw_word;        /* writer and wait bits, reader count   */
+    int            rw_qlock;       /* spin lock of the waiter queues       */
+    void          *rw_rqhead;      /* queue of parked readers              */
+    void          *rw_rqtail;
+    void          *rw_wqhead;      /* queue of parked writers              */
+    void          *rw_wqtail;
+    void          *rw_prof;        /* contention profiler site             */
+    unsigned long long rw_since;   /* start of a sampled write hold        */
 };
 
     /* the condition variable structure */
@@ -286,6 +334,10 @@ typedef struct ht_cond_st ht_cond_t;
 struct ht_cond_st { /* not hidden to avoid destructor */
     unsigned long cn_state;
     unsigned int  cn_waiters;
+    int           cn_qlock;        /* spin lock of the waiter queue        */
+    void         *cn_qhead;        /* queue of parked waiters              */
+    void         *cn_qtail;
+    void         *cn_prof;         /* contention profiler site             */
 };
 
     /* the barrier variable structure */
@@ -294,21 +346,98 @@ struct ht_barrier_st { /* not hidden to avoid destructor */
     unsigned long br_state;
     int           br_threshold;
     int           br_count;
-    int           br_cycle;
-    ht_cond_t    br_cond;
-    ht_mutex_t   br_mutex;
+    int           br_cycle;        /* flipped by the last arrival          */
+    int           br_qlock;        /* spin lock of the waiter queue        */
+    void         *br_qhead;        /* queue of parked waiters              */
+    void         *br_qtail;
+};
+
+    /* the counting semaphore structure */
+typedef struct ht_sem_st ht_sem_t;
+struct ht_sem_st { /* not hidden to avoid destructor */
+    int            sm_state;
+    int            sm_count;       /* available units                      */
+    int            sm_qlock;       /* spin lock of the waiter queue        */
+    int            sm_nwait;       /* threads queued or about to queue     */
+    void          *sm_qhead;       /* queue of parked waiters              */
+    void          *sm_qtail;
 };
 
+    /* the wait group structure */
+typedef struct ht_waitgroup_st ht_waitgroup_t;
+struct ht_waitgroup_st { /* not hidden to avoid destructor */
+    int            wg_state;
+    int            wg_count;       /* outstanding work                     */
+    int            wg_qlock;       /* spin lock of the waiter queue        */
+    void          *wg_qhead;       /* queue of parked waiters              */
+    void          *wg_qtail;
+};
+
+    /* the worker task group structure */
+typedef struct ht_taskgroup_st *ht_taskgroup_t;
+struct ht_taskgroup_st;
+
+    /* the channel structure */
+typedef struct ht_chan_st *ht_chan_t;
+struct ht_chan_st;
+#define HT_CHAN_SEND                1
+#define HT_CHAN_RECV                2
+
+    /* the channel select operation */
+typedef struct ht_chan_op_st ht_chan_op_t;
+struct ht_chan_op_st {
+    ht_chan_t      co_chan;
+    int            co_dir;         /* HT_CHAN_SEND or HT_CHAN_RECV         */
+    void          *co_value;       /* value to send or value received      */
+    int            co_ok;          /* received: FALSE if channel closed    */
+};
+
+    /* the pipeline stage structure */
+typedef struct ht_stage_st *ht_stage_t;
+struct ht_stage_st;
+typedef void (*ht_stage_func_t)(ht_message_t **, int, void *);
+#define HT_STAGE_GREEN              0  /* handler runs on the stage's green threads */
+#define HT_STAGE_WORKER             1  /* handler runs on the worker pool           */
+
+    /* the pipeline stage statistics */
+typedef struct ht_stage_stats_st ht_stage_stats_t;
+struct ht_stage_stats_st {
+    int            ss_depth;       /* messages queued right now        */
+    int            ss_maxdepth;    /* high-water mark of the queue     */
+    unsigned long  ss_put;         /* messages accepted                */
+    unsigned long  ss_done;        /* messages handled                 */
+    unsigned long  ss_batches;     /* handler calls                    */
+    unsigned long  ss_blocked;     /* puts which had to wait for room  */
+    ht_time_t      ss_wait_avg;    /* time a message spent queued      */
+    ht_time_t      ss_wait_max;
+    ht_time_t      ss_run_avg;     /* time per handler call            */
+    ht_time_t      ss_run_max;
+};
+
+    /* the message buffer structure; it starts with a
+       message, so it can be put on message ports as it is */
+typedef struct ht_msgbuf_st *ht_msgbuf_t;
+struct ht_msgbuf_st;
+
+    /* the shared memory message port structure */
+typedef struct ht_shmport_st *ht_shmport_t;
+struct ht_shmport_st;
+
     /* the user-space context structure */
 typedef struct ht_uctx_st *ht_uctx_t;
 struct ht_uctx_st;
 
-    /* filedescriptor blocking modes */
+    /* filedescriptor blocking modes; HT_FDMODE_ASYNC is remembered per
+       filedescriptor number, so an async filedescriptor should be closed
+       with ht_close() or leave the mode with HT_FDMODE_BLOCK before it
+       is closed; otherwise the next one to get its number is taken as
+       async as long as it is non-blocking */
 enum {
     HT_FDMODE_ERROR = -1,
     HT_FDMODE_POLL  =  0,
     HT_FDMODE_BLOCK,
-    HT_FDMODE_NONBLOCK
+    HT_FDMODE_NONBLOCK,
+    HT_FDMODE_ASYNC         /* non-blocking underneath, blocking for ht_* calls */
 };
 
     /* optionally fake poll(2) data structure and options */
@@ -409,6 +538,8 @@ extern int            ht_resume(ht_t);
 extern int            ht_yield(ht_t);
 extern int            ht_nap(ht_time_t);
 extern int            ht_wait(ht_event_t);
+extern int            ht_set_deadline(ht_t, ht_time_t);
+extern int            ht_clear_deadline(ht_t);
 extern int            ht_cancel(ht_t);
 extern int            ht_abort(ht_t);
 extern int            ht_join(ht_t, void **);
@@ -446,24 +577,43 @@ extern ht_msgport_t  ht_msgport_find(const char *);
 extern int            ht_msgport_pending(ht_msgport_t);
 extern int            ht_msgport_put(ht_msgport_t, ht_message_t *);
 extern ht_message_t *ht_msgport_get(ht_msgport_t);
+extern int            ht_msgport_put_n(ht_msgport_t, ht_message_t **, int);
+extern int            ht_msgport_get_n(ht_msgport_t, ht_message_t **, int);
+extern int            ht_msgport_recv_n(ht_msgport_t, ht_message_t **, int, int, ht_time_t);
 extern int            ht_msgport_reply(ht_message_t *);
 
     /* cleanup handler functions */
 extern int            ht_cleanup_push(void (*)(void *), void *);
 extern int            ht_cleanup_pop(int);
+extern int            ht_cleanup_link(ht_cleanup_t *, void (*)(void *), void *);
+extern int            ht_cleanup_unlink(ht_cleanup_t *, int);
 
     /* synchronization functions */
 extern int            ht_mutex_init(ht_mutex_t *);
 extern int            ht_mutex_acquire(ht_mutex_t *, int, ht_event_t);
 extern int            ht_mutex_release(ht_mutex_t *);
+extern int            ht_mutex_setfifo(ht_mutex_t *, int);
+extern int            ht_mutex_setinherit(ht_mutex_t *, int);
+extern int            ht_mutex_setname(ht_mutex_t *, const char *);
 extern int            ht_rwlock_init(ht_rwlock_t *);
 extern int            ht_rwlock_acquire(ht_rwlock_t *, int, int, ht_event_t);
 extern int            ht_rwlock_release(ht_rwlock_t *);
+extern int            ht_rwlock_setname(ht_rwlock_t *, const char *);
 extern int            ht_cond_init(ht_cond_t *);
 extern int            ht_cond_await(ht_cond_t *, ht_mutex_t *, ht_event_t);
 extern int            ht_cond_notify(ht_cond_t *, int);
+extern int            ht_cond_notify_n(ht_cond_t *, int);
+extern int            ht_cond_setname(ht_cond_t *, const char *);
 extern int            ht_barrier_init(ht_barrier_t *, int);
 extern int            ht_barrier_reach(ht_barrier_t *);
+extern int            ht_sem_init(ht_sem_t *, int);
+extern int            ht_sem_acquire(ht_sem_t *, int, ht_event_t);
+extern int            ht_sem_release(ht_sem_t *, int);
+extern int            ht_sem_value(ht_sem_t *);
+extern int            ht_waitgroup_init(ht_waitgroup_t *);
+extern int            ht_waitgroup_add(ht_waitgroup_t *, int);
+extern int            ht_waitgroup_done(ht_waitgroup_t *);
+extern int            ht_waitgroup_wait(ht_waitgroup_t *, ht_event_t);
 
     /* user-space context functions */
 extern int            ht_uctx_create(ht_uctx_t *);
@@ -507,11 +657,53 @@ extern ssize_t        ht_recvfrom(int, void *, size_t, int, struct sockaddr *, s
 extern ssize_t        ht_sendto(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
 extern ssize_t        ht_pread(int, void *, size_t, off_t);
 extern ssize_t        ht_pwrite(int, const void *, size_t, off_t);
+extern int            ht_close(int);
     
     /* hybird thread interaction functions */
 extern int            ht_hand_out();
 extern int            ht_get_back();
 
+    /* worker pool functions */
+extern ht_taskgroup_t ht_taskgroup_create(void);
+extern int            ht_taskgroup_spawn(ht_taskgroup_t, void (*)(void *), void *);
+extern int            ht_taskgroup_wait(ht_taskgroup_t);
+extern int            ht_taskgroup_destroy(ht_taskgroup_t);
+extern int            ht_parallel_for(long, long, long, void (*)(long, long, void *), void *);
+
+    /* channel functions */
+extern ht_chan_t      ht_chan_create(int);
+extern int            ht_chan_send(ht_chan_t, void *, int);
+extern int            ht_chan_recv(ht_chan_t, void **, int);
+extern int            ht_chan_select(ht_chan_op_t *, int, int);
+extern int            ht_chan_close(ht_chan_t);
+extern int            ht_chan_pending(ht_chan_t);
+extern int            ht_chan_destroy(ht_chan_t);
+
+    /* pipeline stage functions */
+extern ht_stage_t     ht_stage_create(const char *, ht_stage_func_t, void *, int, int, int, int);
+extern int            ht_stage_put(ht_stage_t, ht_message_t *, int);
+extern int            ht_stage_stats(ht_stage_t, ht_stage_stats_t *);
+extern int            ht_stage_destroy(ht_stage_t);
+
+    /* message buffer functions */
+extern ht_msgbuf_t    ht_msgbuf_alloc(size_t);
+extern ht_msgbuf_t    ht_msgbuf_slice(ht_msgbuf_t, size_t, size_t);
+extern ht_msgbuf_t    ht_msgbuf_ref(ht_msgbuf_t);
+extern int            ht_msgbuf_resize(ht_msgbuf_t, size_t);
+extern void          *ht_msgbuf_data(ht_msgbuf_t);
+extern size_t         ht_msgbuf_size(ht_msgbuf_t);
+extern void           ht_msgbuf_free(ht_msgbuf_t);
+extern ssize_t        ht_msgbuf_read(int, ht_msgbuf_t);
+extern ssize_t        ht_msgbuf_writev(int, ht_msgbuf_t *, int);
+
+    /* shared memory message port functions */
+extern ht_shmport_t   ht_shmport_open(const char *, int, size_t);
+extern int            ht_shmport_send(ht_shmport_t, const void *, size_t, int);
+extern ssize_t        ht_shmport_recv(ht_shmport_t, void *, size_t, int);
+extern int            ht_shmport_pending(ht_shmport_t);
+extern int            ht_shmport_close(ht_shmport_t);
+extern int            ht_shmport_unlink(const char *);
+
 END_DECLARATION
 
     /* backward compatibility (Pth < 1.5.0) */
@@ -49,6 +49,7 @@ ht_attr_init(ht_attr_t a)
     a->a_cancelstate = HT_CANCEL_DEFAULT;
     a->a_stacksize = 64*1024;
     a->a_stackaddr = NULL;
+    a->a_timerslack = -1;
     return TRUE;
 }
 
@@ -85,9 +86,16 @@ ht_attr_ctrl(int cmd, ht_attr_t a, int op, va_list ap)
         case HT_ATTR_PRIO: {
             /* priority */
             int val, *src, *dst;
+            if (cmd == HT_ATTR_SET && a->a_tid != NULL) {
+                /* only the base, a priority lent through mutexes
+                   stays in effect until it is given back */
+                a->a_tid->prio_base = va_arg(ap, int);
+                ht_mutex_inherit(a->a_tid);
+                break;
+            }
             if (cmd == HT_ATTR_SET) {
                 src = &val; val = va_arg(ap, int);
-                dst = (a->a_tid != NULL ? &a->a_tid->prio : &a->a_prio);
+                dst = &a->a_prio;
             }
             else {
                 src = (a->a_tid != NULL ? &a->a_tid->prio : &a->a_prio);
@@ -267,6 +275,22 @@ ht_attr_ctrl(int cmd, ht_attr_t a, int op, va_list ap)
             *dst = (a->a_tid != NULL ? TRUE : FALSE);
             break;
         }
+        case HT_ATTR_TIMER_SLACK: {
+            /* timer slack */
+            int val, *src, *dst;
+            if (cmd == HT_ATTR_SET) {
+                src = &val; val = va_arg(ap, int);
+                if (val < -1)
+                    return ht_error(FALSE, EINVAL);
+                dst = (a->a_tid != NULL ? &a->a_tid->timerslack : &a->a_timerslack);
+            }
+            else {
+                src = (a->a_tid != NULL ? &a->a_tid->timerslack : &a->a_timerslack);
+                dst = va_arg(ap, int *);
+            }
+            *dst = *src;
+            break;
+        }
         default:
             return ht_error(FALSE, EINVAL);
     }
@@ -0,0 +1,329 @@
+/*
+ *  bounded channels
+ *  Go-style channels passing pointers. A channel has a fixed capacity
+ *  (zero makes every send a rendezvous). A value meeting a parked
+ *  peer is handed over directly, without passing the buffer. Green
+ *  threads park as waiting threads, handed-out threads and worker
+ *  jobs park their kernel thread.
+ */
+
+#include "ht_p.h"
+
+/* one pending operation of a parked thread on a channel */
+typedef struct ht_chan_entry_st ht_chan_entry_t;
+struct ht_chan_entry_st {
+    ht_ringnode_t  ce_node;             /* must be first                */
+    ht_chan_t      ce_chan;
+    ht_waiter_t   *ce_waiter;
+    int            ce_dir;              /* HT_CHAN_SEND or HT_CHAN_RECV */
+    int            ce_index;            /* index of the select operation */
+    void          *ce_value;            /* value to send                */
+};
+
+/* create a channel */
+ht_chan_t
+ht_chan_create(int capacity)
+{
+    ht_chan_t ch;
+
+    if (capacity < 0)
+        return ht_error((ht_chan_t)NULL, EINVAL);
+    if ((ch = (ht_chan_t)malloc(sizeof(struct ht_chan_st))) == NULL)
+        return ht_error((ht_chan_t)NULL, ENOMEM);
+    if ((ch->ch_buf = (void **)malloc(sizeof(void *) * (capacity > 0 ? capacity : 1))) == NULL) {
+        free(ch);
+        return ht_error((ht_chan_t)NULL, ENOMEM);
+    }
+    ch->ch_size   = capacity;
+    ch->ch_head   = 0;
+    ch->ch_count  = 0;
+    ch->ch_closed = FALSE;
+    ht_ring_init(&ch->ch_sendq);
+    ht_ring_init(&ch->ch_recvq);
+    return ch;
+}
+
+/* pop the first entry whose waiter was not yet woken by another channel */
+static ht_chan_entry_t *
+ht_chan_dequeue(ht_ring_t *q)
+{
+    ht_chan_entry_t *ce;
+
+    while ((ce = (ht_chan_entry_t *)ht_ring_pop(q)) != NULL)
+        if (ce->ce_waiter->w_index == -1)
+            return ce;
+    return NULL;
+}
+
+/* complete the operation of a parked peer */
+static void
+ht_chan_complete(ht_chan_entry_t *ce, void *value, int result)
+{
+    ce->ce_waiter->w_index  = ce->ce_index;
+    ce->ce_waiter->w_data   = value;
+    ce->ce_waiter->w_result = result;
+    ht_waiter_wake(ce->ce_waiter);
+    return;
+}
+
+/* try a single operation without parking */
+static int
+ht_chan_try(ht_chan_op_t *op)
+{
+    ht_chan_t ch = op->co_chan;
+    ht_chan_entry_t *ce;
+
+    if (op->co_dir == HT_CHAN_SEND) {
+        if (ch->ch_closed)
+            return ht_error(FALSE, EPIPE);
+        if ((ce = ht_chan_dequeue(&ch->ch_recvq)) != NULL) {
+            /* direct handoff to a parked receiver */
+            ht_chan_complete(ce, op->co_value, TRUE);
+            return TRUE;
+        }
+        if (ch->ch_count < ch->ch_size) {
+            ch->ch_buf[(ch->ch_head + ch->ch_count) % ch->ch_size] = op->co_value;
+            ch->ch_count++;
+            return TRUE;
+        }
+    }
+    else {
+        if (ch->ch_count > 0) {
+            op->co_value = ch->ch_buf[ch->ch_head];
+            op->co_ok = TRUE;
+            ch->ch_head = (ch->ch_head + 1) % ch->ch_size;
+            ch->ch_count--;
+            /* refill from a parked sender */
+            if ((ce = ht_chan_dequeue(&ch->ch_sendq)) != NULL) {
+                ch->ch_buf[(ch->ch_head + ch->ch_count) % ch->ch_size] = ce->ce_value;
+                ch->ch_count++;
+                ht_chan_complete(ce, NULL, TRUE);
+            }
+            return TRUE;
+        }
+        if ((ce = ht_chan_dequeue(&ch->ch_sendq)) != NULL) {
+            /* direct handoff from a parked sender */
+            op->co_value = ce->ce_value;
+            op->co_ok = TRUE;
+            ht_chan_complete(ce, NULL, TRUE);
+            return TRUE;
+        }
+        if (ch->ch_closed) {
+            op->co_value = NULL;
+            op->co_ok = FALSE;
+            return TRUE;
+        }
+    }
+    return ht_error(FALSE, EAGAIN);
+}
+
+/* withdraw the still queued operations of a parked thread */
+static void
+ht_chan_withdraw(ht_chan_entry_t *ce, int n)
+{
+    ht_ring_t *q;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        q = (ce[i].ce_dir == HT_CHAN_RECV ? &ce[i].ce_chan->ch_recvq : &ce[i].ce_chan->ch_sendq);
+        if (ht_ring_contains(q, &ce[i].ce_node))
+            ht_ring_delete(q, &ce[i].ce_node);
+    }
+    return;
+}
+
+/* cleanup handler for a green thread cancelled while parked */
+typedef struct {
+    ht_chan_entry_t *ce;
+    int              n;
+} ht_chan_cleanup_t;
+
+static void
+ht_chan_cleanup_handler(void *_cc)
+{
+    ht_chan_cleanup_t *cc = (ht_chan_cleanup_t *)_cc;
+
+    ht_chan_withdraw(cc->ce, cc->n);
+    return;
+}
+
+/* perform the first operation which can proceed, parking until one can */
+int
+ht_chan_select(ht_chan_op_t *ops, int n, int tryonly)
+{
+    ht_chan_entry_t ce[n > 0 ? n : 1];
+    ht_chan_cleanup_t cc;
+    ht_cleanup_t cleanup;
+    ht_waiter_t w;
+    int lent, done, rc, err, i;
+
+    /* consistency checks */
+    if (ops == NULL || n <= 0)
+        return ht_error(-1, EINVAL);
+    for (i = 0; i < n; i++)
+        if (   ops[i].co_chan == NULL
+            || (ops[i].co_dir != HT_CHAN_SEND && ops[i].co_dir != HT_CHAN_RECV))
+            return ht_error(-1, EINVAL);
+
+    /* off the scheduler's kernel thread borrow its floor */
+    lent = !ht_sched_here;
+    if (lent)
+        ht_sched_enter();
+
+    /* first see whether some operation can proceed right now */
+    for (i = 0; i < n; i++)
+        if ((done = ht_chan_try(&ops[i])) || errno != EAGAIN)
+            break;
+    if (i < n) {
+        rc  = (done ? i : -1);
+        err = errno;
+        goto leave;
+    }
+    if (tryonly) {
+        rc  = -1;
+        err = EAGAIN;
+        goto leave;
+    }
+
+    /* queue us on all channels and park */
+    ht_waiter_init(&w);
+    if (!lent && w.w_ev == NULL) {
+        rc  = -1;
+        err = errno;
+        goto leave;
+    }
+    for (i = 0; i < n; i++) {
+        ce[i].ce_chan   = ops[i].co_chan;
+        ce[i].ce_waiter = &w;
+        ce[i].ce_index  = i;
+        ce[i].ce_dir    = ops[i].co_dir;
+        ce[i].ce_value  = ops[i].co_value;
+        if (ops[i].co_dir == HT_CHAN_SEND)
+            ht_ring_append(&ops[i].co_chan->ch_sendq, &ce[i].ce_node);
+        else
+            ht_ring_append(&ops[i].co_chan->ch_recvq, &ce[i].ce_node);
+    }
+    if (lent) {
+        ht_sched_leave(FALSE);
+        ht_waiter_park(&w);
+        ht_sched_enter();
+    }
+    else {
+        /* only green threads are bounded by their deadline; peers
+           complete us on the scheduler's kernel thread, so once we
+           run again nobody can do so behind our back */
+        cc.ce = ce;
+        cc.n  = n;
+        ht_cleanup_link(&cleanup, ht_chan_cleanup_handler, &cc);
+        while (!__atomic_load_n(&w.w_woken, __ATOMIC_ACQUIRE))
+            if (ht_wait(w.w_ev) < 0)
+                break;
+        ht_cleanup_unlink(&cleanup, FALSE);
+    }
+    ht_chan_withdraw(ce, n);
+    if (w.w_index == -1) {
+        rc  = -1;
+        err = ETIMEDOUT;
+        goto leave;
+    }
+
+    /* pick up the result the waker left for us */
+    rc = i = w.w_index;
+    err = 0;
+    if (ops[i].co_dir == HT_CHAN_SEND) {
+        if (!w.w_result) {
+            rc  = -1;
+            err = EPIPE;
+        }
+    }
+    else {
+        ops[i].co_value = w.w_data;
+        ops[i].co_ok    = w.w_result;
+    }
+
+    leave:
+    if (lent)
+        ht_sched_leave(FALSE);
+    if (rc == -1)
+        return ht_error(-1, err);
+    return rc;
+}
+
+/* send a value, parking while the channel is full */
+int
+ht_chan_send(ht_chan_t ch, void *value, int tryonly)
+{
+    ht_chan_op_t op;
+
+    op.co_chan  = ch;
+    op.co_dir   = HT_CHAN_SEND;
+    op.co_value = value;
+    return (ht_chan_select(&op, 1, tryonly) == 0);
+}
+
+/* receive a value, parking while the channel is empty; FALSE
+   with EPIPE once the channel is closed and drained */
+int
+ht_chan_recv(ht_chan_t ch, void **value, int tryonly)
+{
+    ht_chan_op_t op;
+
+    op.co_chan = ch;
+    op.co_dir  = HT_CHAN_RECV;
+    if (ht_chan_select(&op, 1, tryonly) != 0)
+        return FALSE;
+    if (!op.co_ok)
+        return ht_error(FALSE, EPIPE);
+    if (value != NULL)
+        *value = op.co_value;
+    return TRUE;
+}
+
+/* close a channel: senders fail, receivers drain the buffer */
+int
+ht_chan_close(ht_chan_t ch)
+{
+    ht_chan_entry_t *ce;
+    int lent;
+
+    if (ch == NULL)
+        return ht_error(FALSE, EINVAL);
+    lent = !ht_sched_here;
+    if (lent)
+        ht_sched_enter();
+    if (ch->ch_closed) {
+        if (lent)
+            ht_sched_leave(FALSE);
+        return ht_error(FALSE, EPIPE);
+    }
+    ch->ch_closed = TRUE;
+    while ((ce = ht_chan_dequeue(&ch->ch_recvq)) != NULL)
+        ht_chan_complete(ce, NULL, FALSE);
+    while ((ce = ht_chan_dequeue(&ch->ch_sendq)) != NULL)
+        ht_chan_complete(ce, NULL, FALSE);
+    if (lent)
+        ht_sched_leave(FALSE);
+    return TRUE;
+}
+
+/* number of buffered values */
+int
+ht_chan_pending(ht_chan_t ch)
+{
+    if (ch == NULL)
+        return ht_error(-1, EINVAL);
+    return __atomic_load_n(&ch->ch_count, __ATOMIC_RELAXED);
+}
+
+/* delete a channel nobody is parked on */
+int
+ht_chan_destroy(ht_chan_t ch)
+{
+    if (ch == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (ht_ring_elements(&ch->ch_sendq) > 0 || ht_ring_elements(&ch->ch_recvq) > 0)
+        return ht_error(FALSE, EBUSY);
+    free(ch->ch_buf);
+    free(ch);
+    return TRUE;
+}
@@ -0,0 +1,117 @@
+#include "ht_p.h"
+#include "ht_test.h"
+
+/* test buffering, order, tryonly and close */
+void
+test1()
+{
+   ht_chan_t ch = ht_chan_create(2);
+   void *v;
+
+   HT_TEST_ASSERT(ht_chan_send(ch, (void *)1, TRUE), "send to buffer failed.");
+   HT_TEST_ASSERT(ht_chan_send(ch, (void *)2, TRUE), "send to buffer failed.");
+   HT_TEST_ASSERT(!ht_chan_send(ch, (void *)3, TRUE) && errno == EAGAIN,
+                  "send to a full channel did not fail.");
+   HT_TEST_ASSERT(ht_chan_pending(ch) == 2, "ht_chan_pending() is wrong.");
+   ht_chan_close(ch);
+   HT_TEST_ASSERT(!ht_chan_send(ch, (void *)3, FALSE) && errno == EPIPE,
+                  "send to a closed channel did not fail.");
+   HT_TEST_ASSERT(ht_chan_recv(ch, &v, FALSE) && v == (void *)1, "recv out of order.");
+   HT_TEST_ASSERT(ht_chan_recv(ch, &v, FALSE) && v == (void *)2, "recv out of order.");
+   HT_TEST_ASSERT(!ht_chan_recv(ch, &v, FALSE) && errno == EPIPE,
+                  "recv from a closed and drained channel did not fail.");
+   HT_TEST_ASSERT(ht_chan_destroy(ch), "ht_chan_destroy() failed.");
+}
+
+/* test rendezvous and select between green threads */
+static void *
+test2_producer(void *arg)
+{
+   ht_chan_t *ch = (ht_chan_t *)arg;
+   long i;
+
+   for(i = 1; i <= 100; i++)
+      ht_chan_send(ch[i % 2], (void *)i, FALSE);
+   ht_chan_close(ch[0]);
+   ht_chan_close(ch[1]);
+   return NULL;
+}
+
+void
+test2()
+{
+   ht_chan_t ch[2];
+   ht_chan_op_t ops[2];
+   ht_t t;
+   long sum = 0;
+   int open = 2;
+   int i;
+
+   ch[0] = ht_chan_create(0);
+   ch[1] = ht_chan_create(0);
+   t = ht_spawn(HT_ATTR_DEFAULT, test2_producer, ch);
+   while(open > 0)
+   {
+      ops[0].co_chan = ch[0]; ops[0].co_dir = HT_CHAN_RECV;
+      ops[1].co_chan = ch[1]; ops[1].co_dir = HT_CHAN_RECV;
+      i = ht_chan_select(ops, 2, FALSE);
+      HT_TEST_ASSERT(i == 0 || i == 1, "ht_chan_select() failed.");
+      if(ops[i].co_ok)
+         sum += (long)ops[i].co_value;
+      else
+         open--;
+   }
+   HT_TEST_ASSERT(sum == 5050, "ht_chan_select() lost values.");
+   ht_join(t, NULL);
+   ht_chan_destroy(ch[0]);
+   ht_chan_destroy(ch[1]);
+}
+
+/* test handoff between a worker and a green thread */
+static void *
+test3_echo(void *arg)
+{
+   ht_chan_t *ch = (ht_chan_t *)arg;
+   void *v;
+
+   while(ht_chan_recv(ch[0], &v, FALSE))
+      ht_chan_send(ch[1], v, FALSE);
+   return NULL;
+}
+
+void
+test3()
+{
+   ht_chan_t ch[2];
+   ht_t t;
+   void *v;
+   long i;
+   int ok = TRUE;
+
+   ch[0] = ht_chan_create(0);
+   ch[1] = ht_chan_create(1);
+   t = ht_spawn(HT_ATTR_DEFAULT, test3_echo, ch);
+   ht_hand_out();
+   for(i = 1; i <= 50; i++)
+   {
+      ok = ok && ht_chan_send(ch[0], (void *)i, FALSE);
+      ok = ok && ht_chan_recv(ch[1], &v, FALSE) && v == (void *)i;
+   }
+   ht_chan_close(ch[0]);
+   ht_get_back();
+   HT_TEST_ASSERT(ok, "channel handoff with a worker failed.");
+   ht_join(t, NULL);
+   ht_chan_destroy(ch[0]);
+   ht_chan_destroy(ch[1]);
+}
+
+int
+main()
+{
+   ht_init();
+   test1();
+   test2();
+   test3();
+   ht_kill();
+   return 0;
+}
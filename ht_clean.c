@@ -1,5 +1,37 @@
 #include "ht_p.h"
 
+/*
+ * Cleanup handlers live in frames linked into a per-thread stack. The
+ * frames of ht_cleanup_link() belong to the caller, usually on its own
+ * stack. ht_cleanup_push() takes a frame from the thread's free list
+ * and ht_cleanup_pop() returns it there, so only the deepest nesting
+ * a thread ever reached costs allocations.
+ */
+
+int
+ht_cleanup_link(ht_cleanup_t *cleanup, void (*func)(void *), void *arg)
+{
+    if (cleanup == NULL || func == NULL)
+        return ht_error(FALSE, EINVAL);
+    cleanup->func = func;
+    cleanup->arg  = arg;
+    cleanup->heap = FALSE;
+    cleanup->next = ht_current->cleanups;
+    ht_current->cleanups = cleanup;
+    return TRUE;
+}
+
+int
+ht_cleanup_unlink(ht_cleanup_t *cleanup, int execute)
+{
+    if (cleanup == NULL || ht_current->cleanups != cleanup)
+        return ht_error(FALSE, EINVAL);
+    ht_current->cleanups = cleanup->next;
+    if (execute)
+        cleanup->func(cleanup->arg);
+    return TRUE;
+}
+
 int 
 ht_cleanup_push(void (*func)(void *), void *arg)
 {
@@ -7,12 +39,12 @@ ht_cleanup_push(void (*func)(void *), void *arg)
 
     if (func == NULL)
         return ht_error(FALSE, EINVAL);
-    if ((cleanup = (ht_cleanup_t *)malloc(sizeof(ht_cleanup_t))) == NULL)
+    if ((cleanup = ht_current->cleanfree) != NULL)
+        ht_current->cleanfree = cleanup->next;
+    else if ((cleanup = (ht_cleanup_t *)malloc(sizeof(ht_cleanup_t))) == NULL)
         return ht_error(FALSE, ENOMEM);
-    cleanup->func = func;
-    cleanup->arg  = arg;
-    cleanup->next = ht_current->cleanups;
-    ht_current->cleanups = cleanup;
+    ht_cleanup_link(cleanup, func, arg);
+    cleanup->heap = TRUE;
     return TRUE;
 }
 
@@ -27,7 +59,10 @@ ht_cleanup_pop(int execute)
         ht_current->cleanups = cleanup->next;
         if (execute)
             cleanup->func(cleanup->arg);
-        free(cleanup);
+        if (cleanup->heap) {
+            cleanup->next = ht_current->cleanfree;
+            ht_current->cleanfree = cleanup;
+        }
         rc = TRUE;
     }
     return rc;
@@ -42,8 +77,23 @@ ht_cleanup_popall(ht_t t, int execute)
         t->cleanups = cleanup->next;
         if (execute)
             cleanup->func(cleanup->arg);
-        free(cleanup);
+        if (cleanup->heap) {
+            cleanup->next = t->cleanfree;
+            t->cleanfree = cleanup;
+        }
     }
     return;
 }
 
+/* release the recycled frames of a thread */
+void
+ht_cleanup_drop(ht_t t)
+{
+    ht_cleanup_t *cleanup;
+
+    while ((cleanup = t->cleanfree) != NULL) {
+        t->cleanfree = cleanup->next;
+        free(cleanup);
+    }
+    return;
+}
@@ -1,57 +1,127 @@
 #include "ht_p.h"
 
+/*
+ * The key table grows in chunks up to HT_KEY_MAX keys, so a key's slot
+ * never moves. A thread's values form a dense array which only covers
+ * keys up to the highest one the thread has set. It is followed by a
+ * bitmap of the keys which hold a value, so destructors visit only
+ * those. Handed-out threads read the key table without a lock, so a
+ * new chunk, the table size and a slot's used flag are published with
+ * release stores and read with acquire loads.
+ */
+
+#define HT_KEYTAB_CHUNK   64
+#define HT_KEYTAB_CHUNKS  (HT_KEY_MAX / HT_KEYTAB_CHUNK)
+#define HT_DATA_MINSIZE   8
+#define HT_DATA_WORDBITS  (8 * sizeof(unsigned long))
+
 struct ht_keytab_st {
     int used;
     void (*destructor)(void *);
 };
 
-static struct ht_keytab_st ht_keytab[HT_KEY_MAX];
+static struct ht_keytab_st *ht_keytab[HT_KEYTAB_CHUNKS];
+static int ht_keytab_size = 0;
+
+#define ht_keytab_slot(key) \
+    (&__atomic_load_n(&ht_keytab[(key) / HT_KEYTAB_CHUNK], __ATOMIC_ACQUIRE) \
+      [(key) % HT_KEYTAB_CHUNK])
+#define ht_key_valid(key) \
+    (   (key) >= 0 \
+     && (key) < __atomic_load_n(&ht_keytab_size, __ATOMIC_ACQUIRE) \
+     && __atomic_load_n(&ht_keytab_slot(key)->used, __ATOMIC_ACQUIRE))
 
 int 
 ht_key_create(ht_key_t *key, void (*func)(void *))
 {
+    struct ht_keytab_st *chunk;
+
     if (key == NULL)
         return ht_error(FALSE, EINVAL);
-    for ((*key) = 0; (*key) < HT_KEY_MAX; (*key)++) {
-        if (ht_keytab[(*key)].used == FALSE) {
-            ht_keytab[(*key)].used = TRUE;
-            ht_keytab[(*key)].destructor = func;
-            return TRUE;
-        }
+    for ((*key) = 0; (*key) < ht_keytab_size; (*key)++)
+        if (!ht_keytab_slot(*key)->used)
+            break;
+    if ((*key) == ht_keytab_size) {
+        if (ht_keytab_size == HT_KEY_MAX)
+            return ht_error(FALSE, EAGAIN);
+        chunk = (struct ht_keytab_st *)calloc(HT_KEYTAB_CHUNK, sizeof(struct ht_keytab_st));
+        if (chunk == NULL)
+            return ht_error(FALSE, ENOMEM);
+        __atomic_store_n(&ht_keytab[ht_keytab_size / HT_KEYTAB_CHUNK], chunk,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&ht_keytab_size, ht_keytab_size + HT_KEYTAB_CHUNK,
+                         __ATOMIC_RELEASE);
     }
-    return ht_error(FALSE, EAGAIN);
+    ht_keytab_slot(*key)->destructor = func;
+    __atomic_store_n(&ht_keytab_slot(*key)->used, TRUE, __ATOMIC_RELEASE);
+    return TRUE;
 }
 
 int 
 ht_key_delete(ht_key_t key)
 {
-    if (key < 0 || key >= HT_KEY_MAX)
+    if (key < 0 || key >= ht_keytab_size)
         return ht_error(FALSE, EINVAL);
-    if (!ht_keytab[key].used)
+    if (!ht_keytab_slot(key)->used)
         return ht_error(FALSE, ENOENT);
-    ht_keytab[key].used = FALSE;
+    __atomic_store_n(&ht_keytab_slot(key)->used, FALSE, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/* let the value array of a thread cover a key */
+static int
+ht_key_grow(ht_t t, ht_key_t key)
+{
+    const void **value;
+    unsigned long *used;
+    int size, words;
+
+    for (size = HT_DATA_MINSIZE; size <= key; size *= 2)
+        ;
+    words = (size + HT_DATA_WORDBITS - 1) / HT_DATA_WORDBITS;
+    value = (const void **)calloc(1, sizeof(void *) * size + sizeof(unsigned long) * words);
+    if (value == NULL)
+        return FALSE;
+    used = (unsigned long *)(value + size);
+    if (t->data_value != NULL) {
+        memcpy(value, t->data_value, sizeof(void *) * t->data_size);
+        memcpy(used, t->data_used, sizeof(unsigned long)
+               * ((t->data_size + HT_DATA_WORDBITS - 1) / HT_DATA_WORDBITS));
+        free(t->data_value);
+    }
+    t->data_value = value;
+    t->data_used  = used;
+    t->data_size  = size;
     return TRUE;
 }
 
 int 
 ht_key_setdata(ht_key_t key, const void *value)
 {
+    unsigned long bit;
+
     if (key < 0 || key >= HT_KEY_MAX)
         return ht_error(FALSE, EINVAL);
-    if (!ht_keytab[key].used)
+    if (!ht_key_valid(key))
         return ht_error(FALSE, ENOENT);
-    if (ht_current->data_value == NULL) {
-        ht_current->data_value = (const void **)calloc(1, sizeof(void *)*HT_KEY_MAX);
-        if (ht_current->data_value == NULL)
+    if (key >= ht_current->data_size) {
+        if (value == NULL)
+            return TRUE;
+        if (!ht_key_grow(ht_current, key))
             return ht_error(FALSE, ENOMEM);
     }
+    bit = 1UL << (key % HT_DATA_WORDBITS);
     if (ht_current->data_value[key] == NULL) {
-        if (value != NULL)
+        if (value != NULL) {
             ht_current->data_count++;
+            ht_current->data_used[key / HT_DATA_WORDBITS] |= bit;
+        }
     }
     else {
-        if (value == NULL)
+        if (value == NULL) {
             ht_current->data_count--;
+            ht_current->data_used[key / HT_DATA_WORDBITS] &= ~bit;
+        }
     }
     ht_current->data_value[key] = value;
     return TRUE;
@@ -62,9 +132,9 @@ ht_key_getdata(ht_key_t key)
 {
     if (key < 0 || key >= HT_KEY_MAX)
         return ht_error((void *)NULL, EINVAL);
-    if (!ht_keytab[key].used)
+    if (!ht_key_valid(key))
         return ht_error((void *)NULL, ENOENT);
-    if (ht_current->data_value == NULL)
+    if (key >= ht_current->data_size)
         return (void *)NULL;
     return (void *)ht_current->data_value[key];
 }
@@ -73,8 +143,10 @@ void
 ht_key_destroydata(ht_t t)
 {
     void *data;
+    unsigned long bits;
     int key;
     int itr;
+    int w, words;
     void (*destructor)(void *);
 
     if (t == NULL)
@@ -82,30 +154,29 @@ ht_key_destroydata(ht_t t)
     if (t->data_value == NULL)
         return;
     /* POSIX thread iteration scheme */
-    for (itr = 0; itr < HT_DESTRUCTOR_ITERATIONS; itr++) {
-        for (key = 0; key < HT_KEY_MAX; key++) {
-            if (t->data_count > 0) {
-                destructor = NULL;
-                data = NULL;
-                if (ht_keytab[key].used) {
-                    if (t->data_value[key] != NULL) {
-                        data = (void *)t->data_value[key];
-                        t->data_value[key] = NULL;
-                        t->data_count--;
-                        destructor = ht_keytab[key].destructor;
-                    }
-                }
+    for (itr = 0; itr < HT_DESTRUCTOR_ITERATIONS && t->data_count > 0; itr++) {
+        words = (t->data_size + HT_DATA_WORDBITS - 1) / HT_DATA_WORDBITS;
+        for (w = 0; w < words && t->data_count > 0; w++) {
+            /* destructors may set values again, which the
+               next iteration picks up from the bitmap */
+            bits = t->data_used[w];
+            t->data_used[w] = 0;
+            while (bits != 0) {
+                key = w * HT_DATA_WORDBITS + __builtin_ctzl(bits);
+                bits &= bits - 1;
+                data = (void *)t->data_value[key];
+                t->data_value[key] = NULL;
+                t->data_count--;
+                destructor = (ht_key_valid(key) ? ht_keytab_slot(key)->destructor : NULL);
                 if (destructor != NULL)
                     destructor(data);
             }
-            if (t->data_count == 0)
-                break;
         }
-        if (t->data_count == 0)
-            break;
     }
     free(t->data_value);
     t->data_value = NULL;
+    t->data_used  = NULL;
+    t->data_size  = 0;
+    t->data_count = 0;
     return;
 }
-
@@ -107,6 +107,7 @@ ht_event(unsigned long spec, ...)
         ev->ev_type = HT_EVENT_MSG;
         ev->ev_goal = (int)(spec & (HT_UNTIL_OCCURRED));
         ev->ev_args.MSG.mp = mp;
+        ev->ev_args.MSG.min = 1;
     }
     else if (spec & HT_EVENT_MUTEX) {
         /* mutual exclusion lock */
@@ -329,15 +330,36 @@ ht_event_free(ht_event_t ev, int mode)
 /* wait for one or more events */
 int 
 ht_wait(ht_event_t ev_ring)
+{
+    return ht_event_wait(ev_ring, TRUE);
+}
+
+/* wait for one or more events; with timed set the thread's deadline
+   fails the wait with ETIMEDOUT once it passes before any event */
+int
+ht_event_wait(ht_event_t ev_ring, int timed)
 {
     int nonpending;
     ht_event_t ev;
+    ht_time_t now;
 
     /* at least a waiting ring is required */
     if (ev_ring == NULL)
         return ht_error(-1, EINVAL);
+    /* only the scheduler's kernel thread can dispatch events */
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(-1, EPERM);
     ht_debug2("ht_wait: enter from thread \"%s\"", ht_current->name);
 
+    /* a deadline which already passed fails without a context switch */
+    if (timed && ht_time_cmp(&ht_current->deadline, HT_TIME_ZERO) == 0)
+        timed = FALSE;
+    if (timed) {
+        ht_time_set(&now, HT_TIME_NOW);
+        if (ht_time_cmp(&ht_current->deadline, &now) <= 0)
+            return ht_error(-1, ETIMEDOUT);
+    }
+
     /* mark all events in waiting ring as still pending */
     ev = ev_ring;
     do {
@@ -348,6 +370,7 @@ ht_wait(ht_event_t ev_ring)
 
     /* link event ring to current thread */
     ht_current->events = ev_ring;
+    ht_current->deadline_wait = timed;
 
     /* move thread into waiting state
        and transfer control to scheduler */
@@ -359,6 +382,7 @@ ht_wait(ht_event_t ev_ring)
 
     /* unlink event ring from current thread */
     ht_current->events = NULL;
+    ht_current->deadline_wait = FALSE;
 
     /* count number of actually occurred (or failed) events */
     ev = ev_ring;
@@ -371,6 +395,13 @@ ht_wait(ht_event_t ev_ring)
         ev = ev->ev_next;
     } while (ev != ev_ring);
 
+    /* the deadline passed before any event occurred */
+    if (nonpending == 0 && timed) {
+        ht_time_set(&now, HT_TIME_NOW);
+        if (ht_time_cmp(&ht_current->deadline, &now) <= 0)
+            return ht_error(-1, ETIMEDOUT);
+    }
+
     /* leave to current thread with number of occurred events */
     ht_debug2("ht_wait: leave to thread \"%s\"", ht_current->name);
     return nonpending;
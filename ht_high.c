@@ -16,6 +16,7 @@ ht_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
     ht_time_t now;
     ht_event_t ev;
     static ht_key_t ev_key = HT_KEY_INIT;
+    int rc;
 
     /* consistency checks for POSIX conformance */
     if (rqtp == NULL)
@@ -23,6 +24,10 @@ ht_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
     if (rqtp->tv_nsec < 0 || rqtp->tv_nsec > (1000*1000000))
         return ht_error(-1, EINVAL);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here)
+        return nanosleep(rqtp, rmtp);
+
     /* short-circuit */
     if (rqtp->tv_sec == 0 && rqtp->tv_nsec == 0)
         return 0;
@@ -35,7 +40,7 @@ ht_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
     /* and let thread sleep until this time is elapsed */
     if ((ev = ht_event(HT_EVENT_TIME|HT_MODE_STATIC, &ev_key, until)) == NULL)
         return ht_error(-1, errno);
-    ht_wait(ev);
+    rc = ht_wait(ev);
 
     /* optionally provide amount of slept time */
     if (rmtp != NULL) {
@@ -45,6 +50,9 @@ ht_nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
         rmtp->tv_nsec = until.tv_usec * 1000;
     }
 
+    /* the thread's deadline cut the sleep short */
+    if (rc < 0)
+        return ht_error(-1, ETIMEDOUT);
     return 0;
 }
 
@@ -60,6 +68,8 @@ ht_usleep(unsigned int usec)
     /* short-circuit */
     if (usec == 0)
         return 0;
+    if (!ht_sched_here)
+        return usleep(usec);
 
     /* calculate asleep time */
     offset = ht_time((long)(usec / 1000000), (long)(usec % 1000000));
@@ -69,7 +79,8 @@ ht_usleep(unsigned int usec)
     /* and let thread sleep until this time is elapsed */
     if ((ev = ht_event(HT_EVENT_TIME|HT_MODE_STATIC, &ev_key, until)) == NULL)
         return ht_error(-1, errno);
-    ht_wait(ev);
+    if (ht_wait(ev) < 0)
+        return ht_error(-1, ETIMEDOUT);
 
     return 0;
 }
@@ -86,6 +97,8 @@ ht_sleep(unsigned int sec)
     /* consistency check */
     if (sec == 0)
         return 0;
+    if (!ht_sched_here)
+        return sleep(sec);
 
     /* calculate asleep time */
     offset = ht_time(sec, 0);
@@ -95,7 +108,12 @@ ht_sleep(unsigned int sec)
     /* and let thread sleep until this time is elapsed */
     if ((ev = ht_event(HT_EVENT_TIME|HT_MODE_STATIC, &ev_key, until)) == NULL)
         return sec;
-    ht_wait(ev);
+    if (ht_wait(ev) < 0) {
+        /* the thread's deadline cut the sleep short */
+        ht_time_set(&offset, HT_TIME_NOW);
+        ht_time_sub(&until, &offset);
+        return ht_error((unsigned int)(until.tv_sec + (until.tv_usec > 0)), ETIMEDOUT);
+    }
 
     return 0;
 }
@@ -122,11 +140,19 @@ ht_select_ev(int nfd, fd_set *rfds, fd_set *wfds,
     fd_set rspare, wspare, espare;
     fd_set *rtmp, *wtmp, *etmp;
     int selected;
+    int expired;
     int rc;
 
     ht_implicit_init();
     ht_debug2("ht_select_ev: called from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        return select(nfd, rfds, wfds, efds, timeout);
+    }
+
     /* POSIX.1-2001/SUSv3 compliance */
     if (nfd < 0 || nfd > FD_SETSIZE)
         return ht_error(-1, EINVAL);
@@ -152,7 +178,11 @@ ht_select_ev(int nfd, fd_set *rfds, fd_set *wfds,
                            ht_timeout(timeout->tv_sec, timeout->tv_usec));
             if (ev_extra != NULL)
                 ht_event_concat(ev, ev_extra, NULL);
-            ht_wait(ev);
+            if (ht_wait(ev) < 0) {
+                if (ev_extra != NULL)
+                    ht_event_isolate(ev);
+                return ht_error(-1, ETIMEDOUT);
+            }
             if (ev_extra != NULL) {
                 ht_event_isolate(ev);
                 if (ht_event_status(ev) != HT_STATUS_OCCURRED)
@@ -221,7 +251,7 @@ ht_select_ev(int nfd, fd_set *rfds, fd_set *wfds,
     }
     if (ev_extra != NULL)
         ht_event_concat(ev, ev_extra, NULL);
-    ht_wait(ev);
+    expired = (ht_wait(ev) < 0);
     if (ev_extra != NULL)
         ht_event_isolate(ev_extra);
     if (timeout != NULL)
@@ -242,6 +272,8 @@ ht_select_ev(int nfd, fd_set *rfds, fd_set *wfds,
         if (efds != NULL) FD_ZERO(efds);
         rc = 0;
     }
+    if (expired && !selected)
+        return ht_error(-1, ETIMEDOUT);
     if (ev_extra != NULL && !selected)
         return ht_error(-1, EINTR);
 
@@ -303,6 +335,13 @@ ht_poll_ev(struct pollfd *pfd, nfds_t nfd, int timeout, ht_event_t ev_extra)
     ht_implicit_init();
     ht_debug2("ht_poll_ev: called from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        return poll(pfd, nfd, timeout);
+    }
+
     /* argument sanity checks */
     if (pfd == NULL)
         return ht_error(-1, EFAULT);
@@ -436,6 +475,13 @@ ht_connect_ev(int s, const struct sockaddr *addr, socklen_t addrlen, ht_event_t
     ht_implicit_init();
     ht_debug2("ht_connect_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        return connect(s, addr, addrlen);
+    }
+
     /* POSIX compliance */
     if (!ht_util_fd_valid(s))
         return ht_error(-1, EBADF);
@@ -458,7 +504,11 @@ ht_connect_ev(int s, const struct sockaddr *addr, socklen_t addrlen, ht_event_t
             return ht_error(-1, errno);
         if (ev_extra != NULL)
             ht_event_concat(ev, ev_extra, NULL);
-        ht_wait(ev);
+        if (ht_wait(ev) < 0) {
+            if (ev_extra != NULL)
+                ht_event_isolate(ev);
+            return ht_error(-1, ETIMEDOUT);
+        }
         if (ev_extra != NULL) {
             ht_event_isolate(ev);
             if (ht_event_status(ev) != HT_STATUS_OCCURRED)
@@ -495,6 +545,13 @@ ht_accept_ev(int s, struct sockaddr *addr, socklen_t *addrlen, ht_event_t ev_ext
     ht_implicit_init();
     ht_debug2("ht_accept_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        return accept(s, addr, addrlen);
+    }
+
     /* POSIX compliance */
     if (!ht_util_fd_valid(s))
         return ht_error(-1, EBADF);
@@ -516,7 +573,12 @@ ht_accept_ev(int s, struct sockaddr *addr, socklen_t *addrlen, ht_event_t ev_ext
                 ht_event_concat(ev, ev_extra, NULL);
         }
         /* wait until accept has a chance */
-        ht_wait(ev);
+        if (ht_wait(ev) < 0) {
+            if (ev_extra != NULL)
+                ht_event_isolate(ev);
+            ht_fdmode(s, fdmode);
+            return ht_error(-1, ETIMEDOUT);
+        }
         /* check for the extra events */
         if (ev_extra != NULL) {
             ht_event_isolate(ev);
@@ -530,14 +592,63 @@ ht_accept_ev(int s, struct sockaddr *addr, socklen_t *addrlen, ht_event_t ev_ext
     /* restore filedescriptor mode */
     ht_shield {
         ht_fdmode(s, fdmode);
-        if (rv != -1)
+        if (rv != -1) {
+            /* a reused filedescriptor number carries no async mode */
+            ht_fdmode_reset(rv);
             ht_fdmode(rv, fdmode);
+        }
     }
 
     ht_debug2("ht_accept_ev: leave to thread \"%s\"", ht_current->name);
     return rv;
 }
 
+/* the call on an async filedescriptor would have blocked: let the
+   thread sleep until it is readable (TRUE, try again) or fail with
+   ETIMEDOUT or EINTR; any other error is passed through (FALSE) */
+static int
+ht_async_wait(int fd, ht_event_t ev_extra)
+{
+    static ht_key_t ev_key = HT_KEY_INIT;
+    ht_event_t ev;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return FALSE;
+    if ((ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_READABLE|HT_MODE_STATIC, &ev_key, fd)) == NULL)
+        return FALSE;
+    if (ev_extra != NULL)
+        ht_event_concat(ev, ev_extra, NULL);
+    if (ht_wait(ev) < 0) {
+        if (ev_extra != NULL)
+            ht_event_isolate(ev);
+        return ht_error(FALSE, ETIMEDOUT);
+    }
+    if (ev_extra != NULL) {
+        ht_event_isolate(ev);
+        if (ht_event_status(ev) != HT_STATUS_OCCURRED)
+            return ht_error(FALSE, EINTR);
+    }
+    return TRUE;
+}
+
+/* handed-out threads keep blocking semantics on async filedescriptors
+   by waiting in poll(2) whenever the native call would have blocked */
+static int
+ht_async_native(int fd, short events)
+{
+    struct pollfd pfd;
+
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || !ht_fdmode_async(fd))
+        return FALSE;
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0)
+        if (errno != EINTR)
+            return FALSE;
+    return TRUE;
+}
+
 /* Pth variant of read(2) */
 ssize_t 
 ht_read(int fd, void *buf, size_t nbytes)
@@ -559,6 +670,14 @@ ht_read_ev(int fd, void *buf, size_t nbytes, ht_event_t ev_extra)
     ht_implicit_init();
     ht_debug2("ht_read_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((n = read(fd, buf, nbytes)) < 0 && ht_async_native(fd, POLLIN)) ;
+        return n;
+    }
+
     /* POSIX compliance */
     if (nbytes == 0)
         return 0;
@@ -590,7 +709,11 @@ ht_read_ev(int fd, void *buf, size_t nbytes, ht_event_t ev_extra)
             ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_READABLE|HT_MODE_STATIC, &ev_key, fd);
             if (ev_extra != NULL)
                 ht_event_concat(ev, ev_extra, NULL);
-            n = ht_wait(ev);
+            if ((n = ht_wait(ev)) < 0) {
+                if (ev_extra != NULL)
+                    ht_event_isolate(ev);
+                return ht_error(-1, ETIMEDOUT);
+            }
             if (ev_extra != NULL) {
                 ht_event_isolate(ev);
                 if (ht_event_status(ev) != HT_STATUS_OCCURRED)
@@ -603,9 +726,12 @@ ht_read_ev(int fd, void *buf, size_t nbytes, ht_event_t ev_extra)
        either because we were already in non-blocking mode or we determined
        above by polling that the next read(2) call will not block.  But keep
        in mind, that only 1 next read(2) call is guarrantied to not block
-       (except for the EINTR situation). */
+       (except for the EINTR situation). Async filedescriptors skip the
+       polling: the read(2) is tried first and only when it would block
+       the thread sleeps until readability and tries again. */
     while ((n = read(fd, buf, nbytes)) < 0
-           && errno == EINTR) ;
+           && (errno == EINTR
+               || (fdmode == HT_FDMODE_ASYNC && ht_async_wait(fd, ev_extra)))) ;
 
     ht_debug2("ht_read_ev: leave to thread \"%s\"", ht_current->name);
     return n;
@@ -634,6 +760,14 @@ ht_write_ev(int fd, const void *buf, size_t nbytes, ht_event_t ev_extra)
     ht_implicit_init();
     ht_debug2("ht_write_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((rv = write(fd, buf, nbytes)) < 0 && ht_async_native(fd, POLLOUT)) ;
+        return rv;
+    }
+
     /* POSIX compliance */
     if (nbytes == 0)
         return 0;
@@ -667,7 +801,12 @@ ht_write_ev(int fd, const void *buf, size_t nbytes, ht_event_t ev_extra)
                 ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_WRITEABLE|HT_MODE_STATIC, &ev_key, fd);
                 if (ev_extra != NULL)
                     ht_event_concat(ev, ev_extra, NULL);
-                ht_wait(ev);
+                if (ht_wait(ev) < 0) {
+                    if (ev_extra != NULL)
+                        ht_event_isolate(ev);
+                    ht_fdmode(fd, fdmode);
+                    return ht_error(-1, ETIMEDOUT);
+                }
                 if (ev_extra != NULL) {
                     ht_event_isolate(ev);
                     if (ht_event_status(ev) != HT_STATUS_OCCURRED) {
@@ -735,6 +874,14 @@ ht_readv_ev(int fd, const struct iovec *iov, int iovcnt, ht_event_t ev_extra)
     ht_implicit_init();
     ht_debug2("ht_readv_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((n = readv(fd, iov, iovcnt)) < 0 && ht_async_native(fd, POLLIN)) ;
+        return n;
+    }
+
     /* POSIX compliance */
     if (iovcnt <= 0 || iovcnt > UIO_MAXIOV)
         return ht_error(-1, EINVAL);
@@ -764,7 +911,11 @@ ht_readv_ev(int fd, const struct iovec *iov, int iovcnt, ht_event_t ev_extra)
             ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_READABLE|HT_MODE_STATIC, &ev_key, fd);
             if (ev_extra != NULL)
                 ht_event_concat(ev, ev_extra, NULL);
-            n = ht_wait(ev);
+            if ((n = ht_wait(ev)) < 0) {
+                if (ev_extra != NULL)
+                    ht_event_isolate(ev);
+                return ht_error(-1, ETIMEDOUT);
+            }
             if (ev_extra != NULL) {
                 ht_event_isolate(ev);
                 if (ht_event_status(ev) != HT_STATUS_OCCURRED)
@@ -777,13 +928,17 @@ ht_readv_ev(int fd, const struct iovec *iov, int iovcnt, ht_event_t ev_extra)
        either because we were already in non-blocking mode or we determined
        above by polling that the next read(2) call will not block.  But keep
        in mind, that only 1 next read(2) call is guarrantied to not block
-       (except for the EINTR situation). */
+       (except for the EINTR situation). Async filedescriptors skip the
+       polling: the read(2) is tried first and only when it would block
+       the thread sleeps until readability and tries again. */
 #if HT_FAKE_RWV
     while ((n = ht_readv_faked(fd, iov, iovcnt)) < 0
-           && errno == EINTR) ;
+           && (errno == EINTR
+               || (fdmode == HT_FDMODE_ASYNC && ht_async_wait(fd, ev_extra)))) ;
 #else
     while ((n = readv(fd, iov, iovcnt)) < 0
-           && errno == EINTR) ;
+           && (errno == EINTR
+               || (fdmode == HT_FDMODE_ASYNC && ht_async_wait(fd, ev_extra)))) ;
 #endif
 
     ht_debug2("ht_readv_ev: leave to thread \"%s\"", ht_current->name);
@@ -863,6 +1018,14 @@ ht_writev_ev(int fd, const struct iovec *iov, int iovcnt, ht_event_t ev_extra)
     ht_implicit_init();
     ht_debug2("ht_writev_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((rv = writev(fd, iov, iovcnt)) < 0 && ht_async_native(fd, POLLOUT)) ;
+        return rv;
+    }
+
     /* POSIX compliance */
     if (iovcnt <= 0 || iovcnt > UIO_MAXIOV)
         return ht_error(-1, EINVAL);
@@ -912,7 +1075,14 @@ ht_writev_ev(int fd, const struct iovec *iov, int iovcnt, ht_event_t ev_extra)
                 ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_WRITEABLE|HT_MODE_STATIC, &ev_key, fd);
                 if (ev_extra != NULL)
                     ht_event_concat(ev, ev_extra, NULL);
-                ht_wait(ev);
+                if (ht_wait(ev) < 0) {
+                    if (ev_extra != NULL)
+                        ht_event_isolate(ev);
+                    ht_fdmode(fd, fdmode);
+                    if (iovcnt > sizeof(tiov_stack))
+                        free(tiov);
+                    return ht_error(-1, ETIMEDOUT);
+                }
                 if (ev_extra != NULL) {
                     ht_event_isolate(ev);
                     if (ht_event_status(ev) != HT_STATUS_OCCURRED) {
@@ -1080,6 +1250,10 @@ ht_pread(int fd, void *buf, size_t nbytes, off_t offset)
     off_t old_offset;
     ssize_t rc;
 
+    /* handed-out threads have the native call at hand */
+    if (!ht_sched_here)
+        return pread(fd, buf, nbytes, offset);
+
     /* protect us: ht_read can yield! */
     if (!ht_mutex_acquire(&mutex, FALSE, NULL))
         return (-1);
@@ -1114,6 +1288,10 @@ ht_pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
     off_t old_offset;
     ssize_t rc;
 
+    /* handed-out threads have the native call at hand */
+    if (!ht_sched_here)
+        return pwrite(fd, buf, nbytes, offset);
+
     /* protect us: ht_write can yield! */
     if (!ht_mutex_acquire(&mutex, FALSE, NULL))
         return (-1);
@@ -1140,6 +1318,15 @@ ht_pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
     return rc;
 }
 
+/* Pth variant of close(2): the filedescriptor number leaves async
+   mode, so whatever reuses it next is not taken as non-blocking */
+int 
+ht_close(int fd)
+{
+    ht_fdmode_reset(fd);
+    return close(fd);
+}
+
 /* Pth variant of SUSv2 recv(2) */
 ssize_t 
 ht_recv(int s, void *buf, size_t len, int flags)
@@ -1175,6 +1362,14 @@ ht_recvfrom_ev(int fd, void *buf, size_t nbytes, int flags, struct sockaddr *fro
     ht_implicit_init();
     ht_debug2("ht_recvfrom_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((n = recvfrom(fd, buf, nbytes, flags, from, fromlen)) < 0 && ht_async_native(fd, POLLIN)) ;
+        return n;
+    }
+
     /* POSIX compliance */
     if (nbytes == 0)
         return 0;
@@ -1208,7 +1403,11 @@ ht_recvfrom_ev(int fd, void *buf, size_t nbytes, int flags, struct sockaddr *fro
             ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_READABLE|HT_MODE_STATIC, &ev_key, fd);
             if (ev_extra != NULL)
                 ht_event_concat(ev, ev_extra, NULL);
-            n = ht_wait(ev);
+            if ((n = ht_wait(ev)) < 0) {
+                if (ev_extra != NULL)
+                    ht_event_isolate(ev);
+                return ht_error(-1, ETIMEDOUT);
+            }
             if (ev_extra != NULL) {
                 ht_event_isolate(ev);
                 if (ht_event_status(ev) != HT_STATUS_OCCURRED)
@@ -1221,9 +1420,12 @@ ht_recvfrom_ev(int fd, void *buf, size_t nbytes, int flags, struct sockaddr *fro
        either because we were already in non-blocking mode or we determined
        above by polling that the next recvfrom(2) call will not block.  But keep
        in mind, that only 1 next recvfrom(2) call is guarrantied to not block
-       (except for the EINTR situation). */
+       (except for the EINTR situation). Async filedescriptors try the
+       recvfrom(2) first and sleep until readability only when it would
+       block. */
     while ((n = recvfrom(fd, buf, nbytes, flags, from, fromlen)) < 0
-           && errno == EINTR) ;
+           && (errno == EINTR
+               || (fdmode == HT_FDMODE_ASYNC && ht_async_wait(fd, ev_extra)))) ;
 
     ht_debug2("ht_recvfrom_ev: leave to thread \"%s\"", ht_current->name);
     return n;
@@ -1266,6 +1468,14 @@ ht_sendto_ev(int fd, const void *buf, size_t nbytes, int flags, const struct soc
     ht_implicit_init();
     ht_debug2("ht_sendto_ev: enter from thread \"%s\"", ht_current->name);
 
+    /* handed-out threads block natively, they only hold their worker */
+    if (!ht_sched_here) {
+        if (ev_extra != NULL)
+            return ht_error(-1, EINVAL);
+        while ((rv = sendto(fd, buf, nbytes, flags, to, tolen)) < 0 && ht_async_native(fd, POLLOUT)) ;
+        return rv;
+    }
+
     /* POSIX compliance */
     if (nbytes == 0)
         return 0;
@@ -1303,7 +1513,12 @@ ht_sendto_ev(int fd, const void *buf, size_t nbytes, int flags, const struct soc
                 ev = ht_event(HT_EVENT_FD|HT_UNTIL_FD_WRITEABLE|HT_MODE_STATIC, &ev_key, fd);
                 if (ev_extra != NULL)
                     ht_event_concat(ev, ev_extra, NULL);
-                ht_wait(ev);
+                if (ht_wait(ev) < 0) {
+                    if (ev_extra != NULL)
+                        ht_event_isolate(ev);
+                    ht_fdmode(fd, fdmode);
+                    return ht_error(-1, ETIMEDOUT);
+                }
                 if (ev_extra != NULL) {
                     ht_event_isolate(ev);
                     if (ht_event_status(ev) != HT_STATUS_OCCURRED) {
@@ -94,6 +94,7 @@ ht_kill(void)
     ht_worker_kill();
     ht_thread_cleanup(ht_main);
     ht_scheduler_kill();
+    ht_msgbuf_drop();
     ht_initialized = FALSE;
     ht_tcb_free(ht_sched);
     ht_tcb_free(ht_main);
@@ -144,6 +145,21 @@ ht_ctrl(unsigned long query, ...)
         int favournew = va_arg(ap, int);
         ht_favournew = (favournew ? 1 : 0);
     }
+    else if (query & HT_CTRL_LOCKPROF) {
+        int lockprof = va_arg(ap, int);
+        ht_lockprof_enabled = (lockprof ? TRUE : FALSE);
+    }
+    else if (query & HT_CTRL_DUMPLOCKPROF) {
+        FILE *fp = va_arg(ap, FILE *);
+        ht_lockprof_dump(fp);
+    }
+    else if (query & HT_CTRL_TIMERSLACK) {
+        int slack = va_arg(ap, int);
+        if (slack < 0)
+            rc = -1;
+        else
+            ht_time_slack = slack;
+    }
     else
         rc = -1;
     va_end(ap);
@@ -183,6 +199,14 @@ ht_spawn(ht_attr_t attr, void *(*func)(void *), void *arg)
     if (func == NULL)
         return ht_error((ht_t)NULL, EINVAL);
 
+    /* handed-out threads borrow the scheduler's floor */
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        t = ht_spawn(attr, func, arg);
+        ht_sched_leave(FALSE);
+        return t;
+    }
+
     /* support the special case of main() */
     if (func == (void *(*)(void *))(-1))
         func = NULL;
@@ -200,14 +224,16 @@ ht_spawn(ht_attr_t attr, void *(*func)(void *), void *arg)
         t->joinable    = attr->a_joinable;
         t->cancelstate = attr->a_cancelstate;
         t->dispatches  = attr->a_dispatches;
+        t->timerslack  = attr->a_timerslack;
         ht_util_cpystrn(t->name, attr->a_name, HT_TCB_NAMELEN);
     }
     else if (ht_current != NULL) {
         /* overtake some fields from the parent thread */
-        t->prio        = ht_current->prio;
+        t->prio        = ht_current->prio_base;
         t->joinable    = ht_current->joinable;
         t->cancelstate = ht_current->cancelstate;
         t->dispatches  = 0;
+        t->timerslack  = ht_current->timerslack;
         ht_snprintf(t->name, HT_TCB_NAMELEN, "%s.child@%d=0x%lx",
                      ht_current->name, (unsigned int)time(NULL),
                      (unsigned long)ht_current);
@@ -218,11 +244,15 @@ ht_spawn(ht_attr_t attr, void *(*func)(void *), void *arg)
         t->joinable    = TRUE;
         t->cancelstate = HT_CANCEL_DEFAULT;
         t->dispatches  = 0;
+        t->timerslack  = -1;
         ht_snprintf(t->name, HT_TCB_NAMELEN,
                      "user/%x", (unsigned int)time(NULL));
     }
+    t->prio_base = t->prio;
 
     /* initialize the time points and ranges */
+    ht_time_set(&t->deadline, HT_TIME_ZERO);
+    t->deadline_wait = FALSE;
     ht_time_set(&ts, HT_TIME_NOW);
     ht_time_set(&t->spawned, &ts);
     ht_time_set(&t->lastran, &ts);
@@ -240,6 +270,8 @@ ht_spawn(ht_attr_t attr, void *(*func)(void *), void *arg)
 
     /* initialize thread specific storage */
     t->data_value = NULL;
+    t->data_used  = NULL;
+    t->data_size  = 0;
     t->data_count = 0;
 
     /* initialize cancellation stuff */
@@ -347,13 +379,17 @@ ht_exit(void *value)
 
     ht_debug2("ht_exit: marking thread \"%s\" as dead", ht_current->name);
 
+    /* a handed-out thread has to die under the scheduler */
+    if (!ht_sched_here)
+        ht_get_back();
+
     /* the main thread is special, because its termination
        would terminate the whole process, so we have to delay 
        its termination until it is really the last thread */
     if (ht_current == ht_main) {
         if (!ht_exit_cb(NULL)) {
             ev = ht_event(HT_EVENT_FUNC, ht_exit_cb);
-            ht_wait(ev);
+            ht_event_wait(ev, FALSE);
             ht_event_free(ev, HT_FREE_THIS);
         }
     }
@@ -404,7 +440,8 @@ ht_join(ht_t tid, void **value)
         tid = ht_pqueue_head(&ht_DQ);
     if (tid == NULL || (tid != NULL && tid->state != HT_STATE_DEAD)) {
         ev = ht_event(HT_EVENT_TID|HT_UNTIL_TID_DEAD|HT_MODE_STATIC, &ev_key, tid);
-        ht_wait(ev);
+        if (ht_wait(ev) < 0)
+            return ht_error(FALSE, ETIMEDOUT);
     }
     if (tid == NULL)
         tid = ht_pqueue_head(&ht_DQ);
@@ -425,6 +462,10 @@ ht_yield(ht_t to)
 
     ht_debug2("ht_yield: enter from thread \"%s\"", ht_current->name);
 
+    /* off the scheduler's kernel thread there is nobody to yield to */
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        return TRUE;
+
     /* a given thread has to be new or ready or we ignore the request */
     if (to != NULL) {
         switch (to->state) {
@@ -503,12 +544,64 @@ ht_resume(ht_t t)
     return TRUE;
 }
 
+/*
+ * Filedescriptors in HT_FDMODE_ASYNC mode were switched to non-blocking
+ * once and are remembered here, so the ht_* I/O calls do not switch
+ * their mode back and forth. They leave the mode again with
+ * HT_FDMODE_BLOCK or through ht_close(), since the number may come
+ * back as another filedescriptor. A number closed behind our back can
+ * come back as a blocking filedescriptor, and a try-first read(2) on
+ * it would block the whole scheduler. So the remembered mode only
+ * counts while the filedescriptor is still non-blocking.
+ */
+#define HT_FDASYNC_BITS (8 * sizeof(unsigned long))
+static unsigned long ht_fdasync[FD_SETSIZE / HT_FDASYNC_BITS];
+
+/* forget the mode of a filedescriptor number which was handed out anew */
+void
+ht_fdmode_reset(int fd)
+{
+    if (fd >= 0 && fd < FD_SETSIZE)
+        __atomic_and_fetch(&ht_fdasync[fd / HT_FDASYNC_BITS],
+                           ~(1UL << (fd % HT_FDASYNC_BITS)), __ATOMIC_RELAXED);
+    return;
+}
+
+int
+ht_fdmode_async(int fd)
+{
+    int fdmode;
+
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return FALSE;
+    if (!((__atomic_load_n(&ht_fdasync[fd / HT_FDASYNC_BITS], __ATOMIC_RELAXED)
+           >> (fd % HT_FDASYNC_BITS)) & 1))
+        return FALSE;
+    if ((fdmode = fcntl(fd, F_GETFL, NULL)) == -1 || !(fdmode & O_NONBLOCKING)) {
+        ht_fdmode_reset(fd);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 /* switch a filedescriptor's I/O mode */
 int 
 ht_fdmode(int fd, int newmode)
 {
     int fdmode;
     int oldmode;
+    int async;
+
+    /* only filedescriptors select(2) can wait for can be async */
+    if (newmode == HT_FDMODE_ASYNC && (fd < 0 || fd >= FD_SETSIZE))
+        return ht_error(HT_FDMODE_ERROR, EBADF);
+
+    /* async mode is known without asking and stays non-blocking */
+    if ((async = ht_fdmode_async(fd))) {
+        if (newmode != HT_FDMODE_BLOCK)
+            return HT_FDMODE_ASYNC;
+        ht_fdmode_reset(fd);
+    }
 
     /* retrieve old mode (usually a very cheap operation) */
     if ((fdmode = fcntl(fd, F_GETFL, NULL)) == -1)
@@ -519,13 +612,16 @@ ht_fdmode(int fd, int newmode)
         oldmode = HT_FDMODE_BLOCK;
 
     /* set new mode (usually a more expensive operation) */
-    if (oldmode == HT_FDMODE_BLOCK && newmode == HT_FDMODE_NONBLOCK)
+    if (oldmode == HT_FDMODE_BLOCK && (newmode == HT_FDMODE_NONBLOCK || newmode == HT_FDMODE_ASYNC))
         fcntl(fd, F_SETFL, (fdmode | O_NONBLOCKING));
     if (oldmode == HT_FDMODE_NONBLOCK && newmode == HT_FDMODE_BLOCK)
         fcntl(fd, F_SETFL, (fdmode & ~(O_NONBLOCKING)));
+    if (oldmode != HT_FDMODE_ERROR && newmode == HT_FDMODE_ASYNC)
+        __atomic_or_fetch(&ht_fdasync[fd / HT_FDASYNC_BITS],
+                          1UL << (fd % HT_FDASYNC_BITS), __ATOMIC_RELAXED);
 
     /* return old mode */
-    return oldmode;
+    return (async ? HT_FDMODE_ASYNC : oldmode);
 }
 
 /* wait for specific amount of time */
@@ -538,10 +634,40 @@ ht_nap(ht_time_t naptime)
 
     if (ht_time_cmp(&naptime, HT_TIME_ZERO) == 0)
         return ht_error(FALSE, EINVAL);
+    if (!ht_sched_here) {
+        /* handed-out threads just block their kernel thread */
+        struct timespec ts;
+        ts.tv_sec  = naptime.tv_sec;
+        ts.tv_nsec = naptime.tv_usec * 1000;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+        return TRUE;
+    }
     ht_time_set(&until, HT_TIME_NOW);
     ht_time_add(&until, &naptime);
     ev = ht_event(HT_EVENT_TIME|HT_MODE_STATIC, &ev_key, until);
-    ht_wait(ev);
+    if (ht_wait(ev) < 0)
+        return ht_error(FALSE, ETIMEDOUT);
+    return TRUE;
+}
+
+/* bound the blocking calls of a thread by an absolute deadline
+   (e.g. from ht_timeout()); they fail with ETIMEDOUT once it passed */
+int
+ht_set_deadline(ht_t t, ht_time_t when)
+{
+    if (t == NULL || ht_time_cmp(&when, HT_TIME_ZERO) == 0)
+        return ht_error(FALSE, EINVAL);
+    ht_time_set(&t->deadline, &when);
+    return TRUE;
+}
+
+/* remove the deadline of a thread */
+int
+ht_clear_deadline(ht_t t)
+{
+    if (t == NULL)
+        return ht_error(FALSE, EINVAL);
+    ht_time_set(&t->deadline, HT_TIME_ZERO);
     return TRUE;
 }
 
@@ -0,0 +1,118 @@
+/*
+ *  lock contention profiler
+ *  Opt-in per lock site counters for mutexes, read-write locks and
+ *  condition variables. A lock is profiled once it is attached to a
+ *  site: by its init call site while profiling is switched on, or by
+ *  a name assigned with ht_{mutex,rwlock,cond}_setname(). Unprofiled
+ *  locks only pay for a NULL check. Hold times are sampled.
+ */
+
+#include "ht_p.h"
+
+#define HT_LOCKPROF_SAMPLE 16    /* time every n-th uncontended hold */
+
+static pthread_mutex_t ht_lockprof_lock = PTHREAD_MUTEX_INITIALIZER;
+static ht_lockprof_t  *ht_lockprof_sites = NULL;
+int                    ht_lockprof_enabled = FALSE;
+
+static const char *ht_lockprof_kinds[] = { "mutex", "rwlock", "cond" };
+
+/* raise a maximum atomically */
+static void
+ht_lockprof_max(unsigned long long *max, unsigned long long val)
+{
+    unsigned long long old;
+
+    old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > old)
+        if (__atomic_compare_exchange_n(max, &old, val,
+                                        FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    return;
+}
+
+/* find or create the site of a name or a call site */
+ht_lockprof_t *
+ht_lockprof_site(int kind, const char *name, void *site)
+{
+    ht_lockprof_t *lp;
+
+    pthread_mutex_lock(&ht_lockprof_lock);
+    for (lp = ht_lockprof_sites; lp != NULL; lp = lp->lp_next)
+        if (   lp->lp_kind == kind
+            && (name != NULL ? strcmp(lp->lp_name, name) == 0
+                             : (lp->lp_name[0] == NUL && lp->lp_site == site)))
+            break;
+    if (lp == NULL && (lp = (ht_lockprof_t *)calloc(1, sizeof(ht_lockprof_t))) != NULL) {
+        lp->lp_kind = kind;
+        lp->lp_site = site;
+        if (name != NULL)
+            ht_util_cpystrn(lp->lp_name, name, sizeof(lp->lp_name));
+        lp->lp_next = ht_lockprof_sites;
+        ht_lockprof_sites = lp;
+    }
+    pthread_mutex_unlock(&ht_lockprof_lock);
+    return lp;
+}
+
+/* account an acquisition; waited is the start of the wait or 0, and
+   since, if not NULL, receives the start of a sampled hold or 0 */
+void
+ht_lockprof_acquired(ht_lockprof_t *lp, unsigned long long waited,
+                     unsigned long long *since)
+{
+    unsigned long long now = 0, n;
+
+    n = __atomic_add_fetch(&lp->lp_acquires, 1, __ATOMIC_RELAXED);
+    if (waited != 0) {
+        now = ht_time_ns();
+        __atomic_add_fetch(&lp->lp_contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lp->lp_wait_total, now - waited, __ATOMIC_RELAXED);
+        ht_lockprof_max(&lp->lp_wait_max, now - waited);
+    }
+    if (since != NULL) {
+        if (now == 0 && n % HT_LOCKPROF_SAMPLE == 0)
+            now = ht_time_ns();
+        *since = now;
+    }
+    return;
+}
+
+/* account the end of a sampled hold */
+void
+ht_lockprof_released(ht_lockprof_t *lp, unsigned long long since)
+{
+    unsigned long long hold;
+
+    hold = ht_time_ns() - since;
+    __atomic_add_fetch(&lp->lp_holds, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lp->lp_hold_total, hold, __ATOMIC_RELAXED);
+    ht_lockprof_max(&lp->lp_hold_max, hold);
+    return;
+}
+
+/* print all sites, times in microseconds */
+void
+ht_lockprof_dump(FILE *fp)
+{
+    ht_lockprof_t *lp;
+    char site[32];
+
+    fprintf(fp, "%-6s %-24s %10s %10s %12s %10s %10s %10s\n",
+            "kind", "site", "acquires", "contended",
+            "wait-total", "wait-max", "hold-avg", "hold-max");
+    pthread_mutex_lock(&ht_lockprof_lock);
+    for (lp = ht_lockprof_sites; lp != NULL; lp = lp->lp_next) {
+        if (lp->lp_name[0] == NUL)
+            ht_snprintf(site, sizeof(site), "0x%lx", (unsigned long)lp->lp_site);
+        fprintf(fp, "%-6s %-24s %10llu %10llu %12llu %10llu %10llu %10llu\n",
+                ht_lockprof_kinds[lp->lp_kind],
+                (lp->lp_name[0] != NUL ? lp->lp_name : site),
+                lp->lp_acquires, lp->lp_contended,
+                lp->lp_wait_total / 1000, lp->lp_wait_max / 1000,
+                (lp->lp_holds > 0 ? lp->lp_hold_total / lp->lp_holds / 1000 : 0),
+                lp->lp_hold_max / 1000);
+    }
+    pthread_mutex_unlock(&ht_lockprof_lock);
+    return;
+}
@@ -52,6 +52,19 @@ static void *worker(void *_dummy)
     return NULL;
 }
 
+/* a plain pthread, unknown to the scheduler, posting to a green port */
+#define NPOSTS 10000
+static void *poster(void *_mp)
+{
+    static ht_message_t msgs[NPOSTS];
+    int i;
+
+    for (i = 0; i < NPOSTS; i++) {
+        msgs[i].m_size = i;
+        ht_msgport_put((ht_msgport_t)_mp, &msgs[i]);
+    }
+    return NULL;
+}
 
 #define MAXLINELEN 1024
 
@@ -95,6 +108,70 @@ int main(int argc, char *argv[])
     HT_TEST_ASSERT(0 == strcmp(q->string, "HELLO"), 
                     "message port did not work as expected.");
 
+    /* the registry keeps a private copy of the names and survives growth */
+    {
+        ht_msgport_t mps[200];
+        char name[32];
+        int i, found = TRUE;
+
+        for (i = 0; i < 200; i++) {
+            snprintf(name, sizeof(name), "session-%d", i);
+            mps[i] = ht_msgport_create(name);
+        }
+        strcpy(name, "clobbered");
+        for (i = 0; i < 200; i++) {
+            snprintf(name, sizeof(name), "session-%d", i);
+            found = found && ht_msgport_find(name) == mps[i];
+        }
+        HT_TEST_ASSERT(found, "ht_msgport_find did not find a named port.");
+        HT_TEST_ASSERT(ht_msgport_find("main") == mp,
+                       "ht_msgport_find lost a port while growing.");
+        for (i = 0; i < 200; i++)
+            ht_msgport_destroy(mps[i]);
+        HT_TEST_ASSERT(ht_msgport_find("session-7") == NULL,
+                       "ht_msgport_find found a destroyed port.");
+    }
+
+    /* messages from a foreign pthread arrive complete and in order */
+    {
+        ht_msgport_t mpx = ht_msgport_create(NULL);
+        ht_event_t evx = ht_event(HT_EVENT_MSG, mpx);
+        ht_message_t *m;
+        pthread_t tid;
+        int n = 0, ordered = TRUE;
+
+        pthread_create(&tid, NULL, poster, mpx);
+        while (n < NPOSTS) {
+            ht_wait(evx);
+            while ((m = ht_msgport_get(mpx)) != NULL)
+                ordered = ordered && m->m_size == n++;
+        }
+        pthread_join(tid, NULL);
+        HT_TEST_ASSERT(ordered, "messages from a foreign pthread got reordered.");
+        ht_event_free(evx, HT_FREE_THIS);
+        ht_msgport_destroy(mpx);
+    }
+
+    /* batched receive wakes on the threshold or after the delay */
+    {
+        ht_msgport_t mpb = ht_msgport_create(NULL);
+        ht_message_t msgs[8], *in[8], *out[8];
+        int i, n;
+
+        for (i = 0; i < 8; i++)
+            in[i] = &msgs[i];
+        HT_TEST_ASSERT(ht_msgport_put_n(mpb, in, 6), "ht_msgport_put_n failed.");
+        n = ht_msgport_recv_n(mpb, out, 4, 4, ht_time(0, 0));
+        HT_TEST_ASSERT(n == 4 && out[0] == &msgs[0] && out[3] == &msgs[3],
+                       "ht_msgport_recv_n did not return the batch in order.");
+        n = ht_msgport_recv_n(mpb, out, 8, 8, ht_time(0, 20000));
+        HT_TEST_ASSERT(n == 2 && out[1] == &msgs[5],
+                       "ht_msgport_recv_n did not give up after the delay.");
+        HT_TEST_ASSERT(ht_msgport_get_n(mpb, out, 8) == 0,
+                       "ht_msgport_get_n found messages on an empty port.");
+        ht_msgport_destroy(mpb);
+    }
+
     free(q);
     ht_event_free(ev, HT_FREE_THIS);
     ht_event_free(evt, HT_FREE_THIS);
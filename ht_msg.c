@@ -2,27 +2,95 @@
 
 #pragma GCC diagnostic ignored "-Waddress"
 
-static ht_ring_t ht_msgport = HT_RING_INIT;
+/*
+ * The registry of named message ports: a hash table of rings, keyed
+ * by the name. Each port carries a private copy of its name together
+ * with the hash value, so a lookup compares strings only on a hash
+ * hit. The names are not interned: a shared name table would need
+ * reference counts and its own lock on every create and destroy, while
+ * the copy lives in the port's own allocation and goes away with it.
+ * Ports without a name are not registered at all. The registry
+ * has its own lock instead of relying on the scheduler, so lookups
+ * from any kernel thread do not need the scheduler's floor.
+ */
+#define HT_MSGPORT_BUCKETS 64
+
+static ht_ring_t      *ht_msgport        = NULL;
+static unsigned int    ht_msgport_size   = 0;
+static unsigned int    ht_msgport_nodes  = 0;
+static pthread_mutex_t ht_msgport_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+/* hash a port name (FNV-1a) */
+static unsigned int
+ht_msgport_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    while (*name != NUL)
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+/* double the number of buckets, keeping the order within each chain */
+static int
+ht_msgport_grow(void)
+{
+    ht_ring_t *table;
+    ht_ringnode_t *rn;
+    unsigned int size, i;
+
+    size = (ht_msgport_size == 0 ? HT_MSGPORT_BUCKETS : ht_msgport_size * 2);
+    if ((table = (ht_ring_t *)malloc(sizeof(ht_ring_t) * size)) == NULL)
+        return FALSE;
+    for (i = 0; i < size; i++)
+        ht_ring_init(&table[i]);
+    for (i = 0; i < ht_msgport_size; i++)
+        while ((rn = ht_ring_pop(&ht_msgport[i])) != NULL)
+            ht_ring_append(&table[((ht_msgport_t)rn)->mp_hash & (size - 1)], rn);
+    free(ht_msgport);
+    ht_msgport      = table;
+    ht_msgport_size = size;
+    return TRUE;
+}
 
 /* create a new message port */
 ht_msgport_t 
 ht_msgport_create(const char *name)
 {
     ht_msgport_t mp;
+    size_t len;
 
     /* Notice: "name" is allowed to be NULL */
 
-    /* allocate message port structure */
-    if ((mp = (ht_msgport_t)malloc(sizeof(struct ht_msgport_st))) == NULL)
+    /* allocate message port structure, with room for the name */
+    len = (name != NULL ? strlen(name) + 1 : 0);
+    if ((mp = (ht_msgport_t)malloc(sizeof(struct ht_msgport_st) + len)) == NULL)
         return ht_error((ht_msgport_t)NULL, ENOMEM);
 
     /* initialize structure */
-    mp->mp_name  = name;
+    mp->mp_name  = NULL;
+    mp->mp_hash  = 0;
     mp->mp_tid   = ht_current;
+    mp->mp_inbox = NULL;
     ht_ring_init(&mp->mp_queue);
+    if (name == NULL)
+        return mp;
+    memcpy((char *)(mp + 1), name, len);
+    mp->mp_name = (const char *)(mp + 1);
+    mp->mp_hash = ht_msgport_hash(name);
 
-    /* insert into list of existing message ports */
-    ht_ring_append(&ht_msgport, &mp->mp_node);
+    /* insert into the registry of named message ports */
+    pthread_mutex_lock(&ht_msgport_lock);
+    if (ht_msgport_nodes >= ht_msgport_size) {
+        if (!ht_msgport_grow()) {
+            pthread_mutex_unlock(&ht_msgport_lock);
+            free(mp);
+            return ht_error((ht_msgport_t)NULL, ENOMEM);
+        }
+    }
+    ht_ring_append(&ht_msgport[mp->mp_hash & (ht_msgport_size - 1)], &mp->mp_node);
+    ht_msgport_nodes++;
+    pthread_mutex_unlock(&ht_msgport_lock);
 
     return mp;
 }
@@ -37,12 +105,25 @@ ht_msgport_destroy(ht_msgport_t mp)
     if (mp == NULL)
         return;
 
+    /* handed-out threads borrow the scheduler's floor */
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        ht_msgport_destroy(mp);
+        ht_sched_leave(FALSE);
+        return;
+    }
+
     /* first reply to all pending messages */
     while ((m = ht_msgport_get(mp)) != NULL)
         ht_msgport_reply(m);
 
-    /* remove from list of existing message ports */
-    ht_ring_delete(&ht_msgport, &mp->mp_node);
+    /* remove from the registry of named message ports */
+    if (mp->mp_name != NULL) {
+        pthread_mutex_lock(&ht_msgport_lock);
+        ht_ring_delete(&ht_msgport[mp->mp_hash & (ht_msgport_size - 1)], &mp->mp_node);
+        ht_msgport_nodes--;
+        pthread_mutex_unlock(&ht_msgport_lock);
+    }
 
     /* deallocate message port structure */
     free(mp);
@@ -55,32 +136,82 @@ ht_msgport_t
 ht_msgport_find(const char *name)
 {
     ht_msgport_t mp, mpf;
+    ht_ring_t *r;
+    unsigned int h;
 
     /* check input */
     if (name == NULL)
         return ht_error((ht_msgport_t)NULL, EINVAL);
 
-    /* iterate over message ports */
-    mp = mpf = (ht_msgport_t)ht_ring_first(&ht_msgport);
-    while (mp != NULL) {
-        if (mp->mp_name != NULL)
-            if (strcmp(mp->mp_name, name) == 0)
+    /* iterate over the chain of the name's bucket */
+    h = ht_msgport_hash(name);
+    pthread_mutex_lock(&ht_msgport_lock);
+    mp = NULL;
+    if (ht_msgport_size > 0) {
+        r = &ht_msgport[h & (ht_msgport_size - 1)];
+        mp = mpf = (ht_msgport_t)ht_ring_first(r);
+        while (mp != NULL) {
+            if (mp->mp_hash == h && strcmp(mp->mp_name, name) == 0)
                 break;
-        mp = (ht_msgport_t)ht_ring_next(&ht_msgport, (ht_ringnode_t *)mp);
-        if (mp == mpf) {
-            mp = NULL;
-            break;
+            mp = (ht_msgport_t)ht_ring_next(r, (ht_ringnode_t *)mp);
+            if (mp == mpf) {
+                mp = NULL;
+                break;
+            }
         }
     }
+    pthread_mutex_unlock(&ht_msgport_lock);
     return mp;
 }
 
+/*
+ * Messages put by foreign kernel threads (handed-out threads, worker
+ * jobs or any other pthread of the process) do not go through the
+ * scheduler's floor. They are pushed lock-free onto the inbox of the
+ * port, a LIFO stack linked through m_node.rn_next, and the first
+ * message on an empty inbox rings the scheduler's doorbell. The
+ * inbox has a single consumer: whoever runs the scheduler, natively
+ * or under the floor, moves it over to the queue of the port.
+ */
+
+/* move the messages posted by foreign kernel threads onto the queue */
+void
+ht_msgport_drain(ht_msgport_t mp)
+{
+    ht_message_t *m, *rm, *next;
+
+    if (__atomic_load_n(&mp->mp_inbox, __ATOMIC_RELAXED) == NULL)
+        return;
+    m = __atomic_exchange_n(&mp->mp_inbox, NULL, __ATOMIC_ACQUIRE);
+
+    /* reverse the stack to restore the order of posting */
+    for (rm = NULL; m != NULL; m = next) {
+        next = (ht_message_t *)m->m_node.rn_next;
+        m->m_node.rn_next = (ht_ringnode_t *)rm;
+        rm = m;
+    }
+    for (; rm != NULL; rm = next) {
+        next = (ht_message_t *)rm->m_node.rn_next;
+        ht_ring_append(&mp->mp_queue, &rm->m_node);
+    }
+    return;
+}
+
 /* number of messages on a port */
 int 
 ht_msgport_pending(ht_msgport_t mp)
 {
+    int rc;
+
     if (mp == NULL)
         return ht_error(-1, EINVAL);
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        rc = ht_msgport_pending(mp);
+        ht_sched_leave(FALSE);
+        return rc;
+    }
+    ht_msgport_drain(mp);
     return ht_ring_elements(&mp->mp_queue);
 }
 
@@ -88,8 +219,21 @@ ht_msgport_pending(ht_msgport_t mp)
 int 
 ht_msgport_put(ht_msgport_t mp, ht_message_t *m)
 {
-    if (mp == NULL)
+    ht_message_t *top;
+
+    if (mp == NULL || m == NULL)
         return ht_error(FALSE, EINVAL);
+    if (!ht_sched_here) {
+        top = __atomic_load_n(&mp->mp_inbox, __ATOMIC_RELAXED);
+        do {
+            m->m_node.rn_next = (ht_ringnode_t *)top;
+        } while (!__atomic_compare_exchange_n(&mp->mp_inbox, &top, m, TRUE,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (top == NULL)
+            ht_sched_notify();
+        return TRUE;
+    }
+    ht_msgport_drain(mp);
     ht_ring_append(&mp->mp_queue, (ht_ringnode_t *)m);
     return TRUE;
 }
@@ -102,10 +246,118 @@ ht_msgport_get(ht_msgport_t mp)
 
     if (mp == NULL)
         return ht_error((ht_message_t *)NULL, EINVAL);
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        m = ht_msgport_get(mp);
+        ht_sched_leave(FALSE);
+        return m;
+    }
+    ht_msgport_drain(mp);
     m = (ht_message_t *)ht_ring_pop(&mp->mp_queue);
     return m;
 }
 
+/* put several messages on a port at once */
+int
+ht_msgport_put_n(ht_msgport_t mp, ht_message_t **msgs, int n)
+{
+    ht_message_t *top;
+    int i;
+
+    if (mp == NULL || msgs == NULL || n < 0)
+        return ht_error(FALSE, EINVAL);
+    if (n == 0)
+        return TRUE;
+    if (!ht_sched_here) {
+        /* chain the batch up as a stack and push it in one go */
+        for (i = n - 1; i > 0; i--)
+            msgs[i]->m_node.rn_next = (ht_ringnode_t *)msgs[i-1];
+        top = __atomic_load_n(&mp->mp_inbox, __ATOMIC_RELAXED);
+        do {
+            msgs[0]->m_node.rn_next = (ht_ringnode_t *)top;
+        } while (!__atomic_compare_exchange_n(&mp->mp_inbox, &top, msgs[n-1], TRUE,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (top == NULL)
+            ht_sched_notify();
+        return TRUE;
+    }
+    ht_msgport_drain(mp);
+    for (i = 0; i < n; i++)
+        ht_ring_append(&mp->mp_queue, (ht_ringnode_t *)msgs[i]);
+    return TRUE;
+}
+
+/* get up to n messages from a port, returning how many */
+int
+ht_msgport_get_n(ht_msgport_t mp, ht_message_t **msgs, int n)
+{
+    int i;
+
+    if (mp == NULL || msgs == NULL || n < 0)
+        return ht_error(-1, EINVAL);
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        i = ht_msgport_get_n(mp, msgs, n);
+        ht_sched_leave(FALSE);
+        return i;
+    }
+    ht_msgport_drain(mp);
+    for (i = 0; i < n; i++)
+        if ((msgs[i] = (ht_message_t *)ht_ring_pop(&mp->mp_queue)) == NULL)
+            break;
+    return i;
+}
+
+/*
+ * Receive a batch of up to n messages. The caller sleeps until at
+ * least "threshold" messages are pending or, unless "delay" is zero,
+ * until "delay" has passed since the first message was seen, so a
+ * busy port wakes its receiver once per batch instead of once per
+ * message.
+ */
+int
+ht_msgport_recv_n(ht_msgport_t mp, ht_message_t **msgs, int n,
+                  int threshold, ht_time_t delay)
+{
+    static ht_key_t ev_key_msg  = HT_KEY_INIT;
+    static ht_key_t ev_key_time = HT_KEY_INIT;
+    ht_event_t ev, evt;
+    ht_time_t until;
+
+    if (mp == NULL || msgs == NULL || n <= 0 || threshold <= 0)
+        return ht_error(-1, EINVAL);
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(-1, EPERM);
+    if (threshold > n)
+        threshold = n;
+
+    /* wait for the first message */
+    if (ht_msgport_pending(mp) == 0) {
+        ev = ht_event(HT_EVENT_MSG|HT_MODE_STATIC, &ev_key_msg, mp);
+        if (ht_wait(ev) < 0)
+            return ht_error(-1, ETIMEDOUT);
+    }
+
+    /* then for the batch to fill up or the delay to pass; a
+       deadline passing meanwhile returns what arrived so far */
+    if (ht_msgport_pending(mp) < threshold) {
+        ev = ht_event(HT_EVENT_MSG|HT_MODE_STATIC, &ev_key_msg, mp);
+        ev->ev_args.MSG.min = threshold;
+        if (ht_time_cmp(&delay, HT_TIME_ZERO) > 0) {
+            ht_time_set(&until, HT_TIME_NOW);
+            ht_time_add(&until, &delay);
+            evt = ht_event(HT_EVENT_TIME|HT_MODE_STATIC, &ev_key_time, until);
+            ht_event_concat(ev, evt, NULL);
+            ht_wait(ev);
+            ht_event_isolate(ev);
+        }
+        else
+            ht_wait(ev);
+    }
+
+    return ht_msgport_get_n(mp, msgs, n);
+}
+
 /* reply message to sender */
 int 
 ht_msgport_reply(ht_message_t *m)
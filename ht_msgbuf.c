@@ -0,0 +1,280 @@
+/*
+ *  message buffers
+ *  Pooled, reference counted payload storage. A message buffer is a
+ *  slice of a chunk: its header is an ordinary message whose m_data
+ *  and m_size describe the slice, so it can be put on message ports
+ *  as it is. Slicing and referencing share the chunk instead of
+ *  copying it, and chunks of the common sizes are recycled through
+ *  per size class free lists instead of going back to malloc.
+ */
+
+#include "ht_p.h"
+
+#include <limits.h>
+
+#define HT_MSGBUF_CLASSES   5    /* 256 bytes up to 64 KB, by factors of 4 */
+#define HT_MSGBUF_MINSIZE 256
+#define HT_MSGBUF_CACHE    64    /* chunks kept per size class            */
+
+static struct {
+    pthread_mutex_t    lock;
+    ht_msgbuf_chunk_t *free;
+    int                count;
+} ht_msgbuf_pool[HT_MSGBUF_CLASSES] = {
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+/* the buffer headers are recycled as well */
+static pthread_mutex_t ht_msgbuf_lock  = PTHREAD_MUTEX_INITIALIZER;
+static ht_msgbuf_t     ht_msgbuf_free_ = NULL;
+static int             ht_msgbuf_count = 0;
+
+#define ht_msgbuf_chunk_data(mc) ((char *)((mc) + 1))
+
+/* get a chunk of at least size bytes */
+static ht_msgbuf_chunk_t *
+ht_msgbuf_chunk_get(size_t size)
+{
+    ht_msgbuf_chunk_t *mc;
+    size_t cap;
+    int c;
+
+    for (c = 0, cap = HT_MSGBUF_MINSIZE; c < HT_MSGBUF_CLASSES; c++, cap *= 4)
+        if (size <= cap)
+            break;
+    if (c == HT_MSGBUF_CLASSES) {
+        c = -1;
+        cap = size;
+    }
+    else {
+        pthread_mutex_lock(&ht_msgbuf_pool[c].lock);
+        if ((mc = ht_msgbuf_pool[c].free) != NULL) {
+            ht_msgbuf_pool[c].free = mc->mc_next;
+            ht_msgbuf_pool[c].count--;
+        }
+        pthread_mutex_unlock(&ht_msgbuf_pool[c].lock);
+        if (mc != NULL) {
+            mc->mc_refs = 1;
+            return mc;
+        }
+    }
+    if ((mc = (ht_msgbuf_chunk_t *)malloc(sizeof(ht_msgbuf_chunk_t) + cap)) == NULL)
+        return NULL;
+    mc->mc_refs  = 1;
+    mc->mc_class = c;
+    mc->mc_size  = cap;
+    return mc;
+}
+
+/* drop a reference to a chunk, recycling it with the last one */
+static void
+ht_msgbuf_chunk_put(ht_msgbuf_chunk_t *mc)
+{
+    int c = mc->mc_class;
+
+    if (__atomic_sub_fetch(&mc->mc_refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (c >= 0) {
+        pthread_mutex_lock(&ht_msgbuf_pool[c].lock);
+        if (ht_msgbuf_pool[c].count < HT_MSGBUF_CACHE) {
+            mc->mc_next = ht_msgbuf_pool[c].free;
+            ht_msgbuf_pool[c].free = mc;
+            ht_msgbuf_pool[c].count++;
+            mc = NULL;
+        }
+        pthread_mutex_unlock(&ht_msgbuf_pool[c].lock);
+    }
+    if (mc != NULL)
+        free(mc);
+    return;
+}
+
+/* get a buffer header describing a slice of a chunk */
+static ht_msgbuf_t
+ht_msgbuf_header(ht_msgbuf_chunk_t *mc, size_t off, size_t len)
+{
+    ht_msgbuf_t mb;
+
+    pthread_mutex_lock(&ht_msgbuf_lock);
+    if ((mb = ht_msgbuf_free_) != NULL) {
+        ht_msgbuf_free_ = mb->mb_next;
+        ht_msgbuf_count--;
+    }
+    pthread_mutex_unlock(&ht_msgbuf_lock);
+    if (mb == NULL)
+        if ((mb = (ht_msgbuf_t)malloc(sizeof(struct ht_msgbuf_st))) == NULL)
+            return NULL;
+    mb->mb_msg.m_replyport = NULL;
+    mb->mb_msg.m_data      = ht_msgbuf_chunk_data(mc) + off;
+    mb->mb_msg.m_size      = len;
+    mb->mb_chunk           = mc;
+    mb->mb_off             = off;
+    return mb;
+}
+
+/* allocate a buffer of the given size */
+ht_msgbuf_t
+ht_msgbuf_alloc(size_t size)
+{
+    ht_msgbuf_chunk_t *mc;
+    ht_msgbuf_t mb;
+
+    if (size > UINT_MAX)
+        return ht_error((ht_msgbuf_t)NULL, EINVAL);
+    if ((mc = ht_msgbuf_chunk_get(size)) == NULL)
+        return ht_error((ht_msgbuf_t)NULL, ENOMEM);
+    if ((mb = ht_msgbuf_header(mc, 0, size)) == NULL) {
+        ht_msgbuf_chunk_put(mc);
+        return ht_error((ht_msgbuf_t)NULL, ENOMEM);
+    }
+    return mb;
+}
+
+/* a new buffer sharing part of the payload of another one */
+ht_msgbuf_t
+ht_msgbuf_slice(ht_msgbuf_t mb, size_t off, size_t len)
+{
+    ht_msgbuf_t ms;
+
+    if (mb == NULL || off > mb->mb_msg.m_size || len > mb->mb_msg.m_size - off)
+        return ht_error((ht_msgbuf_t)NULL, EINVAL);
+    __atomic_add_fetch(&mb->mb_chunk->mc_refs, 1, __ATOMIC_RELAXED);
+    if ((ms = ht_msgbuf_header(mb->mb_chunk, mb->mb_off + off, len)) == NULL) {
+        ht_msgbuf_chunk_put(mb->mb_chunk);
+        return ht_error((ht_msgbuf_t)NULL, ENOMEM);
+    }
+    return ms;
+}
+
+/* a new buffer sharing the whole payload of another one */
+ht_msgbuf_t
+ht_msgbuf_ref(ht_msgbuf_t mb)
+{
+    if (mb == NULL)
+        return ht_error((ht_msgbuf_t)NULL, EINVAL);
+    return ht_msgbuf_slice(mb, 0, mb->mb_msg.m_size);
+}
+
+/* whether other buffers still share the chunk of a buffer */
+static int
+ht_msgbuf_shared(ht_msgbuf_t mb)
+{
+    return (__atomic_load_n(&mb->mb_chunk->mc_refs, __ATOMIC_ACQUIRE) > 1);
+}
+
+/* grow or shrink a buffer within its chunk; only a buffer owning its
+   chunk alone may grow, it would expose the bytes of others otherwise */
+int
+ht_msgbuf_resize(ht_msgbuf_t mb, size_t size)
+{
+    if (mb == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (size > mb->mb_chunk->mc_size - mb->mb_off || size > UINT_MAX)
+        return ht_error(FALSE, ENOSPC);
+    if (size > mb->mb_msg.m_size && ht_msgbuf_shared(mb))
+        return ht_error(FALSE, EBUSY);
+    mb->mb_msg.m_size = size;
+    return TRUE;
+}
+
+/* payload and size of a buffer */
+void *
+ht_msgbuf_data(ht_msgbuf_t mb)
+{
+    if (mb == NULL)
+        return ht_error((void *)NULL, EINVAL);
+    return mb->mb_msg.m_data;
+}
+
+size_t
+ht_msgbuf_size(ht_msgbuf_t mb)
+{
+    if (mb == NULL)
+        return ht_error((size_t)0, EINVAL);
+    return mb->mb_msg.m_size;
+}
+
+/* release a buffer */
+void
+ht_msgbuf_free(ht_msgbuf_t mb)
+{
+    if (mb == NULL)
+        return;
+    ht_msgbuf_chunk_put(mb->mb_chunk);
+    pthread_mutex_lock(&ht_msgbuf_lock);
+    if (ht_msgbuf_count < HT_MSGBUF_CACHE * HT_MSGBUF_CLASSES) {
+        mb->mb_next = ht_msgbuf_free_;
+        ht_msgbuf_free_ = mb;
+        ht_msgbuf_count++;
+        mb = NULL;
+    }
+    pthread_mutex_unlock(&ht_msgbuf_lock);
+    if (mb != NULL)
+        free(mb);
+    return;
+}
+
+/* read into a buffer, using all room left in its chunk; a shared
+   chunk is left alone, the other holders still see its payload */
+ssize_t
+ht_msgbuf_read(int fd, ht_msgbuf_t mb)
+{
+    ssize_t n;
+
+    if (mb == NULL)
+        return ht_error(-1, EINVAL);
+    if (ht_msgbuf_shared(mb))
+        return ht_error(-1, EBUSY);
+    if ((n = ht_read(fd, mb->mb_msg.m_data, mb->mb_chunk->mc_size - mb->mb_off)) >= 0)
+        mb->mb_msg.m_size = n;
+    return n;
+}
+
+/* write several buffers with one vectored write */
+ssize_t
+ht_msgbuf_writev(int fd, ht_msgbuf_t *mbs, int n)
+{
+    struct iovec iov[n > 0 && n < UIO_MAXIOV ? n : UIO_MAXIOV];
+    int i;
+
+    if (mbs == NULL || n <= 0)
+        return ht_error(-1, EINVAL);
+    if (n > UIO_MAXIOV)
+        n = UIO_MAXIOV;
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = mbs[i]->mb_msg.m_data;
+        iov[i].iov_len  = mbs[i]->mb_msg.m_size;
+    }
+    return ht_writev(fd, iov, n);
+}
+
+/* release the cached chunks and headers */
+void
+ht_msgbuf_drop(void)
+{
+    ht_msgbuf_chunk_t *mc;
+    ht_msgbuf_t mb;
+    int c;
+
+    for (c = 0; c < HT_MSGBUF_CLASSES; c++) {
+        pthread_mutex_lock(&ht_msgbuf_pool[c].lock);
+        while ((mc = ht_msgbuf_pool[c].free) != NULL) {
+            ht_msgbuf_pool[c].free = mc->mc_next;
+            free(mc);
+        }
+        ht_msgbuf_pool[c].count = 0;
+        pthread_mutex_unlock(&ht_msgbuf_pool[c].lock);
+    }
+    pthread_mutex_lock(&ht_msgbuf_lock);
+    while ((mb = ht_msgbuf_free_) != NULL) {
+        ht_msgbuf_free_ = mb->mb_next;
+        free(mb);
+    }
+    ht_msgbuf_count = 0;
+    pthread_mutex_unlock(&ht_msgbuf_lock);
+    return;
+}
@@ -0,0 +1,99 @@
+#include "ht_p.h"
+#include "ht_test.h"
+
+/* test slicing, sharing and recycling */
+void
+test1()
+{
+   ht_msgbuf_t mb, s1, s2;
+   char *p;
+
+   mb = ht_msgbuf_alloc(100);
+   HT_TEST_ASSERT(mb != NULL && ht_msgbuf_size(mb) == 100, "ht_msgbuf_alloc() failed.");
+   memcpy(ht_msgbuf_data(mb), "header:payload", 14);
+   HT_TEST_ASSERT(ht_msgbuf_resize(mb, 14), "ht_msgbuf_resize() failed.");
+   HT_TEST_ASSERT(!ht_msgbuf_resize(mb, 1000) && errno == ENOSPC,
+                  "ht_msgbuf_resize() grew beyond the chunk.");
+   s1 = ht_msgbuf_slice(mb, 7, 7);
+   HT_TEST_ASSERT(s1 != NULL && memcmp(ht_msgbuf_data(s1), "payload", 7) == 0,
+                  "ht_msgbuf_slice() did not share the payload.");
+   HT_TEST_ASSERT(ht_msgbuf_slice(mb, 10, 7) == NULL && errno == EINVAL,
+                  "ht_msgbuf_slice() exceeded the buffer.");
+   s2 = ht_msgbuf_ref(s1);
+   p = ht_msgbuf_data(mb);
+   ht_msgbuf_free(mb);
+   ht_msgbuf_free(s1);
+   HT_TEST_ASSERT(memcmp(ht_msgbuf_data(s2), "payload", 7) == 0,
+                  "payload did not survive while referenced.");
+   ht_msgbuf_free(s2);
+   mb = ht_msgbuf_alloc(200);
+   HT_TEST_ASSERT(ht_msgbuf_data(mb) == p, "chunk was not recycled.");
+   ht_msgbuf_free(mb);
+}
+
+/* test a buffer travelling through a port from read to writev */
+void
+test2()
+{
+   ht_msgport_t mp = ht_msgport_create(NULL);
+   ht_msgbuf_t mb, out[2];
+   int fds[2];
+   char line[32];
+
+   HT_TEST_ASSERT(pipe(fds) == 0, "pipe() failed.");
+   HT_TEST_ASSERT(write(fds[1], "GET /index", 10) == 10, "write() failed.");
+   mb = ht_msgbuf_alloc(4096);
+   HT_TEST_ASSERT(ht_msgbuf_read(fds[0], mb) == 10 && ht_msgbuf_size(mb) == 10,
+                  "ht_msgbuf_read() failed.");
+   ht_msgport_put(mp, (ht_message_t *)mb);
+   mb = (ht_msgbuf_t)ht_msgport_get(mp);
+   out[0] = ht_msgbuf_slice(mb, 4, 6);
+   out[1] = ht_msgbuf_slice(mb, 0, 4);
+   HT_TEST_ASSERT(ht_msgbuf_writev(fds[1], out, 2) == 10, "ht_msgbuf_writev() failed.");
+   HT_TEST_ASSERT(read(fds[0], line, sizeof(line)) == 10 && memcmp(line, "/indexGET ", 10) == 0,
+                  "ht_msgbuf_writev() wrote the wrong bytes.");
+   ht_msgbuf_free(out[0]);
+   ht_msgbuf_free(out[1]);
+   ht_msgbuf_free(mb);
+   ht_msgport_destroy(mp);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+/* test that shared payload is neither overwritten nor exposed */
+void
+test3()
+{
+   ht_msgbuf_t mb, s;
+   int fds[2];
+
+   HT_TEST_ASSERT(pipe(fds) == 0, "pipe() failed.");
+   mb = ht_msgbuf_alloc(64);
+   memcpy(ht_msgbuf_data(mb), "keep", 4);
+   ht_msgbuf_resize(mb, 2);
+   s = ht_msgbuf_slice(mb, 0, 2);
+   HT_TEST_ASSERT(!ht_msgbuf_resize(mb, 4) && errno == EBUSY,
+                  "ht_msgbuf_resize() grew a shared buffer.");
+   HT_TEST_ASSERT(ht_msgbuf_resize(mb, 1), "ht_msgbuf_resize() did not shrink a shared buffer.");
+   HT_TEST_ASSERT(write(fds[1], "lost", 4) == 4, "write() failed.");
+   HT_TEST_ASSERT(ht_msgbuf_read(fds[0], mb) == -1 && errno == EBUSY,
+                  "ht_msgbuf_read() wrote into a shared chunk.");
+   HT_TEST_ASSERT(memcmp(ht_msgbuf_data(s), "ke", 2) == 0, "shared payload was overwritten.");
+   ht_msgbuf_free(s);
+   HT_TEST_ASSERT(ht_msgbuf_read(fds[0], mb) == 4 && memcmp(ht_msgbuf_data(mb), "lost", 4) == 0,
+                  "ht_msgbuf_read() failed once the chunk was owned alone.");
+   ht_msgbuf_free(mb);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+int
+main()
+{
+   ht_init();
+   test1();
+   test2();
+   test3();
+   ht_kill();
+   return 0;
+}
@@ -19,6 +19,11 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
 #include <time.h>
 #include <ucontext.h>
 #include <pthread.h>
@@ -97,13 +102,17 @@ struct ht_mctx_st {
 extern int ht_mctx_set(ht_mctx_t *, void (*)(void), char *, char *);
 
 /* ht_clean.c */
-typedef struct ht_cleanup_st ht_cleanup_t;
-struct ht_cleanup_st {
-    ht_cleanup_t *next;
-    void (*func)(void *);
-    void *arg;
-};
 extern void ht_cleanup_popall(ht_t, int);
+extern void ht_cleanup_drop(ht_t);
+/* ht_worker.c: units of work for the worker pool */
+typedef struct ht_task_st *ht_task_t;
+struct ht_task_st {
+   ht_t            tk_tid;              /* handed-out thread, or NULL for a job */
+   void            (*tk_func)(void *);  /* job routine                          */
+   void            *tk_arg;             /* job argument                         */
+   ht_taskgroup_t  tk_group;            /* group the job reports to             */
+   int             tk_owned;            /* freed by the worker after the run    */
+};
 /* ht_tcb.c */
 #define HT_TCB_NAMELEN 40
     /* thread control block */
@@ -115,6 +124,7 @@ struct ht_st {
 
    /* standard thread control block ingredients */
    int            prio;                 /* base priority of thread                     */
+   int            prio_base;            /* priority without mutex inheritance          */
    char           name[HT_TCB_NAMELEN];/* name of thread (mainly for debugging)       */
    int            dispatches;           /* total number of thread dispatches           */
    ht_state_t     state;                /* current state indicator for thread          */
@@ -123,9 +133,13 @@ struct ht_st {
    ht_time_t      spawned;              /* time point at which thread was spawned      */
    ht_time_t      lastran;              /* time point at which thread was last running */
    ht_time_t      running;              /* time range the thread was already running   */
+   int            timerslack;           /* timer slack in usec, -1 for the global one  */
+   ht_time_t      deadline;             /* blocking calls fail after it, zero for none */
+   int            deadline_wait;        /* the current wait is bounded by the deadline */
 
    /* event handling */
    ht_event_t     events;               /* events the tread is waiting for             */
+   struct ht_task_st task;              /* worker task while handed out                */
 
    /* machine context */
    ht_mctx_t      mctx;                 /* last saved machine state of thread          */
@@ -142,12 +156,15 @@ struct ht_st {
 
    /* per-thread specific storage */
    const void     **data_value;           /* thread specific  values          */
+   unsigned long  *data_used;           /* bitmap of keys with a value        */
+   int            data_size;            /* number of keys data_value covers   */
    int            data_count;           /* number of stored values            */
 
    /* cancellation support */
    int            cancelreq;            /* cancellation request is pending    */
    unsigned int   cancelstate;          /* cancellation state of thread       */
    ht_cleanup_t   *cleanups;             /* stack of thread cleanup handlers  */
+   ht_cleanup_t   *cleanfree;            /* recycled heap cleanup frames      */
 
    /* mutex ring */
    ht_ring_t      mutexring;            /* ring of aquired mutex structures   */
@@ -157,25 +174,37 @@ extern void ht_tcb_free(ht_t);
 /* ht_tqueue.c */
 typedef struct ht_tqueue_st ht_tqueue_t;
 struct ht_tqueue_st {
-   ht_t*           q_list;
+   ht_task_t*      q_list;
    int             q_size;
    int             q_head;
    int             q_rear;
-   int             q_isfull;            /* since both empty and full lead to
-                                           head==rear, set extra flag to indicate 
-                                           these two states   */
+   int             q_count;             /* number of queued elements, since
+                                           both empty and full lead to
+                                           head==rear                        */
+   int             q_idle;              /* consumers blocked in dequeue     */
    pthread_mutex_t q_lock;
    pthread_cond_t  q_not_empty;
    pthread_cond_t  q_not_full;
 };
 extern int ht_tqueue_init(ht_tqueue_t *, int size);
-extern int ht_tqueue_enqueue(ht_tqueue_t *, ht_t);
-extern ht_t ht_tqueue_dequeue(ht_tqueue_t *); 
+#define HT_TQUEUE_BATCH 32                  /* max hand-outs published at once  */
+extern int ht_tqueue_enqueue(ht_tqueue_t *, ht_task_t);
+extern int ht_tqueue_enqueue_n(ht_tqueue_t *, ht_task_t *, int);
+extern int ht_tqueue_tryenqueue_n(ht_tqueue_t *, ht_task_t *, int);
+extern ht_task_t ht_tqueue_dequeue(ht_tqueue_t *); 
+extern int ht_tqueue_dequeue_n(ht_tqueue_t *, ht_task_t *, int);
 extern unsigned int ht_tqueue_elements(ht_tqueue_t *);
 extern void ht_tqueue_destroy(ht_tqueue_t *);
 /* ht_worker.c */
+struct ht_taskgroup_st {
+   int             tg_pending;          /* jobs spawned but not yet finished    */
+   ht_event_t      tg_ev;               /* event of the waiting thread          */
+   pthread_mutex_t tg_lock;             /* guards tg_ev against the last job    */
+};
 extern int ht_worker_init(int);
 extern int ht_worker_kill();
+extern void ht_worker_release_batch(void);
+extern void ht_worker_task_done(ht_event_t);
 /* ht_pqueue.c */
 typedef struct ht_pqueue_st ht_pqueue_t;
 struct ht_pqueue_st {
@@ -201,15 +230,31 @@ extern int ht_pqueue_contains(ht_pqueue_t *, ht_t);
 /* ht_util.c */
 #define ht_util_min(a,b) \
            ((a) > (b) ? (b) : (a))
+#define ht_util_max(a,b) \
+           ((a) < (b) ? (b) : (a))
+#if defined(__i386__) || defined(__x86_64__)
+#define ht_util_cpu_relax() __builtin_ia32_pause()
+#else
+#define ht_util_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 extern char *ht_util_cpystrn(char *, const char *, size_t);
 extern int ht_util_fd_valid(int);
 extern void ht_util_fds_merge(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
 extern int ht_util_fds_test(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
 extern int ht_util_fds_select(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
 /* ht_sched.c  */
+#define HT_SCHED_NATIVE 1      /* ht_sched_here: the scheduler's kernel thread */
+#define HT_SCHED_LENT   2      /* ht_sched_here: foreign thread holding the floor */
 extern ht_t ht_main;
 extern ht_t ht_sched;
-extern ht_t ht_current;
+/* green threads migrate between kernel threads in the middle of a
+   function, so the address of these per kernel thread variables must
+   not be kept across a context switch: they are only reached through
+   accessors the compiler can neither inline nor analyse */
+extern ht_t *ht_current_slot(void) __attribute__((noinline, noipa));
+extern int *ht_sched_here_slot(void) __attribute__((noinline, noipa));
+#define ht_current    (*ht_current_slot())
+#define ht_sched_here (*ht_sched_here_slot())
 extern ht_pqueue_t ht_NQ;
 extern ht_pqueue_t ht_RQ;
 extern ht_pqueue_t ht_WQ;
@@ -224,6 +269,22 @@ extern void ht_scheduler_drop(void);
 extern void ht_scheduler_kill(void);
 extern void *ht_scheduler(void *);
 extern void ht_sched_eventmanager(ht_time_t *, int);
+extern void ht_sched_notify(void);
+extern void ht_sched_enter(void);
+extern void ht_sched_leave(int);
+extern void ht_sched_await(void);
+typedef struct ht_waiter_st ht_waiter_t;
+struct ht_waiter_st {                   /* a parked green or kernel thread      */
+    ht_t            w_tid;              /* green thread, NULL for kernel thread */
+    ht_event_t      w_ev;               /* wake-up event of a green thread      */
+    int             w_woken;            /* futex word of a kernel thread        */
+    int             w_index;            /* set by the waker                     */
+    int             w_result;           /* set by the waker                     */
+    void           *w_data;             /* handoff slot                         */
+};
+extern void ht_waiter_init(ht_waiter_t *);
+extern void ht_waiter_park(ht_waiter_t *);
+extern void ht_waiter_wake(ht_waiter_t *);
 
 /* ht_debug.c  */
 #ifndef HT_DEBUG
@@ -291,6 +352,7 @@ struct ht_attr_st {
        unsigned int a_cancelstate;
        unsigned int a_stacksize;
        char        *a_stackaddr;
+       int          a_timerslack;
 };
 extern int ht_attr_ctrl(int, ht_attr_t, int, va_list);
 /* ht_time.c */
@@ -302,7 +364,7 @@ extern int ht_attr_ctrl(int, ht_attr_t, int, va_list);
 #define ht_time_set(t1,t2) \
     do { \
         if ((t2) == HT_TIME_NOW) \
-            gettimeofday((t1), NULL); \
+            ht_time_now(t1); \
         else { \
             (t1)->tv_sec  = (t2)->tv_sec; \
             (t1)->tv_usec = (t2)->tv_usec; \
@@ -323,6 +385,11 @@ extern int ht_attr_ctrl(int, ht_attr_t, int, va_list);
         (t1)->tv_usec += 1000000; \
     }
 extern void ht_time_usleep(unsigned long);
+extern void ht_time_now(ht_time_t *);
+extern unsigned long long ht_time_ns(void);
+extern void ht_time_coalesce(ht_time_t *, int);
+#define ht_time_slackof(t) \
+    ((t)->timerslack >= 0 ? (t)->timerslack : ht_time_slack)
 extern int ht_time_cmp(ht_time_t *, ht_time_t *);
 extern void ht_time_div(ht_time_t *, int);
 extern void ht_time_mul(ht_time_t *, int);
@@ -330,12 +397,105 @@ extern double ht_time_t2d(ht_time_t *);
 extern int ht_time_t2i(ht_time_t *);
 extern int ht_time_pos(ht_time_t *);
 extern ht_time_t ht_time_zero;
+extern ht_time_t ht_time_pass;
+extern int ht_time_slack;
 /* ht_msg.c */
 struct ht_msgport_st {
     ht_ringnode_t mp_node;  /* maintainance node handle */
     const char    *mp_name;  /* optional name of message port */
+    unsigned int  mp_hash;  /* hash value of the name */
     ht_t          mp_tid;   /* corresponding thread */
     ht_ring_t     mp_queue; /* queue of messages pending on port */
+    ht_message_t  *mp_inbox; /* messages posted by foreign kernel threads */
+};
+extern void ht_msgport_drain(ht_msgport_t);
+/* ht_chan.c */
+struct ht_chan_st {
+    void          **ch_buf;             /* ring buffer of values            */
+    int             ch_size;            /* capacity, 0 for rendezvous       */
+    int             ch_head;
+    int             ch_count;
+    int             ch_closed;
+    ht_ring_t       ch_sendq;           /* parked senders                   */
+    ht_ring_t       ch_recvq;           /* parked receivers                 */
+};
+/* ht_stage.c */
+struct ht_stage_st {
+    const char       *st_name;
+    ht_stage_func_t   st_func;          /* handler called with message batches   */
+    void             *st_arg;
+    int               st_capacity;      /* max queued messages                   */
+    int               st_concurrency;   /* number of runner threads              */
+    int               st_batch;         /* max messages per handler call         */
+    int               st_mode;          /* HT_STAGE_GREEN or HT_STAGE_WORKER     */
+    int               st_closing;       /* stage refuses new messages            */
+    ht_msgport_t      st_port;          /* the queue                             */
+    int               st_depth;         /* queued messages                       */
+    ht_time_t        *st_stamp;         /* enqueue times, in step with st_port   */
+    int               st_stamp_head;
+    ht_t             *st_runner;
+    ht_message_t     *st_stop;          /* one stop marker per runner            */
+    ht_mutex_t        st_mutex;         /* producers waiting for room            */
+    ht_cond_t         st_room;
+    int               st_waiting;
+    int               st_refs;          /* the stage's own and one per producer  */
+    unsigned long long st_wait_sum;     /* usec messages spent queued            */
+    unsigned long long st_run_sum;      /* usec spent in the handler             */
+    ht_stage_stats_t  st_stats;
+};
+/* ht_msgbuf.c */
+typedef struct ht_msgbuf_chunk_st ht_msgbuf_chunk_t;
+struct ht_msgbuf_chunk_st {
+    ht_msgbuf_chunk_t *mc_next;         /* free list link                   */
+    int                mc_refs;         /* buffers sharing the chunk        */
+    int                mc_class;        /* size class, -1 if not pooled     */
+    size_t             mc_size;         /* payload capacity                 */
+} __attribute__((aligned(16)));         /* the payload follows              */
+struct ht_msgbuf_st {
+    ht_message_t       mb_msg;          /* must be first: m_data/m_size is the slice */
+    ht_msgbuf_chunk_t *mb_chunk;
+    size_t             mb_off;          /* offset of the slice in the chunk */
+    ht_msgbuf_t        mb_next;         /* free list link                   */
+};
+extern void ht_msgbuf_drop(void);
+/* ht_lockprof.c */
+enum { HT_LOCKPROF_MUTEX, HT_LOCKPROF_RWLOCK, HT_LOCKPROF_COND };
+typedef struct ht_lockprof_st ht_lockprof_t;
+struct ht_lockprof_st {
+    ht_lockprof_t     *lp_next;
+    int                lp_kind;
+    void              *lp_site;         /* init call site if not named      */
+    char               lp_name[32];
+    unsigned long long lp_acquires;     /* acquisitions, or waits of a cond */
+    unsigned long long lp_contended;    /* acquisitions which had to wait   */
+    unsigned long long lp_wait_total;   /* in nanoseconds                   */
+    unsigned long long lp_wait_max;
+    unsigned long long lp_holds;        /* sampled holds                    */
+    unsigned long long lp_hold_total;
+    unsigned long long lp_hold_max;
+};
+extern int ht_lockprof_enabled;
+extern ht_lockprof_t *ht_lockprof_site(int, const char *, void *);
+extern void ht_lockprof_acquired(ht_lockprof_t *, unsigned long long, unsigned long long *);
+extern void ht_lockprof_released(ht_lockprof_t *, unsigned long long);
+extern void ht_lockprof_dump(FILE *);
+/* ht_shmport.c */
+typedef struct ht_shmring_st ht_shmring_t;
+struct ht_shmring_st {                  /* head of the shared segment       */
+    unsigned int   sr_magic;            /* set once the ring is laid out    */
+    unsigned int   sr_slots;            /* number of slots, a power of two  */
+    unsigned int   sr_stride;           /* bytes per slot                   */
+    unsigned int   sr_slotsize;         /* max payload per slot             */
+    int            sr_rwait;            /* receivers sleeping on the rx FIFO */
+    int            sr_swait;            /* senders sleeping on the tx FIFO  */
+    unsigned long  sr_tail __attribute__((aligned(64)));
+    unsigned long  sr_head __attribute__((aligned(64)));
+} __attribute__((aligned(64)));         /* the slots follow                 */
+struct ht_shmport_st {
+    ht_shmring_t  *sp_ring;
+    size_t         sp_maplen;
+    int            sp_rbell;            /* FIFO receivers sleep on          */
+    int            sp_sbell;            /* FIFO senders sleep on            */
 };
 /* ht_event.c */
 typedef int (*ht_event_func_t)(void *);
@@ -350,13 +510,14 @@ struct ht_event_st {
         struct { int *n; int nfd; fd_set *rfds, *wfds, *efds; }     SELECT;
 		  struct { int fini; }                                        TASK;
         struct { ht_time_t tv; }                                    TIME;
-        struct { ht_msgport_t mp; }                                 MSG;
+        struct { ht_msgport_t mp; int min; }                        MSG;
         struct { ht_mutex_t *mutex; }                               MUTEX;
         struct { ht_cond_t *cond; }                                 COND;
         struct { ht_t tid; }                                        TID;
         struct { ht_event_func_t func; void *arg; ht_time_t tv; }   FUNC;
     } ev_args;
 };
+extern int ht_event_wait(ht_event_t, int);
 /* ht_ring.c */
 /* return number of nodes in ring; O(1) */
 #define ht_ring_elements(r) \
@@ -398,6 +559,8 @@ extern int ht_ring_contains(ht_ring_t *, ht_ringnode_t *);
         ht_init();
 extern int ht_initialized;
 extern int ht_thread_exists(ht_t);
+extern int ht_fdmode_async(int);
+extern void ht_fdmode_reset(int);
 extern void ht_thread_cleanup(ht_t);
 /* ht_high.c */
 extern ssize_t ht_readv_faked(int, const struct iovec *, int);
@@ -408,5 +571,6 @@ extern ssize_t ht_writev_faked(int, const struct iovec *, int);
 extern void ht_key_destroydata(ht_t);
 /* ht_sync.c */
 extern void ht_mutex_releaseall(ht_t);
+extern void ht_mutex_inherit(ht_t);
 
 #endif /* _HT_P_H_ */
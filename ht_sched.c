@@ -5,7 +5,8 @@
 
 ht_t         ht_main;       /* the main thread                       */
 ht_t         ht_sched;      /* the permanent scheduler thread        */
-ht_t         ht_current;    /* the currently running thread          */
+static __thread ht_t ht_current_tls;   /* the currently running thread (on this kernel thread) */
+static __thread int ht_sched_here_tls; /* whether this kernel thread may enter the scheduler */
 ht_pqueue_t  ht_NQ;         /* queue of new threads                  */
 ht_pqueue_t  ht_RQ;         /* queue of threads ready to run         */
 ht_pqueue_t  ht_WQ;         /* queue of threads waiting for an event */
@@ -17,6 +18,36 @@ float        ht_loadval;    /* average scheduler load value          */
 static ht_time_t   ht_loadticknext;
 static ht_time_t   ht_loadtickgap = HT_TIME(1,0);
 
+static ht_task_t  *ht_TB;                  /* hand-outs collected in this pass  */
+static int         ht_TB_size;             /* allocated slots in ht_TB          */
+static int         ht_TB_num;              /* number of collected hand-outs     */
+static int         ht_TB_pass;             /* dispatches left in this pass      */
+
+static int             ht_sched_bell = -1;  /* doorbell for foreign kernel threads */
+static int             ht_sched_timer = -1; /* timerfd for the earliest deadline    */
+static ht_time_t       ht_sched_armed;      /* deadline it is armed for, or zero    */
+static pthread_mutex_t ht_floor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ht_floor_cond = PTHREAD_COND_INITIALIZER;
+static int             ht_floor_wait;       /* foreign threads waiting for the floor */
+static int             ht_floor_quota;      /* sessions granted in this lending      */
+static int             ht_floor_busy;       /* floor currently lent out              */
+static int             ht_floor_watch;      /* foreign threads awaiting a next pass  */
+static unsigned long   ht_floor_gen;        /* counts passes and floor sessions      */
+static __thread unsigned long ht_floor_seen;
+
+/* the per kernel thread variables, see ht_p.h */
+ht_t *
+ht_current_slot(void)
+{
+    return &ht_current_tls;
+}
+
+int *
+ht_sched_here_slot(void)
+{
+    return &ht_sched_here_tls;
+}
+
 /* initialize the scheduler ingredients */
 int 
 ht_scheduler_init(void)
@@ -24,6 +55,19 @@ ht_scheduler_init(void)
     /* initialize the essential threads */
     ht_sched   = NULL;
     ht_current = NULL;
+    ht_sched_here = HT_SCHED_NATIVE;
+
+    /* initialize the doorbell foreign kernel threads ring */
+    if ((ht_sched_bell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+        return FALSE;
+
+    /* initialize the timer the scheduler sleeps on */
+    if ((ht_sched_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1) {
+        close(ht_sched_bell);
+        ht_sched_bell = -1;
+        return FALSE;
+    }
+    ht_time_set(&ht_sched_armed, HT_TIME_ZERO);
 
     /* initalize the thread queues */
     ht_pqueue_init(&ht_NQ);
@@ -34,11 +78,24 @@ ht_scheduler_init(void)
 
     /* initialize scheduling hints */
     ht_favournew = 1; /* the default is the original behaviour */
+    ht_time_slack = 0; /* timers expire at their exact deadline */
 
     /* initialize load support */
     ht_loadval = 1.0;
     ht_time_set(&ht_loadticknext, HT_TIME_NOW);
 
+    /* initialize hand-out batching */
+    ht_TB_size = HT_TQUEUE_BATCH;
+    if ((ht_TB = (ht_task_t *)malloc(sizeof(ht_task_t) * ht_TB_size)) == NULL) {
+        close(ht_sched_timer);
+        ht_sched_timer = -1;
+        close(ht_sched_bell);
+        ht_sched_bell = -1;
+        return FALSE;
+    }
+    ht_TB_num  = 0;
+    ht_TB_pass = 0;
+
     return TRUE;
 }
 
@@ -82,6 +139,194 @@ ht_scheduler_kill(void)
     /* drop all threads */
     ht_scheduler_drop();
 
+    /* release the hand-out batch */
+    free(ht_TB);
+    ht_TB = NULL;
+    ht_TB_num = 0;
+
+    /* close the doorbell */
+    close(ht_sched_bell);
+    ht_sched_bell = -1;
+    ht_sched_here = FALSE;
+
+    /* close the timer */
+    close(ht_sched_timer);
+    ht_sched_timer = -1;
+
+    return;
+}
+
+/*
+ * Foreign kernel threads (the workers running handed-out threads) must
+ * not touch the scheduler's queues while the scheduler runs. Instead
+ * they borrow the "floor": they ring the doorbell and the scheduler
+ * parks at the start of its next event manager pass until they are
+ * done. Inside such a session all non-yielding ht_* functions can be
+ * used as if called from the scheduler's kernel thread.
+ */
+
+/* wake up the scheduler from any kernel thread */
+void 
+ht_sched_notify(void)
+{
+    uint64_t one = 1;
+
+    while (write(ht_sched_bell, &one, sizeof(one)) < 0 && errno == EINTR) ;
+    return;
+}
+
+/* borrow the floor from the scheduler (foreign kernel threads only) */
+void 
+ht_sched_enter(void)
+{
+    pthread_mutex_lock(&ht_floor_lock);
+    ht_floor_wait++;
+    ht_sched_notify();
+    while (ht_floor_quota == 0 || ht_floor_busy)
+        pthread_cond_wait(&ht_floor_cond, &ht_floor_lock);
+    ht_floor_wait--;
+    ht_floor_quota--;
+    ht_floor_busy = TRUE;
+    pthread_mutex_unlock(&ht_floor_lock);
+    ht_sched_here = HT_SCHED_LENT;
+    return;
+}
+
+/* give the floor back; with watch set the caller
+   is going to ht_sched_await() something to change */
+void 
+ht_sched_leave(int watch)
+{
+    ht_sched_here = FALSE;
+    pthread_mutex_lock(&ht_floor_lock);
+    ht_floor_busy = FALSE;
+    ht_floor_gen++;
+    if (watch) {
+        ht_floor_watch++;
+        ht_floor_seen = ht_floor_gen;
+    }
+    pthread_cond_broadcast(&ht_floor_cond);
+    pthread_mutex_unlock(&ht_floor_lock);
+    return;
+}
+
+/* sleep until the next scheduler pass or floor session after ht_sched_leave() */
+void 
+ht_sched_await(void)
+{
+    pthread_mutex_lock(&ht_floor_lock);
+    while (ht_floor_gen == ht_floor_seen)
+        pthread_cond_wait(&ht_floor_cond, &ht_floor_lock);
+    ht_floor_watch--;
+    pthread_mutex_unlock(&ht_floor_lock);
+    return;
+}
+
+/*
+ * Waiters park a green thread or a whole kernel thread until another
+ * thread wakes them directly, without the event manager having to
+ * evaluate a condition. A kernel thread sleeps on a futex. A green
+ * thread woken on the scheduler's kernel thread (or under its floor)
+ * is moved to the ready queue right away. Woken from anywhere else, it
+ * is completed like a worker task and picked up by the next pass of
+ * the eventmanager.
+ */
+
+/* prepare a waiter for the calling thread */
+void 
+ht_waiter_init(ht_waiter_t *w)
+{
+    static ht_key_t ev_key = HT_KEY_INIT;
+
+    w->w_woken  = FALSE;
+    w->w_index  = -1;
+    w->w_result = FALSE;
+    w->w_data   = NULL;
+    if (ht_sched_here == HT_SCHED_NATIVE) {
+        w->w_tid = ht_current;
+        w->w_ev  = ht_event(HT_EVENT_TASK|HT_MODE_STATIC, &ev_key);
+    }
+    else {
+        w->w_tid = NULL;
+        w->w_ev  = NULL;
+    }
+    return;
+}
+
+/* park until woken; kernel threads must not hold the floor */
+void 
+ht_waiter_park(ht_waiter_t *w)
+{
+    if (w->w_tid != NULL) {
+        while (!__atomic_load_n(&w->w_woken, __ATOMIC_ACQUIRE))
+            ht_event_wait(w->w_ev, FALSE);
+    }
+    else {
+        /* on a worker, the peer to wake us may wait in our batch */
+        if (!__atomic_load_n(&w->w_woken, __ATOMIC_ACQUIRE))
+            ht_worker_release_batch();
+        while (!__atomic_load_n(&w->w_woken, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &w->w_woken, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    }
+    return;
+}
+
+/* wake a parked waiter */
+void 
+ht_waiter_wake(ht_waiter_t *w)
+{
+    ht_t t;
+
+    if ((t = w->w_tid) == NULL) {
+        __atomic_store_n(&w->w_woken, TRUE, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &w->w_woken, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        return;
+    }
+    if (!ht_sched_here) {
+        /* off the scheduler complete the event like a worker task
+           does and leave the rest to the eventmanager */
+        __atomic_store_n(&w->w_ev->ev_args.TASK.fini, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&w->w_woken, TRUE, __ATOMIC_RELEASE);
+        ht_sched_notify();
+        return;
+    }
+    w->w_woken = TRUE;
+    w->w_ev->ev_args.TASK.fini = 1;
+    w->w_ev->ev_status = HT_STATUS_OCCURRED;
+    if (   t->state == HT_STATE_WAITING && t->events == w->w_ev
+        && !ht_pqueue_contains(&ht_SQ, t)) {
+        ht_pqueue_delete(&ht_WQ, t);
+        t->state = HT_STATE_READY;
+        ht_pqueue_insert(&ht_RQ, t->prio, t);
+    }
+    return;
+}
+
+/* lend the floor to the waiting foreign threads (scheduler only) */
+static 
+void 
+ht_sched_lend(void)
+{
+    /* fast path: nobody interested */
+    if (   __atomic_load_n(&ht_floor_wait,  __ATOMIC_ACQUIRE) == 0
+        && __atomic_load_n(&ht_floor_watch, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    pthread_mutex_lock(&ht_floor_lock);
+    ht_floor_gen++;
+    if (ht_floor_wait > 0) {
+        /* serve only those already waiting, so a stream
+           of foreign calls cannot starve the green threads */
+        ht_floor_quota = ht_floor_wait;
+        pthread_cond_broadcast(&ht_floor_cond);
+        while (ht_floor_quota > 0 || ht_floor_busy)
+            pthread_cond_wait(&ht_floor_cond, &ht_floor_lock);
+        /* late arrivals will find the doorbell rung */
+        if (ht_floor_wait > 0)
+            ht_sched_notify();
+    }
+    pthread_cond_broadcast(&ht_floor_cond);
+    pthread_mutex_unlock(&ht_floor_lock);
     return;
 }
 
@@ -114,6 +359,54 @@ ht_scheduler_kill(void)
         ht_time_add(&ht_loadticknext, &ht_loadtickgap); \
     }
 
+/*
+ * Publish the collected hand-outs to the worker task queue.
+ *
+ * Threads handing themselves out are not pushed to ht_TQ one by one.
+ * Instead they are collected during one pass over the ready queue and
+ * published with a single batched enqueue, which takes the queue lock
+ * once and wakes exactly as many workers as there are threads.
+ *
+ * The scheduler never blocks on a full ht_TQ: the workers may be
+ * waiting for the scheduler's floor themselves. What does not fit
+ * stays collected and is retried on the next pass.
+ */
+static 
+void 
+ht_scheduler_handout(void)
+{
+    int n;
+
+    ht_debug2("ht_scheduler: publish %d thread(s) to worker task queue",
+               ht_TB_num);
+    n = ht_tqueue_tryenqueue_n(&ht_TQ, ht_TB, ht_TB_num);
+    ht_TB_num -= n;
+    if (ht_TB_num > 0)
+        memmove(ht_TB, ht_TB + n, sizeof(ht_task_t) * ht_TB_num);
+    ht_TB_pass = 0;
+}
+
+/* collect a hand-out, growing the batch while ht_TQ is congested */
+static 
+void 
+ht_scheduler_collect(ht_t t)
+{
+    ht_task_t *tb;
+
+    if (ht_TB_num == ht_TB_size) {
+        if ((tb = (ht_task_t *)realloc(ht_TB, sizeof(ht_task_t) * ht_TB_size * 2)) == NULL) {
+            fprintf(stderr, "**Pth** SCHEDULER INTERNAL ERROR: "
+                            "out of memory for hand-outs\n");
+            abort();
+        }
+        ht_TB = tb;
+        ht_TB_size *= 2;
+    }
+    if (ht_TB_num == 0)
+        ht_TB_pass = ht_pqueue_elements(&ht_RQ);
+    ht_TB[ht_TB_num++] = &t->task;
+}
+
 /* the heart of this library: the thread scheduler */
 void 
 *ht_scheduler(void *dummy)
@@ -130,8 +423,9 @@ void
     /* mark this thread as the special scheduler thread */
     ht_sched->state = HT_STATE_SCHEDULER;
 
-    /* initialize the snapshot time for bootstrapping the loop */
-    ht_time_set(&snapshot, HT_TIME_NOW);
+    /* initialize the pass time for bootstrapping the loop */
+    ht_time_set(&ht_time_pass, HT_TIME_NOW);
+    ht_time_set(&snapshot, &ht_time_pass);
 
     /*
      * endless scheduler loop
@@ -154,7 +448,7 @@ void
         /*
          * Update average scheduler load
          */
-        ht_scheduler_load(&snapshot);
+        ht_scheduler_load(&ht_time_pass);
 
         /*
          * Find next thread in ready queue
@@ -175,8 +469,10 @@ void
         ht_debug3("ht_scheduler: switching to thread 0x%lx (\"%s\")",
                    (unsigned long)ht_current, ht_current->name);
 
-        /* update thread times */
-        ht_time_set(&ht_current->lastran, HT_TIME_NOW);
+        /* update thread times (the pass time is fresh enough: only
+           the event manager ran since it was read, and it rereads
+           the clock after sleeping) */
+        ht_time_set(&ht_current->lastran, &ht_time_pass);
 
         /* update scheduler times */
         ht_time_set(&running, &ht_current->lastran);
@@ -187,8 +483,9 @@ void
         ht_current->dispatches++;
         ht_mctx_switch(&ht_sched->mctx, &ht_current->mctx);
 
-        /* update scheduler times */
-        ht_time_set(&snapshot, HT_TIME_NOW);
+        /* update scheduler times; this is the one clock read of the pass */
+        ht_time_set(&ht_time_pass, HT_TIME_NOW);
+        ht_time_set(&snapshot, &ht_time_pass);
         ht_debug3("ht_scheduler: cameback from thread 0x%lx (\"%s\")",
                    (unsigned long)ht_current, ht_current->name);
 
@@ -248,13 +545,14 @@ void
         }
 
         /* If thread wants to be scheduled to native worker thread, 
-			* send the ht_t to worker task queue, then move thread to
-			* wait state.
+			* collect the ht_t for the worker task queue, then move thread to
+			* wait state. The pass ends once every thread which was ready
+			* when the first hand-out arrived had its turn.
          */
 		  if (ht_current != NULL && ht_current->state == HT_STATE_WAITING_FOR_SCHED_TO_WORKER) {
-			  ht_debug2("ht_scheduler: put thread \"%s\" to worker task queue",
+			  ht_debug2("ht_scheduler: collect thread \"%s\" for worker task queue",
 					       ht_current->name);
-			  ht_tqueue_enqueue(&ht_TQ, ht_current);
+			  ht_scheduler_collect(ht_current);
 			  ht_current->state = HT_STATE_WAITING;
 		  }
         /*
@@ -277,6 +575,19 @@ void
         if (ht_current != NULL)
             ht_pqueue_insert(&ht_RQ, ht_current->prio, ht_current);
 
+        /*
+         * Publish collected hand-outs at the end of the pass, when the
+         * batch is full or before the scheduler might go to sleep.
+         */
+        if (ht_TB_num > 0) {
+            if (   ht_TB_num >= HT_TQUEUE_BATCH
+                || ht_TB_pass <= 0
+                || ht_pqueue_elements(&ht_RQ) == 0)
+                ht_scheduler_handout();
+            else
+                ht_TB_pass--;
+        }
+
         /*
          * Manage the events in the waiting queue, i.e. decide whether their
          * events occurred and move them to the ready queue. But wait only if
@@ -285,16 +596,34 @@ void
         if (   ht_pqueue_elements(&ht_RQ) == 0
             && ht_pqueue_elements(&ht_NQ) == 0)
             /* still no NEW or READY threads, so we have to wait for new work */
-            ht_sched_eventmanager(&snapshot, FALSE /* wait */);
+            ht_sched_eventmanager(&ht_time_pass, FALSE /* wait */);
         else
             /* already NEW or READY threads exists, so just poll for even more work */
-            ht_sched_eventmanager(&snapshot, TRUE  /* poll */);
+            ht_sched_eventmanager(&ht_time_pass, TRUE  /* poll */);
     }
 
     /* NOTREACHED */
     return NULL;
 }
 
+/* arm the scheduler timer for an absolute deadline, or disarm it
+   for a zero one; the timer is only touched when the deadline changes */
+static void
+ht_sched_arm(ht_time_t *deadline)
+{
+    struct itimerspec its;
+
+    if (ht_time_equal(*deadline, ht_sched_armed))
+        return;
+    its.it_interval.tv_sec  = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec     = deadline->tv_sec;
+    its.it_value.tv_nsec    = deadline->tv_usec * 1000;
+    timerfd_settime(ht_sched_timer, TFD_TIMER_ABSTIME, &its, NULL);
+    ht_time_set(&ht_sched_armed, deadline);
+    return;
+}
+
 /*
  * Look whether some events already occurred (or failed) and move
  * corresponding threads from waiting queue back to ready queue.
@@ -317,10 +646,11 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
     struct timeval delay;
     struct timeval *pdelay;
     int loop_repeat;
+    int bell_rang;
+    int timer_rang;
     int fdmax;
     int rc;
     int n;
-	 ht_time_t event_task_check_interval = ht_time(0, 10000);  // 10 msec
 
     ht_debug2("ht_sched_eventmanager: enter in %s mode",
                dopoll ? "polling" : "waiting");
@@ -328,6 +658,14 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
     /* entry point for internal looping in event handling */
     loop_entry:
     loop_repeat = FALSE;
+    bell_rang = FALSE;
+    timer_rang = FALSE;
+
+    /* let foreign kernel threads do their calls first,
+       and do not sleep if they readied a thread */
+    ht_sched_lend();
+    if (ht_pqueue_elements(&ht_RQ) > 0)
+        dopoll = TRUE;
 
     /* initialize fd sets */
     FD_ZERO(&rfds);
@@ -349,6 +687,23 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
         if (t->cancelreq == TRUE)
             any_occurred = TRUE;
 
+        /* deadline support: a passed deadline readies the thread,
+           a pending one counts as a timer */
+        if (t->deadline_wait) {
+            if (ht_time_cmp(&t->deadline, now) <= 0)
+                any_occurred = TRUE;
+            else {
+                ht_time_t tv;
+                ht_time_set(&tv, &t->deadline);
+                ht_time_coalesce(&tv, ht_time_slackof(t));
+                if (nexttimer_thread == NULL || ht_time_cmp(&tv, &nexttimer_value) < 0) {
+                    nexttimer_thread = t;
+                    nexttimer_ev = NULL;
+                    ht_time_set(&nexttimer_value, &tv);
+                }
+            }
+        }
+
         /* ... and all their events... */
         if (t->events == NULL)
             continue;
@@ -382,39 +737,33 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
                     if (fdmax < ev->ev_args.SELECT.nfd-1)
                         fdmax = ev->ev_args.SELECT.nfd-1;
                 }
-					 /* Task finished */
-					 else if (ev->ev_type == HT_EVENT_TASK) {
-						  if (ev->ev_args.TASK.fini != 0)
+                /* Task finished (the worker rings the doorbell) */
+                else if (ev->ev_type == HT_EVENT_TASK) {
+                    if (__atomic_load_n(&ev->ev_args.TASK.fini, __ATOMIC_ACQUIRE) != 0)
                         this_occurred = TRUE;
-                    else {     //schedule a timer for next check.
-                        ht_time_t tv;
-                        ht_time_set(&tv, now);
-                        ht_time_add(&tv, &event_task_check_interval);  
-                        if ((nexttimer_thread == NULL && nexttimer_ev == NULL) ||
-                            ht_time_cmp(&tv, &nexttimer_value) < 0) {
-                            nexttimer_thread = t;
-                            nexttimer_ev = ev;
-                            ht_time_set(&nexttimer_value, &tv);
-                        }
-                    }
-					 }
+                }
                 /* Timer */
                 else if (ev->ev_type == HT_EVENT_TIME) {
                     if (ht_time_cmp(&(ev->ev_args.TIME.tv), now) < 0)
                         this_occurred = TRUE;
                     else {
-                        /* remember the timer which will be elapsed next */
+                        /* remember the timer which will be elapsed next,
+                           waking at the end of its slack bucket */
+                        ht_time_t tv;
+                        ht_time_set(&tv, &(ev->ev_args.TIME.tv));
+                        ht_time_coalesce(&tv, ht_time_slackof(t));
                         if ((nexttimer_thread == NULL && nexttimer_ev == NULL) ||
-                            ht_time_cmp(&(ev->ev_args.TIME.tv), &nexttimer_value) < 0) {
+                            ht_time_cmp(&tv, &nexttimer_value) < 0) {
                             nexttimer_thread = t;
                             nexttimer_ev = ev;
-                            ht_time_set(&nexttimer_value, &(ev->ev_args.TIME.tv));
+                            ht_time_set(&nexttimer_value, &tv);
                         }
                     }
                 }
                 /* Message Port Arrivals */
                 else if (ev->ev_type == HT_EVENT_MSG) {
-                    if (ht_ring_elements(&(ev->ev_args.MSG.mp->mp_queue)) > 0)
+                    ht_msgport_drain(ev->ev_args.MSG.mp);
+                    if (ht_ring_elements(&(ev->ev_args.MSG.mp->mp_queue)) >= ev->ev_args.MSG.min)
                         this_occurred = TRUE;
                 }
                 /* Mutex Release */
@@ -451,6 +800,7 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
                         ht_time_t tv;
                         ht_time_set(&tv, now);
                         ht_time_add(&tv, &(ev->ev_args.FUNC.tv));
+                        ht_time_coalesce(&tv, ht_time_slackof(t));
                         if ((nexttimer_thread == NULL && nexttimer_ev == NULL) ||
                             ht_time_cmp(&tv, &nexttimer_value) < 0) {
                             nexttimer_thread = t;
@@ -479,19 +829,28 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
         ht_time_set(&delay, HT_TIME_ZERO);
         pdelay = &delay;
     }
-    else if (nexttimer_ev != NULL) {
-        /* do a polling with a timeout set to the next timer,
-           i.e. wait for the fd sets or the next timer */
-        ht_time_set(&delay, &nexttimer_value);
-        ht_time_sub(&delay, now);
-        pdelay = &delay;
-    }
     else {
-        /* do a polling without a timeout,
-           i.e. wait for the fd sets only with blocking */
+        /* do a polling without a timeout, i.e. wait for the fd sets
+           or the timer, armed at the absolute deadline of the next
+           timer (and disarmed without one) */
+        if (nexttimer_thread != NULL)
+            ht_sched_arm(&nexttimer_value);
+        else
+            ht_sched_arm(&ht_time_zero);
         pdelay = NULL;
     }
 
+    /* a sleeping scheduler has to be woken by foreign kernel
+       threads and by its timer */
+    if (!dopoll) {
+        FD_SET(ht_sched_bell, &rfds);
+        if (fdmax < ht_sched_bell)
+            fdmax = ht_sched_bell;
+        FD_SET(ht_sched_timer, &rfds);
+        if (fdmax < ht_sched_timer)
+            fdmax = ht_sched_timer;
+    }
+
     /* now do the polling for filedescriptor I/O and timers
        WHEN THE SCHEDULER SLEEPS AT ALL, THEN HERE!! */
     rc = -1;
@@ -499,11 +858,23 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
         while ((rc = select(fdmax+1, &rfds, &wfds, &efds, pdelay)) < 0
                && errno == EINTR) ;
 
+    /* after sleeping the pass time is outdated */
+    if (!dopoll)
+        ht_time_set(now, HT_TIME_NOW);
+
+    /* drain the timer; it is disarmed after expiring */
+    if (rc > 0 && FD_ISSET(ht_sched_timer, &rfds)) {
+        uint64_t count;
+        FD_CLR(ht_sched_timer, &rfds);
+        while (read(ht_sched_timer, &count, sizeof(count)) < 0 && errno == EINTR) ;
+        ht_time_set(&ht_sched_armed, HT_TIME_ZERO);
+        timer_rang = TRUE;
+    }
+
     /* if the timer elapsed, handle it */
-    if (!dopoll && rc == 0 && nexttimer_ev != NULL) {
-        if (nexttimer_ev->ev_type == HT_EVENT_FUNC 
-              || nexttimer_ev->ev_type == HT_EVENT_TASK) {
-            /* it was an implicit timer event for a function event or task event,
+    if (!dopoll && timer_rang && nexttimer_ev != NULL) {
+        if (nexttimer_ev->ev_type == HT_EVENT_FUNC) {
+            /* it was an implicit timer event for a function event,
                so repeat the event handling for rechecking the function */
             loop_repeat = TRUE;
         }
@@ -515,6 +886,14 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
         }
     }
 
+    /* drain the doorbell */
+    if (rc > 0 && FD_ISSET(ht_sched_bell, &rfds)) {
+        uint64_t count;
+        FD_CLR(ht_sched_bell, &rfds);
+        while (read(ht_sched_bell, &count, sizeof(count)) < 0 && errno == EINTR) ;
+        bell_rang = TRUE;
+    }
+
     /* if an error occurred, avoid confusion in the cleanup loop */
     if (rc <= 0) {
         FD_ZERO(&rfds);
@@ -656,6 +1035,12 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
             any_occurred = TRUE;
         }
 
+        /* deadline support */
+        if (t->deadline_wait && ht_time_cmp(&t->deadline, now) <= 0) {
+            ht_debug2("ht_sched_eventmanager: deadline passed for thread \"%s\"", t->name);
+            any_occurred = TRUE;
+        }
+
         /* walk to next thread in waiting queue */
         tlast = t;
         t = ht_pqueue_walk(&ht_WQ, t, HT_WALK_NEXT);
@@ -677,11 +1062,16 @@ ht_sched_eventmanager(ht_time_t *now, int dopoll)
         }
     }
 
+    /* the doorbell alone readies nobody, so serve
+       the foreign thread and look again */
+    if (   bell_rang
+        && ht_pqueue_elements(&ht_RQ) == 0
+        && ht_pqueue_elements(&ht_NQ) == 0)
+        loop_repeat = TRUE;
+
     /* perhaps we have to internally loop... */
-    if (loop_repeat) {
-        ht_time_set(now, HT_TIME_NOW);
+    if (loop_repeat)
         goto loop_entry;
-    }
 
     ht_debug1("ht_sched_eventmanager: leaving");
     return;
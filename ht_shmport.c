@@ -0,0 +1,330 @@
+/*
+ *  shared memory message ports
+ *  A port between processes: a bounded ring of fixed size slots in a
+ *  named POSIX shared memory segment, which any process can open by
+ *  name. Payloads are copied into and out of the slots. Senders and
+ *  receivers of all processes reserve slots with atomic sequence
+ *  numbers, so the fast path makes no system call. Only a party which
+ *  found the ring empty (or full) goes to sleep. It sleeps on a named
+ *  FIFO next to the segment. Other processes poke that FIFO, and only
+ *  while somebody is counted as sleeping. The FIFO is a file
+ *  descriptor, so green threads sleep on it through the scheduler's
+ *  event manager like on any other descriptor.
+ */
+
+#include "ht_p.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <poll.h>
+
+#define HT_SHMPORT_MAGIC 0x48545350  /* "HTSP" */
+#define HT_SHMPORT_DIR   "/dev/shm"
+
+/* one slot of the ring */
+typedef struct {
+    unsigned long ss_seq;
+    size_t        ss_len;
+} ht_shmslot_t;
+
+#define ht_shmport_slot(sp, pos) \
+    ((ht_shmslot_t *)((char *)((sp)->sp_ring + 1) + \
+                      ((pos) & ((sp)->sp_ring->sr_slots - 1)) * (sp)->sp_ring->sr_stride))
+
+/* ring a doorbell if somebody sleeps on it */
+static void
+ht_shmport_poke(int *waiting, int fd)
+{
+    char c = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0)
+        while (write(fd, &c, 1) < 0 && errno == EINTR) ;
+    return;
+}
+
+/* sleep on a doorbell */
+static void
+ht_shmport_sleep(int fd)
+{
+    static ht_key_t ev_key = HT_KEY_INIT;
+    struct pollfd pfd;
+    char c;
+
+    if (ht_sched_here == HT_SCHED_NATIVE)
+        ht_event_wait(ht_event(HT_EVENT_FD|HT_UNTIL_FD_READABLE|HT_MODE_STATIC, &ev_key, fd), FALSE);
+    else {
+        pfd.fd     = fd;
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR) ;
+    }
+    while (read(fd, &c, 1) < 0 && errno == EINTR) ;
+    return;
+}
+
+/* the FIFO of a doorbell */
+static int
+ht_shmport_bell(const char *name, const char *which, int create)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/ht.%s.%s", HT_SHMPORT_DIR, name, which);
+    if (create && mkfifo(path, 0600) == -1 && errno != EEXIST)
+        return -1;
+    return open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+}
+
+/* open a port by name, creating it with the given geometry if needed */
+ht_shmport_t
+ht_shmport_open(const char *name, int slots, size_t slotsize)
+{
+    ht_shmport_t sp;
+    ht_shmring_t *sr;
+    char path[PATH_MAX];
+    struct stat st;
+    size_t stride, len;
+    int fd, n, created, i;
+
+    if (name == NULL || *name == NUL || strchr(name, '/') != NULL || slots < 0)
+        return ht_error((ht_shmport_t)NULL, EINVAL);
+    snprintf(path, sizeof(path), "/ht.%s", name);
+
+    /* create the segment, or open the existing one */
+    created = FALSE;
+    stride = len = 0;
+    n = 0;
+    if (slots > 0) {
+        for (n = 1; n < slots; n <<= 1) ;
+        stride = (sizeof(ht_shmslot_t) + slotsize + 63) & ~((size_t)63);
+        len = sizeof(ht_shmring_t) + (size_t)n * stride;
+        if ((fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) != -1) {
+            created = TRUE;
+            if (ftruncate(fd, len) == -1) {
+                close(fd);
+                shm_unlink(path);
+                return ht_error((ht_shmport_t)NULL, errno);
+            }
+        }
+        else if (errno != EEXIST)
+            return ht_error((ht_shmport_t)NULL, errno);
+    }
+    if (!created) {
+        if ((fd = shm_open(path, O_RDWR|O_CLOEXEC, 0)) == -1)
+            return ht_error((ht_shmport_t)NULL, errno);
+        /* the creator may still be sizing it */
+        for (i = 0; fstat(fd, &st) == 0 && st.st_size == 0 && i < 1000; i++)
+            ht_nap(ht_time(0, 1000));
+        if (st.st_size == 0) {
+            close(fd);
+            return ht_error((ht_shmport_t)NULL, EAGAIN);
+        }
+        len = st.st_size;
+    }
+    sr = (ht_shmring_t *)mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sr == MAP_FAILED) {
+        if (created)
+            shm_unlink(path);
+        return ht_error((ht_shmport_t)NULL, errno);
+    }
+
+    if ((sp = (ht_shmport_t)malloc(sizeof(struct ht_shmport_st))) == NULL) {
+        munmap(sr, len);
+        if (created)
+            shm_unlink(path);
+        return ht_error((ht_shmport_t)NULL, ENOMEM);
+    }
+    sp->sp_ring   = sr;
+    sp->sp_maplen = len;
+
+    if (created) {
+        /* lay out the ring and publish it with the magic number last */
+        sr->sr_slots    = n;
+        sr->sr_stride   = stride;
+        sr->sr_slotsize = slotsize;
+        sr->sr_rwait    = 0;
+        sr->sr_swait    = 0;
+        sr->sr_head     = 0;
+        sr->sr_tail     = 0;
+        for (i = 0; i < n; i++)
+            ht_shmport_slot(sp, i)->ss_seq = i;
+        sp->sp_rbell = ht_shmport_bell(name, "rx", TRUE);
+        sp->sp_sbell = ht_shmport_bell(name, "tx", TRUE);
+        __atomic_store_n(&sr->sr_magic, HT_SHMPORT_MAGIC, __ATOMIC_RELEASE);
+    }
+    else {
+        /* the creator may still be laying it out */
+        for (i = 0; __atomic_load_n(&sr->sr_magic, __ATOMIC_ACQUIRE) != HT_SHMPORT_MAGIC
+                    && i < 1000; i++)
+            ht_nap(ht_time(0, 1000));
+        if (i == 1000) {
+            munmap(sr, len);
+            free(sp);
+            return ht_error((ht_shmport_t)NULL, EAGAIN);
+        }
+        sp->sp_rbell = ht_shmport_bell(name, "rx", FALSE);
+        sp->sp_sbell = ht_shmport_bell(name, "tx", FALSE);
+    }
+    if (sp->sp_rbell == -1 || sp->sp_sbell == -1) {
+        ht_shmport_close(sp);
+        return ht_error((ht_shmport_t)NULL, EIO);
+    }
+    return sp;
+}
+
+/* try to copy a message into the next free slot */
+static int
+ht_shmport_trysend(ht_shmport_t sp, const void *buf, size_t len)
+{
+    ht_shmring_t *sr = sp->sp_ring;
+    ht_shmslot_t *ss;
+    unsigned long pos;
+    long dif;
+
+    pos = __atomic_load_n(&sr->sr_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        ss = ht_shmport_slot(sp, pos);
+        dif = (long)(__atomic_load_n(&ss->ss_seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&sr->sr_tail, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return FALSE;
+        else
+            pos = __atomic_load_n(&sr->sr_tail, __ATOMIC_RELAXED);
+    }
+    memcpy(ss + 1, buf, len);
+    ss->ss_len = len;
+    __atomic_store_n(&ss->ss_seq, pos + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/* try to copy the oldest message out of its slot */
+static ssize_t
+ht_shmport_tryrecv(ht_shmport_t sp, void *buf, size_t len)
+{
+    ht_shmring_t *sr = sp->sp_ring;
+    ht_shmslot_t *ss;
+    unsigned long pos;
+    long dif;
+    size_t n;
+
+    pos = __atomic_load_n(&sr->sr_head, __ATOMIC_RELAXED);
+    for (;;) {
+        ss = ht_shmport_slot(sp, pos);
+        dif = (long)(__atomic_load_n(&ss->ss_seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (dif == 0) {
+            if (ss->ss_len > len)
+                return ht_error(-1, EMSGSIZE);
+            if (__atomic_compare_exchange_n(&sr->sr_head, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return ht_error(-1, EAGAIN);
+        else
+            pos = __atomic_load_n(&sr->sr_head, __ATOMIC_RELAXED);
+    }
+    n = ss->ss_len;
+    memcpy(buf, ss + 1, n);
+    __atomic_store_n(&ss->ss_seq, pos + sr->sr_slots, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* send a message, sleeping while the ring is full unless tryonly */
+int
+ht_shmport_send(ht_shmport_t sp, const void *buf, size_t len, int tryonly)
+{
+    ht_shmring_t *sr;
+    int ok;
+
+    if (sp == NULL || (buf == NULL && len > 0))
+        return ht_error(FALSE, EINVAL);
+    sr = sp->sp_ring;
+    if (len > sr->sr_slotsize)
+        return ht_error(FALSE, EMSGSIZE);
+    if (!(ok = ht_shmport_trysend(sp, buf, len)) && !tryonly) {
+        __atomic_add_fetch(&sr->sr_swait, 1, __ATOMIC_SEQ_CST);
+        while (!(ok = ht_shmport_trysend(sp, buf, len)))
+            ht_shmport_sleep(sp->sp_sbell);
+        __atomic_sub_fetch(&sr->sr_swait, 1, __ATOMIC_RELAXED);
+    }
+    if (!ok)
+        return ht_error(FALSE, EAGAIN);
+    ht_shmport_poke(&sr->sr_rwait, sp->sp_rbell);
+    return TRUE;
+}
+
+/* receive a message into buf, sleeping while the ring is empty unless tryonly */
+ssize_t
+ht_shmport_recv(ht_shmport_t sp, void *buf, size_t len, int tryonly)
+{
+    ht_shmring_t *sr;
+    ssize_t n;
+
+    if (sp == NULL || (buf == NULL && len > 0))
+        return ht_error(-1, EINVAL);
+    sr = sp->sp_ring;
+    if ((n = ht_shmport_tryrecv(sp, buf, len)) < 0 && errno == EAGAIN && !tryonly) {
+        __atomic_add_fetch(&sr->sr_rwait, 1, __ATOMIC_SEQ_CST);
+        while ((n = ht_shmport_tryrecv(sp, buf, len)) < 0 && errno == EAGAIN)
+            ht_shmport_sleep(sp->sp_rbell);
+        __atomic_sub_fetch(&sr->sr_rwait, 1, __ATOMIC_RELAXED);
+    }
+    if (n < 0)
+        return -1;
+    ht_shmport_poke(&sr->sr_swait, sp->sp_sbell);
+    /* a receiver may have eaten a poke meant for another one */
+    if (ht_shmport_pending(sp) > 0)
+        ht_shmport_poke(&sr->sr_rwait, sp->sp_rbell);
+    return n;
+}
+
+/* number of messages in the ring */
+int
+ht_shmport_pending(ht_shmport_t sp)
+{
+    long n;
+
+    if (sp == NULL)
+        return ht_error(-1, EINVAL);
+    n = (long)(__atomic_load_n(&sp->sp_ring->sr_tail, __ATOMIC_RELAXED)
+               - __atomic_load_n(&sp->sp_ring->sr_head, __ATOMIC_RELAXED));
+    return (n > 0 ? (int)n : 0);
+}
+
+/* detach from a port */
+int
+ht_shmport_close(ht_shmport_t sp)
+{
+    if (sp == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (sp->sp_rbell != -1)
+        close(sp->sp_rbell);
+    if (sp->sp_sbell != -1)
+        close(sp->sp_sbell);
+    munmap(sp->sp_ring, sp->sp_maplen);
+    free(sp);
+    return TRUE;
+}
+
+/* remove a port's name; processes attached keep using it */
+int
+ht_shmport_unlink(const char *name)
+{
+    char path[PATH_MAX];
+
+    if (name == NULL || *name == NUL || strchr(name, '/') != NULL)
+        return ht_error(FALSE, EINVAL);
+    snprintf(path, sizeof(path), "%s/ht.%s.rx", HT_SHMPORT_DIR, name);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/ht.%s.tx", HT_SHMPORT_DIR, name);
+    unlink(path);
+    snprintf(path, sizeof(path), "/ht.%s", name);
+    if (shm_unlink(path) == -1)
+        return ht_error(FALSE, errno);
+    return TRUE;
+}
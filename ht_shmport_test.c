@@ -0,0 +1,68 @@
+#include <sys/wait.h>
+
+#include "ht_p.h"
+#include "ht_test.h"
+
+#define NMSGS 10000
+
+/* the other process sends through a small ring, so both sides sleep */
+static void
+sender()
+{
+   ht_shmport_t sp;
+   char buf[64];
+   int i, n;
+
+   ht_init();
+   if ((sp = ht_shmport_open("ht_shmport_test", 0, 0)) == NULL)
+      _exit(1);
+   for (i = 0; i < NMSGS; i++) {
+      n = snprintf(buf, sizeof(buf), "%d", i);
+      if (!ht_shmport_send(sp, buf, n + 1, FALSE))
+         _exit(1);
+   }
+   ht_shmport_close(sp);
+   ht_kill();
+   _exit(0);
+}
+
+void
+test1(ht_shmport_t sp, pid_t pid)
+{
+   char buf[64];
+   int i, n, ordered, status;
+
+   memset(buf, 0, sizeof(buf));
+   HT_TEST_ASSERT(!ht_shmport_send(sp, buf, 33, TRUE) && errno == EMSGSIZE,
+                  "ht_shmport_send() accepted an oversized message.");
+   ordered = TRUE;
+   for (i = 0; i < NMSGS; i++) {
+      n = ht_shmport_recv(sp, buf, sizeof(buf), FALSE);
+      ordered = ordered && n > 0 && atoi(buf) == i;
+   }
+   HT_TEST_ASSERT(ordered, "messages from another process got lost or reordered.");
+   HT_TEST_ASSERT(ht_shmport_recv(sp, buf, sizeof(buf), TRUE) == -1 && errno == EAGAIN,
+                  "ht_shmport_recv() found a message on an empty port.");
+   HT_TEST_ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                  "the sending process failed.");
+}
+
+int
+main()
+{
+   ht_shmport_t sp;
+   pid_t pid;
+
+   ht_shmport_unlink("ht_shmport_test");
+   sp = ht_shmport_open("ht_shmport_test", 8, 32);
+   HT_TEST_ASSERT(sp != NULL, "ht_shmport_open() could not create the port.");
+   if ((pid = fork()) == 0)
+      sender();
+   HT_TEST_ASSERT(pid > 0, "fork() failed.");
+   ht_init();
+   test1(sp, pid);
+   ht_shmport_close(sp);
+   HT_TEST_ASSERT(ht_shmport_unlink("ht_shmport_test"), "ht_shmport_unlink() failed.");
+   ht_kill();
+   return 0;
+}
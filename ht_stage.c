@@ -0,0 +1,353 @@
+/*
+ *  pipeline stages (SEDA-style)
+ *  A stage is a bounded message queue drained by a fixed number of
+ *  runner threads. The runners call the stage handler with batches of
+ *  messages, either directly as green threads or on the worker pool.
+ *  A full stage blocks its producers, which gives backpressure along
+ *  a chain of stages.
+ */
+
+#include "ht_p.h"
+
+#define ht_stage_usec(t) \
+    ((unsigned long long)(t)->tv_sec * 1000000 + (t)->tv_usec)
+
+/* the handler job of a runner in HT_STAGE_WORKER mode */
+typedef struct {
+    ht_stage_t     sj_stage;
+    ht_message_t **sj_msgs;
+    int            sj_n;
+} ht_stage_job_t;
+
+static void
+ht_stage_job(void *_sj)
+{
+    ht_stage_job_t *sj = (ht_stage_job_t *)_sj;
+
+    sj->sj_stage->st_func(sj->sj_msgs, sj->sj_n, sj->sj_stage->st_arg);
+    return;
+}
+
+/* take the next message off the stage queue, NULL if empty or at a stop marker */
+static ht_message_t *
+ht_stage_get(ht_stage_t st, ht_time_t *now, int *stop)
+{
+    ht_message_t *m;
+    ht_time_t wait;
+
+    if ((m = ht_msgport_get(st->st_port)) == NULL)
+        return NULL;
+    if (m >= st->st_stop && m < st->st_stop + st->st_concurrency) {
+        *stop = TRUE;
+        return NULL;
+    }
+
+    /* account the time the message was queued */
+    ht_time_set(&wait, now);
+    ht_time_sub(&wait, &st->st_stamp[st->st_stamp_head]);
+    st->st_stamp_head = (st->st_stamp_head + 1) % st->st_capacity;
+    st->st_depth--;
+    st->st_wait_sum += ht_stage_usec(&wait);
+    if (ht_time_cmp(&wait, &st->st_stats.ss_wait_max) > 0)
+        st->st_stats.ss_wait_max = wait;
+    return m;
+}
+
+/* the runner threads of a stage */
+static void *
+ht_stage_runner(void *_st)
+{
+    ht_stage_t st = (ht_stage_t)_st;
+    static ht_key_t ev_key = HT_KEY_INIT;
+    ht_message_t *batch[st->st_batch];
+    ht_taskgroup_t tg = NULL;
+    ht_stage_job_t sj;
+    ht_event_t ev;
+    ht_time_t now, run;
+    int n, stop;
+
+    if (st->st_mode == HT_STAGE_WORKER)
+        if ((tg = ht_taskgroup_create()) == NULL)
+            return NULL;
+
+    stop = FALSE;
+    while (!stop) {
+        /* wait for work */
+        if (ht_msgport_pending(st->st_port) == 0) {
+            ev = ht_event(HT_EVENT_MSG|HT_MODE_STATIC, &ev_key, st->st_port);
+            ht_event_wait(ev, FALSE);
+            continue;
+        }
+
+        /* dequeue a batch and make room for the producers */
+        ht_time_set(&now, HT_TIME_NOW);
+        for (n = 0; n < st->st_batch; n++)
+            if ((batch[n] = ht_stage_get(st, &now, &stop)) == NULL)
+                break;
+        if (n == 0)
+            continue;
+        if (st->st_waiting > 0)
+            ht_cond_notify_n(&st->st_room, n);
+
+        /* run the handler */
+        if (st->st_mode == HT_STAGE_WORKER) {
+            sj.sj_stage = st;
+            sj.sj_msgs  = batch;
+            sj.sj_n     = n;
+            ht_taskgroup_spawn(tg, ht_stage_job, &sj);
+            ht_taskgroup_wait(tg);
+        }
+        else
+            st->st_func(batch, n, st->st_arg);
+
+        /* account the handler run */
+        ht_time_set(&run, HT_TIME_NOW);
+        ht_time_sub(&run, &now);
+        st->st_run_sum += ht_stage_usec(&run);
+        if (ht_time_cmp(&run, &st->st_stats.ss_run_max) > 0)
+            st->st_stats.ss_run_max = run;
+        st->st_stats.ss_done += n;
+        st->st_stats.ss_batches++;
+    }
+
+    if (tg != NULL)
+        ht_taskgroup_destroy(tg);
+    return NULL;
+}
+
+/* free a stage whose runners are gone */
+static void
+ht_stage_free(ht_stage_t st)
+{
+    ht_msgport_destroy(st->st_port);
+    free(st->st_stamp);
+    free(st->st_stop);
+    free(st->st_runner);
+    free(st);
+    return;
+}
+
+/* create a new stage */
+ht_stage_t
+ht_stage_create(const char *name, ht_stage_func_t func, void *arg,
+                int capacity, int concurrency, int batch, int mode)
+{
+    ht_stage_t st;
+    ht_attr_t attr;
+    char rname[HT_TCB_NAMELEN];
+    size_t len;
+    int i, err;
+
+    /* consistency checks */
+    if (func == NULL || capacity <= 0 || concurrency <= 0 || batch <= 0)
+        return ht_error((ht_stage_t)NULL, EINVAL);
+    if (mode != HT_STAGE_GREEN && mode != HT_STAGE_WORKER)
+        return ht_error((ht_stage_t)NULL, EINVAL);
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error((ht_stage_t)NULL, EPERM);
+
+    /* allocate stage structure, with room for the name */
+    len = (name != NULL ? strlen(name) + 1 : 0);
+    if ((st = (ht_stage_t)malloc(sizeof(struct ht_stage_st) + len)) == NULL)
+        return ht_error((ht_stage_t)NULL, ENOMEM);
+    memset(st, 0, sizeof(struct ht_stage_st));
+    if (name != NULL) {
+        memcpy((char *)(st + 1), name, len);
+        st->st_name = (const char *)(st + 1);
+    }
+    st->st_stamp  = (ht_time_t *)malloc(sizeof(ht_time_t) * capacity);
+    st->st_stop   = (ht_message_t *)malloc(sizeof(ht_message_t) * concurrency);
+    st->st_runner = (ht_t *)malloc(sizeof(ht_t) * concurrency);
+    if (st->st_stamp == NULL || st->st_stop == NULL || st->st_runner == NULL) {
+        free(st->st_stamp);
+        free(st->st_stop);
+        free(st->st_runner);
+        free(st);
+        return ht_error((ht_stage_t)NULL, ENOMEM);
+    }
+    /* the queue stays out of the registry of named message ports */
+    if ((st->st_port = ht_msgport_create(NULL)) == NULL) {
+        free(st->st_stamp);
+        free(st->st_stop);
+        free(st->st_runner);
+        free(st);
+        return ht_error((ht_stage_t)NULL, ENOMEM);
+    }
+
+    /* initialize structure */
+    memset(st->st_stop, 0, sizeof(ht_message_t) * concurrency);
+    st->st_func        = func;
+    st->st_arg         = arg;
+    st->st_capacity    = capacity;
+    st->st_concurrency = concurrency;
+    st->st_batch       = batch;
+    st->st_mode        = mode;
+    st->st_refs        = 1;
+    ht_mutex_init(&st->st_mutex);
+    ht_cond_init(&st->st_room);
+
+    /* start the runners */
+    attr = ht_attr_new();
+    if (attr == NULL) {
+        err = errno;
+        i = 0;
+        goto unwind;
+    }
+    ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+    snprintf(rname, sizeof(rname), "stage:%s", name != NULL ? name : "-");
+    ht_attr_set(attr, HT_ATTR_NAME, rname);
+    for (i = 0; i < concurrency; i++) {
+        if ((st->st_runner[i] = ht_spawn(attr, ht_stage_runner, st)) == NULL) {
+            err = errno;
+            ht_attr_destroy(attr);
+            goto unwind;
+        }
+    }
+    ht_attr_destroy(attr);
+
+    return st;
+
+    /* stop the runners started so far and fail */
+    unwind:
+    st->st_closing = TRUE;
+    for (concurrency = i, i = 0; i < concurrency; i++)
+        ht_msgport_put(st->st_port, &st->st_stop[i]);
+    for (i = 0; i < concurrency; i++)
+        ht_join(st->st_runner[i], NULL);
+    ht_stage_free(st);
+    return ht_error((ht_stage_t)NULL, err);
+}
+
+/* put a message on a stage without waiting */
+static int
+ht_stage_tryput(ht_stage_t st, ht_message_t *m)
+{
+    if (st->st_closing)
+        return ht_error(FALSE, EPIPE);
+    if (st->st_depth == st->st_capacity)
+        return ht_error(FALSE, EAGAIN);
+    ht_time_set(&st->st_stamp[(st->st_stamp_head + st->st_depth) % st->st_capacity],
+                HT_TIME_NOW);
+    st->st_depth++;
+    if (st->st_stats.ss_maxdepth < st->st_depth)
+        st->st_stats.ss_maxdepth = st->st_depth;
+    st->st_stats.ss_put++;
+    return ht_msgport_put(st->st_port, m);
+}
+
+/* a producer leaves ht_stage_put(); the last one out
+   of a destroyed stage frees it */
+static void
+ht_stage_leave(ht_stage_t st)
+{
+    if (--st->st_refs == 0)
+        ht_stage_free(st);
+    return;
+}
+
+/* put a message on a stage, waiting for room unless tryonly */
+int
+ht_stage_put(ht_stage_t st, ht_message_t *m, int tryonly)
+{
+    int rc, err, full, blocked;
+
+    if (st == NULL || m == NULL)
+        return ht_error(FALSE, EINVAL);
+
+    /* handed-out threads and worker jobs retry under the
+       scheduler's floor each time the scheduler moved on,
+       holding a reference until they give up the stage */
+    if (!ht_sched_here) {
+        for (blocked = FALSE;; blocked = TRUE) {
+            ht_sched_enter();
+            if (!blocked)
+                st->st_refs++;
+            rc = ht_stage_tryput(st, m);
+            err = errno;
+            full = (!rc && err == EAGAIN && !tryonly);
+            if (full && !blocked)
+                st->st_stats.ss_blocked++;
+            if (!full)
+                ht_stage_leave(st);
+            ht_sched_leave(full);
+            if (!full)
+                return ht_error(rc, err);
+            ht_sched_await();
+        }
+    }
+
+    st->st_refs++;
+    rc = ht_stage_tryput(st, m);
+    err = errno;
+    if (!rc && err == EAGAIN && !tryonly) {
+        /* wait for the runners to make room */
+        st->st_stats.ss_blocked++;
+        if (ht_mutex_acquire(&st->st_mutex, FALSE, NULL)) {
+            st->st_waiting++;
+            while (!(rc = ht_stage_tryput(st, m)) && errno == EAGAIN)
+                if (!ht_cond_await(&st->st_room, &st->st_mutex, NULL))
+                    break;
+            err = errno;
+            st->st_waiting--;
+            ht_mutex_release(&st->st_mutex);
+        }
+        else
+            err = errno;
+    }
+    ht_stage_leave(st);
+    if (!rc)
+        return ht_error(FALSE, err);
+    return TRUE;
+}
+
+/* get the statistics of a stage */
+int
+ht_stage_stats(ht_stage_t st, ht_stage_stats_t *stats)
+{
+    unsigned long long us;
+
+    if (st == NULL || stats == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        ht_stage_stats(st, stats);
+        ht_sched_leave(FALSE);
+        return TRUE;
+    }
+    *stats = st->st_stats;
+    stats->ss_depth = st->st_depth;
+    us = (stats->ss_done > 0 ? st->st_wait_sum / stats->ss_done : 0);
+    stats->ss_wait_avg = ht_time(us / 1000000, us % 1000000);
+    us = (stats->ss_batches > 0 ? st->st_run_sum / stats->ss_batches : 0);
+    stats->ss_run_avg = ht_time(us / 1000000, us % 1000000);
+    return TRUE;
+}
+
+/* drain and delete a stage */
+int
+ht_stage_destroy(ht_stage_t st)
+{
+    int i;
+
+    if (st == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EPERM);
+
+    /* refuse further messages and release blocked producers */
+    st->st_closing = TRUE;
+    if (st->st_waiting > 0)
+        ht_cond_notify_n(&st->st_room, HT_COND_ALL);
+
+    /* queue one stop marker per runner behind the pending messages */
+    for (i = 0; i < st->st_concurrency; i++)
+        ht_msgport_put(st->st_port, &st->st_stop[i]);
+    for (i = 0; i < st->st_concurrency; i++)
+        if (st->st_runner[i] != NULL)
+            ht_join(st->st_runner[i], NULL);
+
+    /* producers still on their way out free the stage last */
+    if (--st->st_refs == 0)
+        ht_stage_free(st);
+    return TRUE;
+}
@@ -0,0 +1,157 @@
+#include "ht_p.h"
+#include "ht_test.h"
+
+struct item {
+    ht_message_t head;
+    int          value;
+};
+
+static ht_stage_t stage_sum;
+static long total;
+
+/* first stage: doubles on the worker pool and forwards */
+static void
+double_items(ht_message_t **msgs, int n, void *arg)
+{
+   int i;
+   for(i = 0; i < n; i++)
+   {
+      ((struct item *)msgs[i])->value *= 2;
+      ht_stage_put(stage_sum, msgs[i], FALSE);
+   }
+}
+
+/* second stage: sums up on green threads */
+static void
+sum_items(ht_message_t **msgs, int n, void *arg)
+{
+   int i;
+   for(i = 0; i < n; i++)
+      total += ((struct item *)msgs[i])->value;
+}
+
+/* test a two stage pipeline with backpressure */
+void
+test1()
+{
+   struct item items[200];
+   ht_stage_t stage_double;
+   ht_stage_stats_t stats;
+   long expect = 0;
+   int i;
+
+   stage_sum = ht_stage_create("sum", sum_items, NULL, 4, 1, 8, HT_STAGE_GREEN);
+   stage_double = ht_stage_create("double", double_items, NULL, 8, 2, 4, HT_STAGE_WORKER);
+   HT_TEST_ASSERT(stage_sum != NULL && stage_double != NULL,
+                  "ht_stage_create() failed.");
+   for(i = 0; i < 200; i++)
+   {
+      items[i].value = i;
+      expect += 2 * i;
+      HT_TEST_ASSERT(ht_stage_put(stage_double, &items[i].head, FALSE),
+                     "ht_stage_put() failed.");
+   }
+   ht_stage_stats(stage_double, &stats);
+   HT_TEST_ASSERT(stats.ss_put == 200 && stats.ss_maxdepth <= 8,
+                  "ht_stage_put() did not respect the capacity.");
+   HT_TEST_ASSERT(ht_stage_destroy(stage_double), "ht_stage_destroy() failed.");
+   ht_stage_stats(stage_sum, &stats);
+   HT_TEST_ASSERT(stats.ss_maxdepth <= 4, "stage ran over its capacity.");
+   HT_TEST_ASSERT(ht_stage_destroy(stage_sum), "ht_stage_destroy() failed.");
+   HT_TEST_ASSERT(total == expect, "pipeline lost messages.");
+   HT_TEST_ASSERT(!ht_stage_put(NULL, &items[0].head, FALSE)
+                  && errno == EINVAL, "ht_stage_put() accepted a NULL stage.");
+}
+
+/* test that a stage neither shadows a named port nor keeps the name pointer */
+void
+test2()
+{
+   ht_msgport_t mp;
+   ht_stage_t st;
+   char name[16];
+
+   strcpy(name, "orders");
+   st = ht_stage_create(name, sum_items, NULL, 4, 1, 1, HT_STAGE_GREEN);
+   HT_TEST_ASSERT(st != NULL, "ht_stage_create() failed.");
+   strcpy(name, "scratch");
+   mp = ht_msgport_create("orders");
+   HT_TEST_ASSERT(ht_msgport_find("orders") == mp, "the stage shadowed a named port.");
+   HT_TEST_ASSERT(strcmp(st->st_name, "orders") == 0, "the stage kept the caller's name.");
+   HT_TEST_ASSERT(ht_stage_destroy(st), "ht_stage_destroy() failed.");
+   HT_TEST_ASSERT(ht_msgport_find("orders") == mp, "the named port got lost.");
+   ht_msgport_destroy(mp);
+}
+
+/* test destroying a stage while producers are blocked on it */
+static int test3_gate;
+static ht_stage_t test3_stage;
+
+static void
+test3_hold(ht_message_t **msgs, int n, void *arg)
+{
+   while(!test3_gate)
+      ht_yield(NULL);
+}
+
+static void *
+test3_green(void *arg)
+{
+   if(ht_stage_put(test3_stage, (ht_message_t *)arg, FALSE) || errno != EPIPE)
+      return NULL;
+   return arg;
+}
+
+static void *
+test3_handed_out(void *arg)
+{
+   void *rv;
+
+   ht_hand_out();
+   rv = test3_green(arg);
+   ht_get_back();
+   return rv;
+}
+
+void
+test3()
+{
+   struct item items[4];
+   ht_attr_t attr = ht_attr_new();
+   ht_t green, handed_out;
+   void *rv[2];
+
+   test3_stage = ht_stage_create("hold", test3_hold, NULL, 1, 1, 1, HT_STAGE_GREEN);
+   HT_TEST_ASSERT(test3_stage != NULL, "ht_stage_create() failed.");
+
+   /* one message in the handler, one queued, two producers blocked */
+   HT_TEST_ASSERT(ht_stage_put(test3_stage, &items[0].head, FALSE), "ht_stage_put() failed.");
+   while(test3_stage->st_depth > 0)
+      ht_yield(NULL);
+   HT_TEST_ASSERT(ht_stage_put(test3_stage, &items[1].head, FALSE), "ht_stage_put() failed.");
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   green = ht_spawn(attr, test3_green, &items[2]);
+   handed_out = ht_spawn(attr, test3_handed_out, &items[3]);
+   while(test3_stage->st_waiting < 1 || test3_stage->st_stats.ss_blocked < 2)
+      ht_yield(NULL);
+
+   /* the producers must leave the stage before it is freed */
+   test3_gate = TRUE;
+   HT_TEST_ASSERT(ht_stage_destroy(test3_stage), "ht_stage_destroy() failed.");
+   ht_join(green, &rv[0]);
+   ht_join(handed_out, &rv[1]);
+   HT_TEST_ASSERT(rv[0] == &items[2] && rv[1] == &items[3],
+                  "a blocked producer did not fail with EPIPE.");
+   ht_attr_destroy(attr);
+}
+
+int
+main()
+{
+   ht_init();
+   test1();
+   test2();
+   test3();
+   ht_kill();
+   return 0;
+}
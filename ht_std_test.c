@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "ht.h"
 #include "ht_test.h"
 
@@ -44,6 +45,47 @@ static void *t2_func(void *arg)
     return rval;
 }
 
+static ht_key_t t3_keys[300];
+static int t3_destroyed;
+
+static void t3_destructor(void *data)
+{
+    t3_destroyed += (int)(long)data;
+}
+
+static void *t3_func(void *arg)
+{
+    ht_key_setdata(t3_keys[1], (void *)1);
+    ht_key_setdata(t3_keys[299], (void *)10);
+    ht_key_setdata(t3_keys[2], (void *)100);
+    ht_key_setdata(t3_keys[2], NULL);
+    HT_TEST_ASSERT(ht_key_getdata(t3_keys[299]) == (void *)10, "ht_key_getdata failed.");
+    HT_TEST_ASSERT(ht_key_getdata(t3_keys[0]) == NULL, "ht_key_getdata invented a value.");
+    return NULL;
+}
+
+static void t4_cleanup(void *arg)
+{
+    (*(int *)arg)++;
+}
+
+static void *t4_func(void *arg)
+{
+    HT_CLEANUP_PUSH(t4_cleanup, arg);
+    HT_CLEANUP_PUSH(t4_cleanup, arg);
+    HT_CLEANUP_POP(TRUE);
+    ht_sleep(10);
+    HT_CLEANUP_POP(FALSE);
+    return NULL;
+}
+
+static void *t5_writer(void *arg)
+{
+    ht_usleep(5000);
+    HT_TEST_ASSERT(ht_write(*(int *)arg, "late", 4) == 4, "ht_write failed.");
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     /*=== TESTING GLOBAL LIBRARY API ===*/
@@ -114,6 +156,104 @@ int main(int argc, char *argv[])
                        "ht_join did not return expected value.");
     }
 
+    /*=== TESTING THREAD SPECIFIC DATA ===*/
+    {
+        ht_t tid;
+        int i;
+
+        /* more keys than the old fixed table held */
+        for (i = 0; i < 300; i++)
+            HT_TEST_ASSERT(ht_key_create(&t3_keys[i], t3_destructor), "ht_key_create failed.");
+        tid = ht_spawn(HT_ATTR_DEFAULT, t3_func, NULL);
+        HT_TEST_ASSERT(tid != NULL, "ht_spawn failed.");
+        ht_join(tid, NULL);
+        HT_TEST_ASSERT(t3_destroyed == 11, "destructors did not run exactly for the set keys.");
+        for (i = 0; i < 300; i++)
+            ht_key_delete(t3_keys[i]);
+    }
+
+    /*=== TESTING CLEANUP FRAMES ON THE STACK ===*/
+    {
+        ht_t tid;
+        int count = 0;
+
+        tid = ht_spawn(HT_ATTR_DEFAULT, t4_func, &count);
+        HT_TEST_ASSERT(tid != NULL, "ht_spawn failed.");
+        ht_yield(NULL);
+        HT_TEST_ASSERT(count == 1, "HT_CLEANUP_POP did not execute the handler.");
+        ht_cancel(tid);
+        ht_join(tid, NULL);
+        HT_TEST_ASSERT(count == 2, "cancellation did not run the stacked handler.");
+    }
+
+    /*=== TESTING TRY-FIRST READS ON AN ASYNC FILEDESCRIPTOR ===*/
+    {
+        struct iovec iov;
+        ht_t tid;
+        int fds[2], pfd[2];
+        char buf[8];
+
+        HT_TEST_ASSERT(pipe(fds) == 0, "pipe failed.");
+        HT_TEST_ASSERT(ht_fdmode(fds[0], HT_FDMODE_ASYNC) == HT_FDMODE_BLOCK,
+                       "ht_fdmode did not switch to async mode.");
+        HT_TEST_ASSERT(ht_fdmode(fds[0], HT_FDMODE_POLL) == HT_FDMODE_ASYNC
+                       && (fcntl(fds[0], F_GETFL) & O_NONBLOCK),
+                       "async mode was not cached.");
+
+        /* data present: the first read(2) succeeds */
+        HT_TEST_ASSERT(write(fds[1], "now", 3) == 3, "write failed.");
+        HT_TEST_ASSERT(ht_read(fds[0], buf, sizeof(buf)) == 3 && memcmp(buf, "now", 3) == 0,
+                       "ht_read failed on a readable async fd.");
+
+        /* no data: the thread still blocks until the writer delivers */
+        tid = ht_spawn(HT_ATTR_DEFAULT, t5_writer, &fds[1]);
+        iov.iov_base = buf;
+        iov.iov_len  = sizeof(buf);
+        HT_TEST_ASSERT(ht_readv(fds[0], &iov, 1) == 4 && memcmp(buf, "late", 4) == 0,
+                       "ht_readv did not block on an empty async fd.");
+        ht_join(tid, NULL);
+
+        /* a deadline still bounds the wait */
+        HT_TEST_ASSERT(ht_set_deadline(ht_self(), ht_timeout(0, 5000)), "ht_set_deadline failed.");
+        HT_TEST_ASSERT(ht_read(fds[0], buf, sizeof(buf)) == -1 && errno == ETIMEDOUT,
+                       "ht_read did not time out on an async fd.");
+        ht_clear_deadline(ht_self());
+
+        HT_TEST_ASSERT(ht_fdmode(fds[0], HT_FDMODE_BLOCK) == HT_FDMODE_ASYNC
+                       && !(fcntl(fds[0], F_GETFL) & O_NONBLOCK),
+                       "ht_fdmode did not leave async mode.");
+        HT_TEST_ASSERT(ht_fdmode(fds[0], HT_FDMODE_POLL) == HT_FDMODE_BLOCK,
+                       "async mode outlived ht_fdmode.");
+        close(fds[0]);
+        close(fds[1]);
+
+        /* ht_close forgets the mode of a reused number */
+        HT_TEST_ASSERT(pipe(fds) == 0, "pipe failed.");
+        ht_fdmode(fds[0], HT_FDMODE_ASYNC);
+        HT_TEST_ASSERT(ht_close(fds[0]) == 0, "ht_close failed.");
+        HT_TEST_ASSERT(dup2(fds[1], fds[0]) == fds[0], "dup2 failed.");
+        HT_TEST_ASSERT(ht_fdmode(fds[0], HT_FDMODE_POLL) == HT_FDMODE_BLOCK,
+                       "async mode outlived ht_close.");
+        close(fds[0]);
+        close(fds[1]);
+
+        /* a blocking filedescriptor reusing the number of an async one
+           closed with close(2) is not read before it is readable */
+        HT_TEST_ASSERT(pipe(fds) == 0, "pipe failed.");
+        ht_fdmode(fds[0], HT_FDMODE_ASYNC);
+        close(fds[0]);
+        HT_TEST_ASSERT(pipe(pfd) == 0 && pfd[0] == fds[0], "pipe failed.");
+        tid = ht_spawn(HT_ATTR_DEFAULT, t5_writer, &pfd[1]);
+        HT_TEST_ASSERT(ht_read(pfd[0], buf, sizeof(buf)) == 4 && memcmp(buf, "late", 4) == 0,
+                       "ht_read blocked the scheduler on a reused number.");
+        HT_TEST_ASSERT(ht_fdmode(pfd[0], HT_FDMODE_POLL) == HT_FDMODE_BLOCK,
+                       "a reused blocking number was taken as async.");
+        ht_join(tid, NULL);
+        close(fds[1]);
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+
     ht_kill();
     exit(0);
 }
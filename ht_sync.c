@@ -1,9 +1,398 @@
 #include "ht_p.h"
 
+/*
+**  Wait Queues
+**
+**  The synchronization objects keep their parked threads in FIFO
+**  queues of entries living on the stacks of the parked threads,
+**  guarded by a small spin lock of the object. Whoever dequeues an
+**  entry wakes its thread directly through the waiter layer, usually
+**  after granting it what it waited for.
+*/
+
+typedef struct ht_syncq_entry_st ht_syncq_entry_t;
+struct ht_syncq_entry_st {
+    ht_waiter_t       se_w;
+    ht_syncq_entry_t *se_next;
+};
+
+/* undo a wait of a cancelled green thread; woken tells whether
+   the entry had already been dequeued for a wakeup */
+typedef void (*ht_syncq_undo_t)(void *, ht_syncq_entry_t *, int);
+
+static void
+ht_syncq_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ht_util_cpu_relax();
+    return;
+}
+
+static void
+ht_syncq_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    return;
+}
+
+/* prepare an entry for the calling thread */
+static int
+ht_syncq_init(ht_syncq_entry_t *se)
+{
+    ht_waiter_init(&se->se_w);
+    se->se_next = NULL;
+    if (ht_sched_here == HT_SCHED_NATIVE && se->se_w.w_ev == NULL)
+        return FALSE;
+    return TRUE;
+}
+
+static void
+ht_syncq_append(void **head, void **tail, ht_syncq_entry_t *se)
+{
+    se->se_next = NULL;
+    if (*tail != NULL)
+        ((ht_syncq_entry_t *)*tail)->se_next = se;
+    else
+        *head = se;
+    *tail = se;
+    return;
+}
+
+static ht_syncq_entry_t *
+ht_syncq_pop(void **head, void **tail)
+{
+    ht_syncq_entry_t *se;
+
+    if ((se = (ht_syncq_entry_t *)*head) != NULL) {
+        *head = se->se_next;
+        if (*head == NULL)
+            *tail = NULL;
+    }
+    return se;
+}
+
+static int
+ht_syncq_remove(void **head, void **tail, ht_syncq_entry_t *se)
+{
+    ht_syncq_entry_t **pse, *prev;
+
+    for (pse = (ht_syncq_entry_t **)head, prev = NULL;
+         *pse != NULL; prev = *pse, pse = &(*pse)->se_next) {
+        if (*pse == se) {
+            *pse = se->se_next;
+            if (*tail == se)
+                *tail = prev;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* a parked entry and the queue it is parked in */
+typedef struct {
+    int              *sp_lock;
+    void            **sp_head;
+    void            **sp_tail;
+    ht_syncq_entry_t *sp_se;
+    ht_syncq_undo_t   sp_undo;
+    void             *sp_obj;
+} ht_syncq_park_t;
+
+/* take a parked entry out of its queue again; FALSE if it had already
+   been dequeued, in which case we wait for the wakeup to arrive */
+static int
+ht_syncq_withdraw(ht_syncq_park_t *sp)
+{
+    int found;
+
+    ht_syncq_lock(sp->sp_lock);
+    found = ht_syncq_remove(sp->sp_head, sp->sp_tail, sp->sp_se);
+    ht_syncq_unlock(sp->sp_lock);
+    if (!found)
+        ht_waiter_park(&sp->sp_se->se_w);
+    return found;
+}
+
+static void
+ht_syncq_cleanup_handler(void *_sp)
+{
+    ht_syncq_park_t *sp = (ht_syncq_park_t *)_sp;
+
+    sp->sp_undo(sp->sp_obj, sp->sp_se, !ht_syncq_withdraw(sp));
+    return;
+}
+
+/* release the queue lock and park the queued entry until it is woken;
+   FALSE with EINTR, and the entry withdrawn, if ev_extra occurred first,
+   or with ETIMEDOUT if timed is set and the thread's deadline passed */
+static int
+ht_syncq_park(int *lock, void **head, void **tail, ht_syncq_entry_t *se,
+              ht_event_t ev_extra, int timed, ht_syncq_undo_t undo, void *obj)
+{
+    ht_syncq_park_t sp;
+    ht_cleanup_t cleanup;
+    ht_event_t ev;
+    int err;
+
+    ht_syncq_unlock(lock);
+    if (se->se_w.w_tid == NULL) {
+        /* kernel threads have no extra events and no cancellation */
+        ht_waiter_park(&se->se_w);
+        return TRUE;
+    }
+    sp.sp_lock = lock;
+    sp.sp_head = head;
+    sp.sp_tail = tail;
+    sp.sp_se   = se;
+    sp.sp_undo = undo;
+    sp.sp_obj  = obj;
+    ev = se->se_w.w_ev;
+    if (ev_extra != NULL)
+        ht_event_concat(ev, ev_extra, NULL);
+    ht_cleanup_link(&cleanup, ht_syncq_cleanup_handler, &sp);
+    err = 0;
+    while (!__atomic_load_n(&se->se_w.w_woken, __ATOMIC_ACQUIRE)) {
+        if (ht_event_wait(ev, timed) < 0) {
+            err = ETIMEDOUT;
+            break;
+        }
+        if (ev_extra != NULL && !__atomic_load_n(&se->se_w.w_woken, __ATOMIC_ACQUIRE)) {
+            err = EINTR;
+            break;
+        }
+    }
+    ht_cleanup_unlink(&cleanup, FALSE);
+    if (ev_extra != NULL)
+        ht_event_isolate(ev);
+    if (err != 0 && !__atomic_load_n(&se->se_w.w_woken, __ATOMIC_ACQUIRE))
+        if (ht_syncq_withdraw(&sp))
+            return ht_error(FALSE, err);
+    return TRUE;
+}
+
 /*
 **  Mutual Exclusion Locks
+**
+**  The lock bit in mx_state is taken with an atomic compare-and-swap,
+**  so green threads, handed-out threads, worker jobs and foreign
+**  pthreads all share the same mutexes. Contenders on a kernel thread
+**  of their own first spin for a while, adapting the spin length to
+**  how long the lock was held recently. They then park like green
+**  threads do. All parked threads queue up on the mutex. Green threads
+**  park as waiting threads and kernel threads park on a futex, and a
+**  release wakes the first one in the queue directly. In HT_MUTEX_FIFO
+**  mode the release does not even unlock: it hands the lock over to
+**  the longest waiter, so nobody can barge in and the woken thread
+**  never finds the lock taken again. In HT_MUTEX_INHERIT mode a green
+**  owner runs with the highest priority of the green threads parked
+**  on its mutexes, so threads of medium priority cannot hold off a
+**  parked thread of high priority.
 */
 
+#define HT_MUTEX_SPIN_MAX 100
+
+/* held by a green thread of the scheduler, which thus cannot run
+   while another green thread looks at the mutex. Once the owner
+   handed itself out it runs on a worker, and only the owner itself
+   touches its mutexring and priority until it got back */
+#define HT_MUTEX_GREEN    _BIT(8)
+#define ht_mutex_away(t) \
+    ((t) != ht_current && (t)->task.tk_tid != NULL)
+
+/* the owner identity of kernel threads without a thread handle */
+static __thread int ht_mutex_token;
+#define ht_mutex_self() \
+    (ht_current != NULL ? ht_current : (ht_t)&ht_mutex_token)
+
+/* take the lock bit if it is free */
+static int
+ht_mutex_trylock(ht_mutex_t *mutex)
+{
+    int state;
+
+    state = __atomic_load_n(&mutex->mx_state, __ATOMIC_RELAXED);
+    while (!(state & HT_MUTEX_LOCKED))
+        if (__atomic_compare_exchange_n(&mutex->mx_state, &state, state|HT_MUTEX_LOCKED,
+                                        FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return TRUE;
+    return FALSE;
+}
+
+/* spin for the lock, at most a bit longer than it took recently */
+static int
+ht_mutex_spin(ht_mutex_t *mutex)
+{
+    int spins, max, n;
+
+    spins = __atomic_load_n(&mutex->mx_spins, __ATOMIC_RELAXED);
+    max = ht_util_min(HT_MUTEX_SPIN_MAX, spins * 2 + 10);
+    for (n = 0; n < max; n++) {
+        if (ht_mutex_trylock(mutex))
+            break;
+        ht_util_cpu_relax();
+    }
+    __atomic_store_n(&mutex->mx_spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+    return (n < max);
+}
+
+/* wake the first parked waiter, if any */
+static void
+ht_mutex_wakeup(ht_mutex_t *mutex)
+{
+    ht_syncq_entry_t *se;
+
+    ht_syncq_lock(&mutex->mx_qlock);
+    se = ht_syncq_pop(&mutex->mx_qhead, &mutex->mx_qtail);
+    ht_syncq_unlock(&mutex->mx_qlock);
+    if (se != NULL)
+        ht_waiter_wake(&se->se_w);
+    return;
+}
+
+/* give the lock bit up, or hand it over to the first waiter in FIFO mode */
+static void
+ht_mutex_unlock(ht_mutex_t *mutex)
+{
+    ht_syncq_entry_t *se;
+
+    if (   (mutex->mx_state & HT_MUTEX_FIFO)
+        && __atomic_load_n(&mutex->mx_nwait, __ATOMIC_SEQ_CST) > 0) {
+        ht_syncq_lock(&mutex->mx_qlock);
+        if ((se = ht_syncq_pop(&mutex->mx_qhead, &mutex->mx_qtail)) != NULL) {
+            se->se_w.w_result = TRUE;
+            ht_syncq_unlock(&mutex->mx_qlock);
+            ht_waiter_wake(&se->se_w);
+            return;
+        }
+        ht_syncq_unlock(&mutex->mx_qlock);
+    }
+    __atomic_and_fetch(&mutex->mx_state, ~(HT_MUTEX_LOCKED), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&mutex->mx_nwait, __ATOMIC_SEQ_CST) > 0)
+        ht_mutex_wakeup(mutex);
+    return;
+}
+
+/* move a green thread to a new priority */
+static void
+ht_mutex_setprio(ht_t t, int prio)
+{
+    if (t->prio == prio)
+        return;
+    if (t != ht_current && ht_pqueue_contains(&ht_RQ, t)) {
+        ht_pqueue_delete(&ht_RQ, t);
+        ht_pqueue_insert(&ht_RQ, prio, t);
+    }
+    t->prio = prio;
+    return;
+}
+
+/* recompute the priority a green thread inherits through its mutexes */
+void
+ht_mutex_inherit(ht_t t)
+{
+    ht_ringnode_t *rn, *rnf;
+    ht_syncq_entry_t *se;
+    ht_mutex_t *mutex;
+    int prio = t->prio_base;
+
+    /* ht_get_back() catches up */
+    if (ht_mutex_away(t))
+        return;
+    rn = rnf = ht_ring_first(&(t->mutexring));
+    while (rn != NULL) {
+        mutex = (ht_mutex_t *)rn;
+        if (mutex->mx_state & HT_MUTEX_INHERIT) {
+            ht_syncq_lock(&mutex->mx_qlock);
+            for (se = mutex->mx_qhead; se != NULL; se = se->se_next)
+                if (se->se_w.w_tid != NULL && se->se_w.w_tid->prio > prio)
+                    prio = se->se_w.w_tid->prio;
+            ht_syncq_unlock(&mutex->mx_qlock);
+        }
+        rn = ht_ring_next(&(t->mutexring), rn);
+        if (rn == rnf)
+            break;
+    }
+    ht_mutex_setprio(t, prio);
+    return;
+}
+
+/* a parked contender left without the lock: take back the priority
+   it lent to a green owner */
+static void
+ht_mutex_unlend(ht_mutex_t *mutex)
+{
+    ht_t owner;
+
+    if (   (mutex->mx_state & (HT_MUTEX_INHERIT|HT_MUTEX_GREEN))
+           == (HT_MUTEX_INHERIT|HT_MUTEX_GREEN)
+        && (owner = mutex->mx_owner) != NULL
+        && !ht_mutex_away(owner)
+        && owner->prio != owner->prio_base)
+        ht_mutex_inherit(owner);
+    return;
+}
+
+/* a parked contender was cancelled: pass on the wakeup or the lock it got */
+static void
+ht_mutex_undo(void *_mutex, ht_syncq_entry_t *se, int woken)
+{
+    ht_mutex_t *mutex = (ht_mutex_t *)_mutex;
+
+    __atomic_sub_fetch(&mutex->mx_nwait, 1, __ATOMIC_SEQ_CST);
+    if (woken) {
+        if (se->se_w.w_result)
+            ht_mutex_unlock(mutex);
+        else
+            ht_mutex_wakeup(mutex);
+    }
+    else
+        ht_mutex_unlend(mutex);
+    return;
+}
+
+/* queue up and park until the lock bit is ours */
+static int
+ht_mutex_park(ht_mutex_t *mutex, ht_event_t ev_extra, int timed)
+{
+    ht_syncq_entry_t se;
+
+    ht_syncq_lock(&mutex->mx_qlock);
+    __atomic_add_fetch(&mutex->mx_nwait, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        /* the releaser clears the lock bit before it looks for
+           waiters, so we either get the lock here or get woken */
+        if (ht_mutex_trylock(mutex))
+            break;
+        if (!ht_syncq_init(&se)) {
+            __atomic_sub_fetch(&mutex->mx_nwait, 1, __ATOMIC_SEQ_CST);
+            ht_syncq_unlock(&mutex->mx_qlock);
+            return FALSE;
+        }
+        ht_syncq_append(&mutex->mx_qhead, &mutex->mx_qtail, &se);
+        if (   se.se_w.w_tid != NULL
+            && (mutex->mx_state & (HT_MUTEX_INHERIT|HT_MUTEX_GREEN))
+               == (HT_MUTEX_INHERIT|HT_MUTEX_GREEN)
+            && !ht_mutex_away(mutex->mx_owner)
+            && mutex->mx_owner->prio < se.se_w.w_tid->prio)
+            /* lend our priority to the owner */
+            ht_mutex_setprio(mutex->mx_owner, se.se_w.w_tid->prio);
+        if (!ht_syncq_park(&mutex->mx_qlock, &mutex->mx_qhead, &mutex->mx_qtail,
+                           &se, ev_extra, timed, ht_mutex_undo, mutex)) {
+            __atomic_sub_fetch(&mutex->mx_nwait, 1, __ATOMIC_SEQ_CST);
+            ht_shield { ht_mutex_unlend(mutex); }
+            return FALSE;
+        }
+        ht_syncq_lock(&mutex->mx_qlock);
+        if (se.se_w.w_result)
+            /* a FIFO release handed the lock over to us */
+            break;
+    }
+    __atomic_sub_fetch(&mutex->mx_nwait, 1, __ATOMIC_SEQ_CST);
+    ht_syncq_unlock(&mutex->mx_qlock);
+    return TRUE;
+}
+
 int 
 ht_mutex_init(ht_mutex_t *mutex)
 {
@@ -12,35 +401,41 @@ ht_mutex_init(ht_mutex_t *mutex)
     mutex->mx_state = HT_MUTEX_INITIALIZED;
     mutex->mx_owner = NULL;
     mutex->mx_count = 0;
+    mutex->mx_qlock = 0;
+    mutex->mx_nwait = 0;
+    mutex->mx_spins = 0;
+    mutex->mx_qhead = NULL;
+    mutex->mx_qtail = NULL;
+    mutex->mx_prof  = (ht_lockprof_enabled ? ht_lockprof_site(HT_LOCKPROF_MUTEX, NULL,
+                                             __builtin_return_address(0)) : NULL);
+    mutex->mx_since = 0;
     return TRUE;
 }
 
-int 
-ht_mutex_acquire(ht_mutex_t *mutex, int tryonly, ht_event_t ev_extra)
+/* acquire a mutex; with timed set the thread's deadline bounds the wait */
+static int
+ht_mutex_take(ht_mutex_t *mutex, int tryonly, ht_event_t ev_extra, int timed)
 {
-    static ht_key_t ev_key = HT_KEY_INIT;
-    ht_event_t ev;
-
-    ht_debug2("ht_mutex_acquire: called from thread \"%s\"", ht_current->name);
+    unsigned long long waited = 0;
+    ht_t self;
 
     /* consistency checks */
     if (mutex == NULL)
         return ht_error(FALSE, EINVAL);
     if (!(mutex->mx_state & HT_MUTEX_INITIALIZED))
         return ht_error(FALSE, EDEADLK);
+    if (ev_extra != NULL && ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EINVAL);
+    self = ht_mutex_self();
 
     /* still not locked, so simply acquire mutex? */
-    if (!(mutex->mx_state & HT_MUTEX_LOCKED)) {
-        mutex->mx_state |= HT_MUTEX_LOCKED;
-        mutex->mx_owner = ht_current;
-        mutex->mx_count = 1;
-        ht_ring_append(&(ht_current->mutexring), &(mutex->mx_node));
+    if (ht_mutex_trylock(mutex)) {
         ht_debug1("ht_mutex_acquire: immediately locking mutex");
-        return TRUE;
+        goto locked;
     }
 
     /* already locked by caller? */
-    if (mutex->mx_count >= 1 && mutex->mx_owner == ht_current) {
+    if (mutex->mx_count >= 1 && mutex->mx_owner == self) {
         /* recursive lock */
         mutex->mx_count++;
         ht_debug1("ht_mutex_acquire: recursive locking");
@@ -51,31 +446,39 @@ ht_mutex_acquire(ht_mutex_t *mutex, int tryonly, ht_event_t ev_extra)
     if (tryonly)
         return ht_error(FALSE, EBUSY);
 
+    /* on a kernel thread of our own spin for a while; green
+       threads would only keep the lock holder from running */
+    if (mutex->mx_prof != NULL)
+        waited = ht_time_ns();
+    if (ht_sched_here != HT_SCHED_NATIVE && ht_mutex_spin(mutex))
+        goto locked;
+
     /* else wait for mutex to become unlocked.. */
     ht_debug1("ht_mutex_acquire: wait until mutex is unlocked");
-    for (;;) {
-        ev = ht_event(HT_EVENT_MUTEX|HT_MODE_STATIC, &ev_key, mutex);
-        if (ev_extra != NULL)
-            ht_event_concat(ev, ev_extra, NULL);
-        ht_wait(ev);
-        if (ev_extra != NULL) {
-            ht_event_isolate(ev);
-            if (ht_event_status(ev) == HT_STATUS_PENDING)
-                return ht_error(FALSE, EINTR);
-        }
-        if (!(mutex->mx_state & HT_MUTEX_LOCKED))
-            break;
-    }
+    if (!ht_mutex_park(mutex, ev_extra, timed))
+        return FALSE;
 
-    /* now it's again unlocked, so acquire mutex */
-    ht_debug1("ht_mutex_acquire: locking mutex");
-    mutex->mx_state |= HT_MUTEX_LOCKED;
-    mutex->mx_owner = ht_current;
+    locked:
+    mutex->mx_owner = self;
     mutex->mx_count = 1;
-    ht_ring_append(&(ht_current->mutexring), &(mutex->mx_node));
+    if (mutex->mx_prof != NULL)
+        ht_lockprof_acquired(mutex->mx_prof, waited, &mutex->mx_since);
+    if (ht_current != NULL)
+        ht_ring_append(&(ht_current->mutexring), &(mutex->mx_node));
+    if ((mutex->mx_state & HT_MUTEX_INHERIT) && ht_sched_here == HT_SCHED_NATIVE) {
+        /* inherit from the threads still parked on the mutex */
+        __atomic_or_fetch(&mutex->mx_state, HT_MUTEX_GREEN, __ATOMIC_RELAXED);
+        ht_mutex_inherit(ht_current);
+    }
     return TRUE;
 }
 
+int 
+ht_mutex_acquire(ht_mutex_t *mutex, int tryonly, ht_event_t ev_extra)
+{
+    return ht_mutex_take(mutex, tryonly, ev_extra, TRUE);
+}
+
 int 
 ht_mutex_release(ht_mutex_t *mutex)
 {
@@ -86,20 +489,72 @@ ht_mutex_release(ht_mutex_t *mutex)
         return ht_error(FALSE, EDEADLK);
     if (!(mutex->mx_state & HT_MUTEX_LOCKED))
         return ht_error(FALSE, EDEADLK);
-    if (mutex->mx_owner != ht_current)
+    if (mutex->mx_owner != ht_mutex_self())
         return ht_error(FALSE, EACCES);
 
     /* decrement recursion counter and release mutex */
     mutex->mx_count--;
     if (mutex->mx_count <= 0) {
-        mutex->mx_state &= ~(HT_MUTEX_LOCKED);
+        if (mutex->mx_prof != NULL && mutex->mx_since != 0)
+            ht_lockprof_released(mutex->mx_prof, mutex->mx_since);
         mutex->mx_owner = NULL;
         mutex->mx_count = 0;
-        ht_ring_delete(&(ht_current->mutexring), &(mutex->mx_node));
+        if (ht_current != NULL)
+            ht_ring_delete(&(ht_current->mutexring), &(mutex->mx_node));
+        if (mutex->mx_state & HT_MUTEX_GREEN) {
+            __atomic_and_fetch(&mutex->mx_state, ~(HT_MUTEX_GREEN), __ATOMIC_RELAXED);
+            ht_mutex_unlock(mutex);
+            /* give back what we inherited through this mutex */
+            if (ht_current->prio != ht_current->prio_base)
+                ht_mutex_inherit(ht_current);
+        }
+        else
+            ht_mutex_unlock(mutex);
     }
     return TRUE;
 }
 
+/* switch FIFO handoff on or off */
+int
+ht_mutex_setfifo(ht_mutex_t *mutex, int fifo)
+{
+    if (mutex == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!(mutex->mx_state & HT_MUTEX_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+    if (fifo)
+        __atomic_or_fetch(&mutex->mx_state, HT_MUTEX_FIFO, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&mutex->mx_state, ~(HT_MUTEX_FIFO), __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/* switch priority inheritance on or off */
+int
+ht_mutex_setinherit(ht_mutex_t *mutex, int inherit)
+{
+    if (mutex == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!(mutex->mx_state & HT_MUTEX_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+    if (inherit)
+        __atomic_or_fetch(&mutex->mx_state, HT_MUTEX_INHERIT, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&mutex->mx_state, ~(HT_MUTEX_INHERIT), __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/* profile the mutex under a name of its own */
+int
+ht_mutex_setname(ht_mutex_t *mutex, const char *name)
+{
+    if (mutex == NULL || name == NULL)
+        return ht_error(FALSE, EINVAL);
+    if ((mutex->mx_prof = ht_lockprof_site(HT_LOCKPROF_MUTEX, name, NULL)) == NULL)
+        return ht_error(FALSE, ENOMEM);
+    return TRUE;
+}
+
 void 
 ht_mutex_releaseall(ht_t thread)
 {
@@ -120,89 +575,296 @@ ht_mutex_releaseall(ht_t thread)
 
 /*
 **  Read-Write Locks
+**
+**  The whole lock state lives in one word: a writer bit, a bit each
+**  for parked writers and parked readers, and the reader count above
+**  them. Uncontended readers and writers get along with a single
+**  compare-and-swap. The lock is phase-fair: once a writer waits, new
+**  readers queue up behind it, and a writer releasing the lock admits
+**  all queued readers at once before the next writer gets its turn, so
+**  neither side can starve the other. Parked threads are granted the
+**  lock by whoever wakes them and never have to retry.
 */
 
+#define HT_RWLOCK_WRITER  1UL      /* held by a writer                 */
+#define HT_RWLOCK_WWAIT   2UL      /* writers are queued               */
+#define HT_RWLOCK_RWAIT   4UL      /* readers are queued               */
+#define HT_RWLOCK_READER  8UL      /* one reader in the reader count   */
+#define HT_RWLOCK_RMASK   (~(HT_RWLOCK_READER-1))
+
+/* wake the popped waiters of a queue, granting them the lock */
+static void
+ht_rwlock_grant(ht_syncq_entry_t *se)
+{
+    ht_syncq_entry_t *next;
+
+    for (; se != NULL; se = next) {
+        next = se->se_next;
+        se->se_w.w_result = TRUE;
+        ht_waiter_wake(&se->se_w);
+    }
+    return;
+}
+
+/* with the queue lock held: pass a lock without holders on to the
+   next writer, or to all queued readers; returns the waiters to wake */
+static ht_syncq_entry_t *
+ht_rwlock_handoff(ht_rwlock_t *rwlock, int readers_first)
+{
+    ht_syncq_entry_t *se;
+    unsigned long w, n;
+
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_RELAXED);
+    if (   rwlock->rw_rqhead != NULL
+        && (readers_first || rwlock->rw_wqhead == NULL)) {
+        /* admit the whole batch of readers */
+        for (n = 0, se = rwlock->rw_rqhead; se != NULL; se = se->se_next)
+            n++;
+        se = rwlock->rw_rqhead;
+        rwlock->rw_rqhead = rwlock->rw_rqtail = NULL;
+        while (!__atomic_compare_exchange_n(&rwlock->rw_word, &w,
+                   ((w & HT_RWLOCK_RMASK) + n * HT_RWLOCK_READER)
+                   | (rwlock->rw_wqhead != NULL ? HT_RWLOCK_WWAIT : 0),
+                   FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        return se;
+    }
+    if ((se = ht_syncq_pop(&rwlock->rw_wqhead, &rwlock->rw_wqtail)) != NULL) {
+        se->se_next = NULL;
+        __atomic_store_n(&rwlock->rw_word, HT_RWLOCK_WRITER
+                         | (rwlock->rw_wqhead != NULL ? HT_RWLOCK_WWAIT : 0)
+                         | (rwlock->rw_rqhead != NULL ? HT_RWLOCK_RWAIT : 0),
+                         __ATOMIC_RELEASE);
+        return se;
+    }
+    __atomic_store_n(&rwlock->rw_word, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* give up a write lock */
+static void
+ht_rwlock_unlock_rw(ht_rwlock_t *rwlock)
+{
+    ht_syncq_entry_t *se;
+    unsigned long w = HT_RWLOCK_WRITER;
+
+    if (__atomic_compare_exchange_n(&rwlock->rw_word, &w, 0,
+                                    FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+    ht_syncq_lock(&rwlock->rw_qlock);
+    se = ht_rwlock_handoff(rwlock, TRUE);
+    ht_syncq_unlock(&rwlock->rw_qlock);
+    ht_rwlock_grant(se);
+    return;
+}
+
+/* give up a read lock; the last reader hands over to a queued writer */
+static void
+ht_rwlock_unlock_rd(ht_rwlock_t *rwlock)
+{
+    ht_syncq_entry_t *se = NULL;
+    unsigned long w;
+
+    w = __atomic_sub_fetch(&rwlock->rw_word, HT_RWLOCK_READER, __ATOMIC_RELEASE);
+    if ((w & ~(HT_RWLOCK_RWAIT)) != HT_RWLOCK_WWAIT)
+        return;
+    ht_syncq_lock(&rwlock->rw_qlock);
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_ACQUIRE);
+    if ((w & ~(HT_RWLOCK_RWAIT)) == HT_RWLOCK_WWAIT)
+        se = ht_rwlock_handoff(rwlock, FALSE);
+    ht_syncq_unlock(&rwlock->rw_qlock);
+    ht_rwlock_grant(se);
+    return;
+}
+
+/* with the queue lock held: fix the wait bits after a waiter left its
+   queue without being granted the lock; returns the waiters to wake */
+static ht_syncq_entry_t *
+ht_rwlock_requeue(ht_rwlock_t *rwlock)
+{
+    unsigned long w, v;
+
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_RELAXED);
+    if (rwlock->rw_wqhead != NULL)
+        return NULL;
+    if (!(w & HT_RWLOCK_WRITER) && rwlock->rw_rqhead != NULL)
+        /* the readers only queued up behind the writers which left */
+        return ht_rwlock_handoff(rwlock, TRUE);
+    do {
+        v = w & ~(HT_RWLOCK_WWAIT);
+        if (rwlock->rw_rqhead == NULL)
+            v &= ~(HT_RWLOCK_RWAIT);
+    } while (!__atomic_compare_exchange_n(&rwlock->rw_word, &w, v,
+                                          FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return NULL;
+}
+
+/* a parked thread was cancelled: give back what it got, or leave */
+static void
+ht_rwlock_undo(void *_rwlock, ht_syncq_entry_t *se, int woken)
+{
+    ht_rwlock_t *rwlock = (ht_rwlock_t *)_rwlock;
+    ht_syncq_entry_t *wake;
+
+    if (woken) {
+        if (se->se_w.w_index == HT_RWLOCK_RW)
+            ht_rwlock_unlock_rw(rwlock);
+        else
+            ht_rwlock_unlock_rd(rwlock);
+        return;
+    }
+    ht_syncq_lock(&rwlock->rw_qlock);
+    wake = ht_rwlock_requeue(rwlock);
+    ht_syncq_unlock(&rwlock->rw_qlock);
+    ht_rwlock_grant(wake);
+    return;
+}
+
 int 
 ht_rwlock_init(ht_rwlock_t *rwlock)
 {
     if (rwlock == NULL)
         return ht_error(FALSE, EINVAL);
-    rwlock->rw_state = HT_RWLOCK_INITIALIZED;
-    rwlock->rw_readers = 0;
-    ht_mutex_init(&(rwlock->rw_mutex_rd));
-    ht_mutex_init(&(rwlock->rw_mutex_rw));
+    rwlock->rw_state  = HT_RWLOCK_INITIALIZED;
+    rwlock->rw_word   = 0;
+    rwlock->rw_qlock  = 0;
+    rwlock->rw_rqhead = NULL;
+    rwlock->rw_rqtail = NULL;
+    rwlock->rw_wqhead = NULL;
+    rwlock->rw_wqtail = NULL;
+    rwlock->rw_prof   = (ht_lockprof_enabled ? ht_lockprof_site(HT_LOCKPROF_RWLOCK, NULL,
+                                               __builtin_return_address(0)) : NULL);
+    rwlock->rw_since  = 0;
     return TRUE;
 }
 
 int 
 ht_rwlock_acquire(ht_rwlock_t *rwlock, int op, int tryonly, ht_event_t ev_extra)
 {
+    ht_syncq_entry_t se, *wake;
+    unsigned long w, busy, want;
+    unsigned long long waited = 0;
+    void **head, **tail;
+    int err;
+
     /* consistency checks */
-    if (rwlock == NULL)
+    if (rwlock == NULL || (op != HT_RWLOCK_RD && op != HT_RWLOCK_RW))
         return ht_error(FALSE, EINVAL);
     if (!(rwlock->rw_state & HT_RWLOCK_INITIALIZED))
         return ht_error(FALSE, EDEADLK);
+    if (ev_extra != NULL && ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EINVAL);
 
-    /* acquire lock */
+    /* readers are held off by writers, holding or waiting, and
+       writers by everybody except the readers queued behind them */
     if (op == HT_RWLOCK_RW) {
-        /* read-write lock is simple */
-        if (!ht_mutex_acquire(&(rwlock->rw_mutex_rw), tryonly, ev_extra))
-            return FALSE;
-        rwlock->rw_mode = HT_RWLOCK_RW;
+        busy = ~(HT_RWLOCK_RWAIT);
+        want = HT_RWLOCK_WWAIT;
+        head = &rwlock->rw_wqhead;
+        tail = &rwlock->rw_wqtail;
     }
     else {
-        /* read-only lock is more complicated to get right */
-        if (!ht_mutex_acquire(&(rwlock->rw_mutex_rd), tryonly, ev_extra))
-            return FALSE;
-        rwlock->rw_readers++;
-        if (rwlock->rw_readers == 1) {
-            if (!ht_mutex_acquire(&(rwlock->rw_mutex_rw), tryonly, ev_extra)) {
-                rwlock->rw_readers--;
-                ht_shield { ht_mutex_release(&(rwlock->rw_mutex_rd)); }
-                return FALSE;
+        busy = HT_RWLOCK_WRITER|HT_RWLOCK_WWAIT;
+        want = HT_RWLOCK_RWAIT;
+        head = &rwlock->rw_rqhead;
+        tail = &rwlock->rw_rqtail;
+    }
+
+    /* fast path: a single compare-and-swap */
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_RELAXED);
+    while (!(w & busy))
+        if (__atomic_compare_exchange_n(&rwlock->rw_word, &w,
+                (op == HT_RWLOCK_RW ? w|HT_RWLOCK_WRITER : w+HT_RWLOCK_READER),
+                FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto locked;
+    if (tryonly)
+        return ht_error(FALSE, EBUSY);
+
+    /* slow path: announce ourself in the lock word and park */
+    if (!ht_syncq_init(&se))
+        return FALSE;
+    if (rwlock->rw_prof != NULL)
+        waited = ht_time_ns();
+    se.se_w.w_index = op;
+    ht_syncq_lock(&rwlock->rw_qlock);
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_RELAXED);
+    for (;;) {
+        if (!(w & busy)) {
+            if (__atomic_compare_exchange_n(&rwlock->rw_word, &w,
+                    (op == HT_RWLOCK_RW ? w|HT_RWLOCK_WRITER : w+HT_RWLOCK_READER),
+                    FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                ht_syncq_unlock(&rwlock->rw_qlock);
+                goto locked;
             }
         }
-        rwlock->rw_mode = HT_RWLOCK_RD;
-        ht_mutex_release(&(rwlock->rw_mutex_rd));
+        else if (   (w & want)
+                 || __atomic_compare_exchange_n(&rwlock->rw_word, &w, w|want,
+                                                FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+    ht_syncq_append(head, tail, &se);
+    if (!ht_syncq_park(&rwlock->rw_qlock, head, tail, &se,
+                       ev_extra, TRUE, ht_rwlock_undo, rwlock)) {
+        /* the extra event occurred or the deadline passed,
+           and we left the queue again */
+        err = errno;
+        ht_syncq_lock(&rwlock->rw_qlock);
+        wake = ht_rwlock_requeue(rwlock);
+        ht_syncq_unlock(&rwlock->rw_qlock);
+        ht_rwlock_grant(wake);
+        return ht_error(FALSE, err);
     }
+
+    locked:
+    if (rwlock->rw_prof != NULL)
+        ht_lockprof_acquired(rwlock->rw_prof, waited,
+                             (op == HT_RWLOCK_RW ? &rwlock->rw_since : NULL));
     return TRUE;
 }
 
 int 
 ht_rwlock_release(ht_rwlock_t *rwlock)
 {
+    unsigned long w;
+
     /* consistency checks */
     if (rwlock == NULL)
         return ht_error(FALSE, EINVAL);
     if (!(rwlock->rw_state & HT_RWLOCK_INITIALIZED))
         return ht_error(FALSE, EDEADLK);
 
-    /* release lock */
-    if (rwlock->rw_mode == HT_RWLOCK_RW) {
-        /* read-write unlock is simple */
-        if (!ht_mutex_release(&(rwlock->rw_mutex_rw)))
-            return FALSE;
-    }
-    else {
-        /* read-only unlock is more complicated to get right */
-        if (!ht_mutex_acquire(&(rwlock->rw_mutex_rd), FALSE, NULL))
-            return FALSE;
-        rwlock->rw_readers--;
-        if (rwlock->rw_readers == 0) {
-            if (!ht_mutex_release(&(rwlock->rw_mutex_rw))) {
-                rwlock->rw_readers++;
-                ht_shield { ht_mutex_release(&(rwlock->rw_mutex_rd)); }
-                return FALSE;
-            }
-        }
-        rwlock->rw_mode = HT_RWLOCK_RD;
-        ht_mutex_release(&(rwlock->rw_mutex_rd));
+    /* a held write lock excludes readers, so the mode is in the word */
+    w = __atomic_load_n(&rwlock->rw_word, __ATOMIC_RELAXED);
+    if (w & HT_RWLOCK_WRITER) {
+        if (rwlock->rw_prof != NULL && rwlock->rw_since != 0)
+            ht_lockprof_released(rwlock->rw_prof, rwlock->rw_since);
+        ht_rwlock_unlock_rw(rwlock);
     }
+    else if (w & HT_RWLOCK_RMASK)
+        ht_rwlock_unlock_rd(rwlock);
+    else
+        return ht_error(FALSE, EDEADLK);
+    return TRUE;
+}
+
+/* profile the read-write lock under a name of its own */
+int
+ht_rwlock_setname(ht_rwlock_t *rwlock, const char *name)
+{
+    if (rwlock == NULL || name == NULL)
+        return ht_error(FALSE, EINVAL);
+    if ((rwlock->rw_prof = ht_lockprof_site(HT_LOCKPROF_RWLOCK, name, NULL)) == NULL)
+        return ht_error(FALSE, ENOMEM);
     return TRUE;
 }
 
 /*
 **  Condition Variables
+**
+**  Waiters queue up on the condition variable itself and a notify
+**  wakes them directly, in one pass for a broadcast. For threads
+**  waiting on HT_EVENT_COND events ht_cond_notify() still raises the
+**  signal bits for the event manager and yields to let them run.
 */
 
 int 
@@ -212,87 +874,158 @@ ht_cond_init(ht_cond_t *cond)
         return ht_error(FALSE, EINVAL);
     cond->cn_state   = HT_COND_INITIALIZED;
     cond->cn_waiters = 0;
+    cond->cn_qlock   = 0;
+    cond->cn_qhead   = NULL;
+    cond->cn_qtail   = NULL;
+    cond->cn_prof    = (ht_lockprof_enabled ? ht_lockprof_site(HT_LOCKPROF_COND, NULL,
+                                              __builtin_return_address(0)) : NULL);
     return TRUE;
 }
 
+/* a parked waiter was cancelled: pass on a notify it consumed */
+static void
+ht_cond_undo(void *_cond, ht_syncq_entry_t *se, int woken)
+{
+    ht_cond_t *cond = (ht_cond_t *)_cond;
+
+    if (woken)
+        ht_cond_notify_n(cond, 1);
+    else {
+        ht_syncq_lock(&cond->cn_qlock);
+        cond->cn_waiters--;
+        ht_syncq_unlock(&cond->cn_qlock);
+    }
+    return;
+}
+
 static 
 void 
-ht_cond_cleanup_handler(void *_cleanvec)
+ht_cond_cleanup_handler(void *_mutex)
 {
-    ht_mutex_t *mutex = (ht_mutex_t *)(((void **)_cleanvec)[0]);
-    ht_cond_t  *cond  = (ht_cond_t  *)(((void **)_cleanvec)[1]);
-
     /* re-acquire mutex when ht_cond_await() is cancelled
        in order to restore the condition variable semantics */
-    ht_mutex_acquire(mutex, FALSE, NULL);
-
-    /* fix number of waiters */
-    cond->cn_waiters--;
+    ht_mutex_take((ht_mutex_t *)_mutex, FALSE, NULL, FALSE);
     return;
 }
 
 int 
 ht_cond_await(ht_cond_t *cond, ht_mutex_t *mutex, ht_event_t ev_extra)
 {
-    static ht_key_t ev_key = HT_KEY_INIT;
-    void *cleanvec[2];
-    ht_event_t ev;
+    ht_syncq_entry_t se;
+    ht_cleanup_t cleanup;
+    unsigned long long waited = 0;
+    int rv, err;
 
     /* consistency checks */
     if (cond == NULL || mutex == NULL)
         return ht_error(FALSE, EINVAL);
     if (!(cond->cn_state & HT_COND_INITIALIZED))
         return ht_error(FALSE, EDEADLK);
+    if (ev_extra != NULL && ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EINVAL);
+    if (!ht_syncq_init(&se))
+        return FALSE;
+    if (cond->cn_prof != NULL)
+        waited = ht_time_ns();
 
-    /* check whether we can do a short-circuit wait */
-    if (    (cond->cn_state & HT_COND_SIGNALED)
-        && !(cond->cn_state & HT_COND_BROADCAST)) {
-        cond->cn_state &= ~(HT_COND_SIGNALED);
-        cond->cn_state &= ~(HT_COND_BROADCAST);
-        cond->cn_state &= ~(HT_COND_HANDLED);
-        return TRUE;
-    }
-
-    /* add us to the number of waiters */
+    /* queue us up before the mutex is released, so that
+       no notify between the two can get lost */
+    ht_syncq_lock(&cond->cn_qlock);
+    ht_syncq_append(&cond->cn_qhead, &cond->cn_qtail, &se);
     cond->cn_waiters++;
+    ht_syncq_unlock(&cond->cn_qlock);
 
     /* release mutex (caller had to acquire it first) */
     ht_mutex_release(mutex);
 
-    /* wait until the condition is signaled */
-    ev = ht_event(HT_EVENT_COND|HT_MODE_STATIC, &ev_key, cond);
-    if (ev_extra != NULL)
-        ht_event_concat(ev, ev_extra, NULL);
-    cleanvec[0] = mutex;
-    cleanvec[1] = cond;
-    ht_cleanup_push(ht_cond_cleanup_handler, cleanvec);
-    ht_wait(ev);
-    ht_cleanup_pop(FALSE);
-    if (ev_extra != NULL)
-        ht_event_isolate(ev);
+    /* wait until the condition is signaled; only green
+       threads can be cancelled while they are parked */
+    if (se.se_w.w_tid != NULL)
+        ht_cleanup_link(&cleanup, ht_cond_cleanup_handler, mutex);
+    ht_syncq_lock(&cond->cn_qlock);
+    rv = ht_syncq_park(&cond->cn_qlock, &cond->cn_qhead, &cond->cn_qtail,
+                       &se, ev_extra, TRUE, ht_cond_undo, cond);
+    err = errno;
+    if (se.se_w.w_tid != NULL)
+        ht_cleanup_unlink(&cleanup, FALSE);
+    if (!rv) {
+        ht_syncq_lock(&cond->cn_qlock);
+        cond->cn_waiters--;
+        ht_syncq_unlock(&cond->cn_qlock);
+    }
 
-    /* reacquire mutex */
-    ht_mutex_acquire(mutex, FALSE, NULL);
+    /* reacquire mutex, past the deadline as well */
+    ht_mutex_take(mutex, FALSE, NULL, FALSE);
+    if (cond->cn_prof != NULL)
+        ht_lockprof_acquired(cond->cn_prof, waited, NULL);
+    if (!rv)
+        return ht_error(FALSE, err);
+    return TRUE;
+}
 
-    /* remove us from the number of waiters */
-    cond->cn_waiters--;
+/* wake up to n waiters (all for HT_COND_ALL) without yielding;
+   returns the number of threads woken */
+int
+ht_cond_notify_n(ht_cond_t *cond, int n)
+{
+    ht_syncq_entry_t *se, *wake = NULL, **tail = &wake;
+    int k;
 
-    /* release mutex (caller had to acquire it first) */
+    /* consistency checks */
+    if (cond == NULL || (n < 0 && n != HT_COND_ALL))
+        return ht_error(-1, EINVAL);
+    if (!(cond->cn_state & HT_COND_INITIALIZED))
+        return ht_error(-1, EDEADLK);
+
+    /* unlink the waiters in one go and wake them outside the lock */
+    ht_syncq_lock(&cond->cn_qlock);
+    for (k = 0; k != n; k++) {
+        if ((se = ht_syncq_pop(&cond->cn_qhead, &cond->cn_qtail)) == NULL)
+            break;
+        *tail = se;
+        tail = &se->se_next;
+    }
+    *tail = NULL;
+    cond->cn_waiters -= k;
+    ht_syncq_unlock(&cond->cn_qlock);
+    for (; wake != NULL; wake = se) {
+        se = wake->se_next;
+        ht_waiter_wake(&wake->se_w);
+    }
+    return k;
+}
+
+/* profile the condition variable under a name of its own */
+int
+ht_cond_setname(ht_cond_t *cond, const char *name)
+{
+    if (cond == NULL || name == NULL)
+        return ht_error(FALSE, EINVAL);
+    if ((cond->cn_prof = ht_lockprof_site(HT_LOCKPROF_COND, name, NULL)) == NULL)
+        return ht_error(FALSE, ENOMEM);
     return TRUE;
 }
 
 int 
 ht_cond_notify(ht_cond_t *cond, int broadcast)
 {
+    int rc;
+
     /* consistency checks */
     if (cond == NULL)
         return ht_error(FALSE, EINVAL);
     if (!(cond->cn_state & HT_COND_INITIALIZED))
         return ht_error(FALSE, EDEADLK);
+    if (!ht_sched_here) {
+        ht_sched_enter();
+        rc = ht_cond_notify(cond, broadcast);
+        ht_sched_leave(FALSE);
+        return rc;
+    }
 
     /* do something only if there is at least one waiters (POSIX semantics) */
-    if (cond->cn_waiters > 0) {
-        /* signal the condition */
+    if (ht_cond_notify_n(cond, broadcast ? HT_COND_ALL : 1) > 0) {
+        /* signal the condition to event waiters */
         cond->cn_state |= HT_COND_SIGNALED;
         if (broadcast)
             cond->cn_state |= HT_COND_BROADCAST;
@@ -302,6 +1035,7 @@ ht_cond_notify(ht_cond_t *cond, int broadcast)
 
         /* and give other threads a chance to awake */
         ht_yield(NULL);
+        cond->cn_state &= ~(HT_COND_SIGNALED|HT_COND_BROADCAST|HT_COND_HANDLED);
     }
 
     /* return to caller */
@@ -310,28 +1044,42 @@ ht_cond_notify(ht_cond_t *cond, int broadcast)
 
 /*
 **  Barriers
+**
+**  A sense-reversing barrier: arrivals count down, and the last one
+**  resets the count, flips the cycle and wakes the parked waiters in
+**  one pass. Green threads park right away, while threads on kernel
+**  threads of their own first spin on the cycle for a while, as the
+**  others of a batch phase usually arrive shortly.
 */
 
+#define HT_BARRIER_SPIN 2000
+
+static void
+ht_barrier_undo(void *_barrier, ht_syncq_entry_t *se, int woken)
+{
+    return;
+}
+
 int 
 ht_barrier_init(ht_barrier_t *barrier, int threshold)
 {
     if (barrier == NULL || threshold <= 0)
         return ht_error(FALSE, EINVAL);
-    if (!ht_mutex_init(&(barrier->br_mutex)))
-        return FALSE;
-    if (!ht_cond_init(&(barrier->br_cond)))
-        return FALSE;
     barrier->br_state     = HT_BARRIER_INITIALIZED;
     barrier->br_threshold = threshold;
     barrier->br_count     = threshold;
     barrier->br_cycle     = FALSE;
+    barrier->br_qlock     = 0;
+    barrier->br_qhead     = NULL;
+    barrier->br_qtail     = NULL;
     return TRUE;
 }
 
 int 
 ht_barrier_reach(ht_barrier_t *barrier)
 {
-    int cancel, cycle;
+    ht_syncq_entry_t se, *next, *wake;
+    int cancel, cycle, n, i;
     int rv;
 
     if (barrier == NULL)
@@ -339,30 +1087,277 @@ ht_barrier_reach(ht_barrier_t *barrier)
     if (!(barrier->br_state & HT_BARRIER_INITIALIZED))
         return ht_error(FALSE, EINVAL);
 
-    if (!ht_mutex_acquire(&(barrier->br_mutex), FALSE, NULL))
+    /* the cycle has to be read before we count ourself in */
+    cycle = __atomic_load_n(&barrier->br_cycle, __ATOMIC_ACQUIRE);
+    n = __atomic_sub_fetch(&barrier->br_count, 1, __ATOMIC_ACQ_REL);
+    if (n == 0) {
+        /* last thread reached the barrier: reset it for the next
+           phase before anybody can be released into that */
+        __atomic_store_n(&barrier->br_count, barrier->br_threshold, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->br_cycle, !cycle, __ATOMIC_RELEASE);
+        ht_syncq_lock(&barrier->br_qlock);
+        wake = barrier->br_qhead;
+        barrier->br_qhead = barrier->br_qtail = NULL;
+        ht_syncq_unlock(&barrier->br_qlock);
+        for (; wake != NULL; wake = next) {
+            next = wake->se_next;
+            ht_waiter_wake(&wake->se_w);
+        }
+        return HT_BARRIER_TAILLIGHT;
+    }
+    rv = (n == barrier->br_threshold - 1 ? HT_BARRIER_HEADLIGHT : TRUE);
+
+    /* wait until remaining threads have reached the barrier, too */
+    if (ht_sched_here != HT_SCHED_NATIVE)
+        for (i = 0; i < HT_BARRIER_SPIN; i++) {
+            if (__atomic_load_n(&barrier->br_cycle, __ATOMIC_ACQUIRE) != cycle)
+                return rv;
+            ht_util_cpu_relax();
+        }
+    if (!ht_syncq_init(&se))
         return FALSE;
-    cycle = barrier->br_cycle;
-    if (--(barrier->br_count) == 0) {
-        /* last thread reached the barrier */
-        barrier->br_cycle   = !(barrier->br_cycle);
-        barrier->br_count   = barrier->br_threshold;
-        if ((rv = ht_cond_notify(&(barrier->br_cond), TRUE)))
-            rv = HT_BARRIER_TAILLIGHT;
+    ht_syncq_lock(&barrier->br_qlock);
+    if (__atomic_load_n(&barrier->br_cycle, __ATOMIC_ACQUIRE) != cycle) {
+        ht_syncq_unlock(&barrier->br_qlock);
+        return rv;
     }
-    else {
-        /* wait until remaining threads have reached the barrier, too */
+    ht_syncq_append(&barrier->br_qhead, &barrier->br_qtail, &se);
+    if (se.se_w.w_tid != NULL)
         ht_cancel_state(HT_CANCEL_DISABLE, &cancel);
-        if (barrier->br_threshold == barrier->br_count)
-            rv = HT_BARRIER_HEADLIGHT;
-        else
-            rv = TRUE;
-        while (cycle == barrier->br_cycle) {
-            if (!(rv = ht_cond_await(&(barrier->br_cond), &(barrier->br_mutex), NULL)))
-                break;
-        }
+    ht_syncq_park(&barrier->br_qlock, &barrier->br_qhead, &barrier->br_qtail,
+                  &se, NULL, FALSE, ht_barrier_undo, barrier);
+    if (se.se_w.w_tid != NULL)
         ht_cancel_state(cancel, NULL);
-    }
-    ht_mutex_release(&(barrier->br_mutex));
     return rv;
 }
 
+/*
+**  Counting Semaphores
+**
+**  The count is taken with a compare-and-swap. Parked threads queue
+**  up like on a mutex, and a release hands its units directly to the
+**  queued threads, which therefore never have to retry.
+*/
+
+/* take a unit if one is available */
+static int
+ht_sem_trytake(ht_sem_t *sem)
+{
+    int count;
+
+    count = __atomic_load_n(&sem->sm_count, __ATOMIC_RELAXED);
+    while (count > 0)
+        if (__atomic_compare_exchange_n(&sem->sm_count, &count, count - 1,
+                                        FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return TRUE;
+    return FALSE;
+}
+
+/* hand available units to queued waiters */
+static void
+ht_sem_grant(ht_sem_t *sem)
+{
+    ht_syncq_entry_t *se, *wake = NULL;
+
+    ht_syncq_lock(&sem->sm_qlock);
+    while (sem->sm_qhead != NULL && ht_sem_trytake(sem)) {
+        se = ht_syncq_pop(&sem->sm_qhead, &sem->sm_qtail);
+        __atomic_sub_fetch(&sem->sm_nwait, 1, __ATOMIC_SEQ_CST);
+        se->se_next = wake;
+        wake = se;
+    }
+    ht_syncq_unlock(&sem->sm_qlock);
+    for (; wake != NULL; wake = se) {
+        se = wake->se_next;
+        wake->se_w.w_result = TRUE;
+        ht_waiter_wake(&wake->se_w);
+    }
+    return;
+}
+
+/* a parked thread was cancelled: give back the unit it got, or leave */
+static void
+ht_sem_undo(void *_sem, ht_syncq_entry_t *se, int woken)
+{
+    ht_sem_t *sem = (ht_sem_t *)_sem;
+
+    if (woken)
+        ht_sem_release(sem, 1);
+    else
+        __atomic_sub_fetch(&sem->sm_nwait, 1, __ATOMIC_SEQ_CST);
+    return;
+}
+
+int
+ht_sem_init(ht_sem_t *sem, int value)
+{
+    if (sem == NULL || value < 0)
+        return ht_error(FALSE, EINVAL);
+    sem->sm_state = HT_SEM_INITIALIZED;
+    sem->sm_count = value;
+    sem->sm_qlock = 0;
+    sem->sm_nwait = 0;
+    sem->sm_qhead = NULL;
+    sem->sm_qtail = NULL;
+    return TRUE;
+}
+
+/* take a unit, parking until one is released or ev_extra occurs */
+int
+ht_sem_acquire(ht_sem_t *sem, int tryonly, ht_event_t ev_extra)
+{
+    ht_syncq_entry_t se;
+
+    /* consistency checks */
+    if (sem == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!(sem->sm_state & HT_SEM_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+    if (ev_extra != NULL && ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EINVAL);
+
+    if (ht_sem_trytake(sem))
+        return TRUE;
+    if (tryonly)
+        return ht_error(FALSE, EAGAIN);
+
+    if (!ht_syncq_init(&se))
+        return FALSE;
+    ht_syncq_lock(&sem->sm_qlock);
+    __atomic_add_fetch(&sem->sm_nwait, 1, __ATOMIC_SEQ_CST);
+    /* a release adds its units before it looks for waiters,
+       so we either get one here or get granted one later */
+    if (ht_sem_trytake(sem)) {
+        __atomic_sub_fetch(&sem->sm_nwait, 1, __ATOMIC_SEQ_CST);
+        ht_syncq_unlock(&sem->sm_qlock);
+        return TRUE;
+    }
+    ht_syncq_append(&sem->sm_qhead, &sem->sm_qtail, &se);
+    if (!ht_syncq_park(&sem->sm_qlock, &sem->sm_qhead, &sem->sm_qtail,
+                       &se, ev_extra, TRUE, ht_sem_undo, sem)) {
+        __atomic_sub_fetch(&sem->sm_nwait, 1, __ATOMIC_SEQ_CST);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* give back n units, waking as many parked threads */
+int
+ht_sem_release(ht_sem_t *sem, int n)
+{
+    /* consistency checks */
+    if (sem == NULL || n < 1)
+        return ht_error(FALSE, EINVAL);
+    if (!(sem->sm_state & HT_SEM_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+
+    __atomic_add_fetch(&sem->sm_count, n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->sm_nwait, __ATOMIC_SEQ_CST) > 0)
+        ht_sem_grant(sem);
+    return TRUE;
+}
+
+/* number of available units */
+int
+ht_sem_value(ht_sem_t *sem)
+{
+    if (sem == NULL)
+        return ht_error(-1, EINVAL);
+    return __atomic_load_n(&sem->sm_count, __ATOMIC_RELAXED);
+}
+
+/*
+**  Wait Groups
+**
+**  A counter of outstanding work. Waiters park until it drops to
+**  zero, and the thread which brings it there wakes all of them in
+**  one pass.
+*/
+
+static void
+ht_waitgroup_undo(void *_wg, ht_syncq_entry_t *se, int woken)
+{
+    return;
+}
+
+int
+ht_waitgroup_init(ht_waitgroup_t *wg)
+{
+    if (wg == NULL)
+        return ht_error(FALSE, EINVAL);
+    wg->wg_state = HT_WAITGROUP_INITIALIZED;
+    wg->wg_count = 0;
+    wg->wg_qlock = 0;
+    wg->wg_qhead = NULL;
+    wg->wg_qtail = NULL;
+    return TRUE;
+}
+
+/* add to the outstanding work, waking the waiters when it is done */
+int
+ht_waitgroup_add(ht_waitgroup_t *wg, int delta)
+{
+    ht_syncq_entry_t *se, *next;
+    int count;
+
+    /* consistency checks */
+    if (wg == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!(wg->wg_state & HT_WAITGROUP_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+
+    count = __atomic_load_n(&wg->wg_count, __ATOMIC_RELAXED);
+    do {
+        if (count + delta < 0)
+            return ht_error(FALSE, EINVAL);
+    } while (!__atomic_compare_exchange_n(&wg->wg_count, &count, count + delta,
+                                          FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if (count + delta > 0 || delta == 0)
+        return TRUE;
+
+    /* waiters check the count under the queue lock */
+    ht_syncq_lock(&wg->wg_qlock);
+    se = wg->wg_qhead;
+    wg->wg_qhead = wg->wg_qtail = NULL;
+    ht_syncq_unlock(&wg->wg_qlock);
+    for (; se != NULL; se = next) {
+        next = se->se_next;
+        se->se_w.w_result = TRUE;
+        ht_waiter_wake(&se->se_w);
+    }
+    return TRUE;
+}
+
+int
+ht_waitgroup_done(ht_waitgroup_t *wg)
+{
+    return ht_waitgroup_add(wg, -1);
+}
+
+/* park until the outstanding work is done or ev_extra occurs */
+int
+ht_waitgroup_wait(ht_waitgroup_t *wg, ht_event_t ev_extra)
+{
+    ht_syncq_entry_t se;
+
+    /* consistency checks */
+    if (wg == NULL)
+        return ht_error(FALSE, EINVAL);
+    if (!(wg->wg_state & HT_WAITGROUP_INITIALIZED))
+        return ht_error(FALSE, EDEADLK);
+    if (ev_extra != NULL && ht_sched_here != HT_SCHED_NATIVE)
+        return ht_error(FALSE, EINVAL);
+
+    if (__atomic_load_n(&wg->wg_count, __ATOMIC_ACQUIRE) == 0)
+        return TRUE;
+    if (!ht_syncq_init(&se))
+        return FALSE;
+    ht_syncq_lock(&wg->wg_qlock);
+    if (__atomic_load_n(&wg->wg_count, __ATOMIC_ACQUIRE) == 0) {
+        ht_syncq_unlock(&wg->wg_qlock);
+        return TRUE;
+    }
+    ht_syncq_append(&wg->wg_qhead, &wg->wg_qtail, &se);
+    return ht_syncq_park(&wg->wg_qlock, &wg->wg_qhead, &wg->wg_qtail,
+                         &se, ev_extra, TRUE, ht_waitgroup_undo, wg);
+}
@@ -20,6 +20,8 @@ ht_tcb_alloc(unsigned int stacksize, void *stackaddr)
     t->stack      = NULL;
     t->stackguard = NULL;
     t->stackloan  = (stackaddr != NULL ? TRUE : FALSE);
+    t->cleanups   = NULL;
+    t->cleanfree  = NULL;
     if (stacksize > 0) { /* stacksize == 0 means "main" thread */
         if (stackaddr != NULL)
             t->stack = (char *)(stackaddr);
@@ -42,12 +44,14 @@ ht_tcb_free(ht_t t)
 {
     if (t == NULL)
         return;
+    /* frames may live on the stack, so unlink them first */
+    if (t->cleanups != NULL)
+        ht_cleanup_popall(t, FALSE);
+    ht_cleanup_drop(t);
     if (t->stack != NULL && !t->stackloan)
         free(t->stack);
     if (t->data_value != NULL)
         free(t->data_value);
-    if (t->cleanups != NULL)
-        ht_cleanup_popall(t, FALSE);
     free(t);
     return;
 }
@@ -2,6 +2,58 @@
 /* a global variable holding a zero time */
 ht_time_t ht_time_zero = { 0L, 0L };
 
+/* the time of the current scheduler pass, read once per pass and
+   shared by the scheduler's accounting and the event manager */
+ht_time_t ht_time_pass = { 0L, 0L };
+
+/* the timer slack of threads without one of their own (microseconds) */
+int ht_time_slack = 0;
+
+/*
+ * All time points are taken from the monotonic clock, so stepping
+ * the wall clock does not disturb timers. Through the vDSO this is
+ * a TSC read already, without a system call.
+ */
+
+/* the current time point */
+void
+ht_time_now(ht_time_t *t)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->tv_sec  = ts.tv_sec;
+    t->tv_usec = ts.tv_nsec / 1000;
+    return;
+}
+
+/* the current time point in nanoseconds */
+unsigned long long
+ht_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* round a deadline up to the end of its slack bucket; the buckets
+   are aligned on the clock, so the timers of all threads falling
+   into one bucket expire together */
+void
+ht_time_coalesce(ht_time_t *t, int slack)
+{
+    long long usec;
+
+    if (slack <= 1)
+        return;
+    usec = (long long)t->tv_sec * 1000000 + t->tv_usec;
+    usec = (usec + slack - 1) / slack * slack;
+    t->tv_sec  = usec / 1000000;
+    t->tv_usec = usec % 1000000;
+    return;
+}
+
 /* sleep for a specified amount of microseconds */
 void 
 ht_time_usleep(unsigned long usec)
@@ -10,7 +62,7 @@ ht_time_usleep(unsigned long usec)
     return;
 }
 
-/* time value constructor */
+/* time value constructor; as a time point it counts on CLOCK_MONOTONIC */
 ht_time_t 
 ht_time(long sec, long usec)
 {
@@ -0,0 +1,137 @@
+#include "ht_p.h"
+#include "ht_test.h"
+
+/* test the monotonic clock and the pass time after a timed sleep */
+void
+test1()
+{
+   unsigned long long t0, t1;
+   ht_time_t tv;
+
+   t0 = ht_time_ns();
+   tv = ht_timeout(0, 20000);
+   ht_usleep(20000);
+   t1 = ht_time_ns();
+   HT_TEST_ASSERT(t1 - t0 >= 20000000ULL, "ht_usleep() returned early.");
+   HT_TEST_ASSERT(ht_time_cmp(&tv, &ht_time_pass) <= 0,
+                  "the pass time was not refreshed after sleeping.");
+}
+
+/* test timer slack coalescing the wakeups of several sleepers */
+static unsigned long long test2_woke[2];
+
+static void *
+test2_sleeper(void *arg)
+{
+   long i = (long)arg;
+
+   ht_usleep(i == 0 ? 5000 : 60000);
+   test2_woke[i] = ht_time_ns();
+   return NULL;
+}
+
+void
+test2()
+{
+   ht_attr_t attr = ht_attr_new();
+   ht_attr_t self = ht_attr_of(ht_self());
+   unsigned long long t0, t1;
+   ht_t tid[2];
+   int slack;
+   long i;
+
+   /* a per-thread slack delays a sleeper to the end of its bucket */
+   HT_TEST_ASSERT(ht_attr_set(self, HT_ATTR_TIMER_SLACK, 100000), "ht_attr_set() failed.");
+   t0 = ht_time_ns();
+   ht_usleep(1000);
+   t1 = ht_time_ns();
+   HT_TEST_ASSERT(t1 >= (t0 / 1000 + 1000 + 99999) / 100000 * 100000 * 1000,
+                  "a sleeper woke before the end of its slack bucket.");
+   HT_TEST_ASSERT(ht_attr_set(self, HT_ATTR_TIMER_SLACK, -1), "ht_attr_set() failed.");
+
+   /* with a global slack, timers due in one bucket fire together;
+      uncoalesced they would wake 55ms apart */
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_TIMERSLACK, 100000) == 0, "ht_ctrl() failed.");
+   ht_usleep(1);
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   ht_attr_get(attr, HT_ATTR_TIMER_SLACK, &slack);
+   HT_TEST_ASSERT(slack == -1, "the default slack is not the global one.");
+   for (i = 0; i < 2; i++)
+      tid[i] = ht_spawn(attr, test2_sleeper, (void *)i);
+   for (i = 0; i < 2; i++)
+      ht_join(tid[i], NULL);
+   HT_TEST_ASSERT(test2_woke[1] - test2_woke[0] < 40000000,
+                  "timers in one slack bucket woke separately.");
+   ht_ctrl(HT_CTRL_TIMERSLACK, 0);
+   ht_attr_destroy(self);
+   ht_attr_destroy(attr);
+}
+
+/* test sub-millisecond sleeps on the scheduler timer */
+void
+test3()
+{
+   unsigned long long t0, t1;
+   int i, fine = 0;
+
+   /* judge by the majority, a loaded host may delay a few wakeups */
+   for (i = 0; i < 20; i++) {
+      t0 = ht_time_ns();
+      ht_usleep(200);
+      t1 = ht_time_ns();
+      HT_TEST_ASSERT(t1 - t0 >= 200000, "ht_usleep() returned early.");
+      if (t1 - t0 < 2000000)
+         fine++;
+   }
+   HT_TEST_ASSERT(fine >= 10, "sub-millisecond sleeps overslept.");
+}
+
+/* test a per-thread deadline bounding blocking calls */
+static ht_mutex_t test4_mutex = HT_MUTEX_INIT;
+static ht_cond_t test4_cond = HT_COND_INIT;
+static ht_sem_t test4_sem = HT_SEM_INIT(0);
+
+void
+test4()
+{
+   ht_chan_t ch = ht_chan_create(0);
+   unsigned long long t0;
+   int fds[2];
+   char c;
+
+   HT_TEST_ASSERT(pipe(fds) == 0, "pipe() failed.");
+   t0 = ht_time_ns();
+   HT_TEST_ASSERT(ht_set_deadline(ht_self(), ht_timeout(0, 20000)), "ht_set_deadline() failed.");
+   HT_TEST_ASSERT(ht_read(fds[0], &c, 1) == -1 && errno == ETIMEDOUT,
+                  "ht_read() did not time out.");
+   HT_TEST_ASSERT(ht_time_ns() - t0 >= 20000000, "ht_read() timed out early.");
+
+   /* once passed, the deadline fails every blocking call right away */
+   HT_TEST_ASSERT(!ht_chan_recv(ch, NULL, FALSE) && errno == ETIMEDOUT,
+                  "ht_chan_recv() did not time out.");
+   HT_TEST_ASSERT(!ht_sem_acquire(&test4_sem, FALSE, NULL) && errno == ETIMEDOUT,
+                  "ht_sem_acquire() did not time out.");
+   ht_mutex_acquire(&test4_mutex, FALSE, NULL);
+   HT_TEST_ASSERT(!ht_cond_await(&test4_cond, &test4_mutex, NULL) && errno == ETIMEDOUT,
+                  "ht_cond_await() did not time out.");
+   HT_TEST_ASSERT(ht_mutex_release(&test4_mutex), "ht_cond_await() did not reacquire the mutex.");
+
+   HT_TEST_ASSERT(ht_clear_deadline(ht_self()), "ht_clear_deadline() failed.");
+   HT_TEST_ASSERT(ht_usleep(1000) == 0, "ht_usleep() failed without a deadline.");
+   ht_chan_destroy(ch);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+
+int
+main()
+{
+   ht_init();
+   test1();
+   test2();
+   test3();
+   test4();
+   ht_kill();
+   return 0;
+}
@@ -2,19 +2,22 @@
  * task queue implementation.
  * enqueue blocks when queue is full.
  * dequeue blocks when queue is empty. 
+ * the batch variants move several elements per lock round trip and
+ * wake exactly as many blocked consumers as there are new elements.
  */
 #include "ht_p.h"
 /* initialize the queue. */
 int 
 ht_tqueue_init(ht_tqueue_t * q, int size)
 {
-   q->q_list = (ht_t*) malloc(sizeof(ht_t) * size);
+   q->q_list = (ht_task_t*) malloc(sizeof(ht_task_t) * size);
    q->q_size = size;
    pthread_cond_init(&q->q_not_full, NULL);
    pthread_cond_init(&q->q_not_empty, NULL);
    pthread_mutex_init(&q->q_lock, NULL);
    q->q_head = q->q_rear = 0;
-   q->q_isfull = 0;  //empty
+   q->q_count = 0;   //empty
+   q->q_idle = 0;
    return 0;
 }
 
@@ -22,43 +25,109 @@ ht_tqueue_init(ht_tqueue_t * q, int size)
 unsigned int 
 ht_tqueue_elements(ht_tqueue_t * q)
 {
-   int n = q->q_head - q->q_rear;
-   n = (n < 0) ? -n : n;
-   if(n == 0)
+   return q->q_count;
+}
+
+/* wake up to n consumers blocked in dequeue; q_lock held. */
+static void
+ht_tqueue_wakeup(ht_tqueue_t * q, int n)
+{
+   n = ht_util_min(n, q->q_idle);
+   while(n-- > 0)
+      pthread_cond_signal(&q->q_not_empty);
+}
+
+int
+ht_tqueue_enqueue(ht_tqueue_t * q, ht_task_t t)
+{
+   return ht_tqueue_enqueue_n(q, &t, 1);
+}
+
+int
+ht_tqueue_enqueue_n(ht_tqueue_t * q, ht_task_t * list, int n)
+{
+   int i = 0;
+   int k;
+   pthread_mutex_lock(&q->q_lock);
+   while(i < n)
    {
-		return q->q_isfull ? q->q_size : 0;
+      while(q->q_count == q->q_size)
+         pthread_cond_wait(&q->q_not_full, &q->q_lock);
+      /* copy as many as fit, then publish them all at once. */
+      k = ht_util_min(n - i, q->q_size - q->q_count);
+      q->q_count += k;
+      ht_tqueue_wakeup(q, k);
+      while(k-- > 0)
+      {
+         q->q_list[q->q_head] = list[i++];
+         q->q_head = (q->q_head + 1) % q->q_size;
+      }
    }
-	return n;
+   pthread_mutex_unlock(&q->q_lock);
+   return 0;
 }
 
+/* enqueue as many as fit without blocking, return how many did. */
 int
-ht_tqueue_enqueue(ht_tqueue_t * q, ht_t t)
+ht_tqueue_tryenqueue_n(ht_tqueue_t * q, ht_task_t * list, int n)
 {
+   int i, k;
    pthread_mutex_lock(&q->q_lock);
-   if(ht_tqueue_elements(q) == q->q_size)
-      pthread_cond_wait(&q->q_not_full, &q->q_lock);
-   q->q_list[q->q_head] = t;
-   q->q_head = (q->q_head + 1) % q->q_size;
-   if(0 == q->q_head - q->q_rear)
-		q->q_isfull = 1;   //full
-   pthread_cond_signal(&q->q_not_empty);
+   k = ht_util_min(n, q->q_size - q->q_count);
+   q->q_count += k;
+   ht_tqueue_wakeup(q, k);
+   for(i = 0; i < k; i++)
+   {
+      q->q_list[q->q_head] = list[i];
+      q->q_head = (q->q_head + 1) % q->q_size;
+   }
    pthread_mutex_unlock(&q->q_lock);
-   return 0;
+   return k;
 }
 
-ht_t
+ht_task_t
 ht_tqueue_dequeue(ht_tqueue_t * q)
 {
+   ht_task_t r;
+   ht_tqueue_dequeue_n(q, &r, 1);
+   return r;
+}
+
+int
+ht_tqueue_dequeue_n(ht_tqueue_t * q, ht_task_t * list, int max)
+{
+   int n, k;
    pthread_mutex_lock(&q->q_lock);
-   if(ht_tqueue_elements(q) == 0)
+   while(q->q_count == 0)
+   {
+      q->q_idle++;
       pthread_cond_wait(&q->q_not_empty, &q->q_lock);
-   ht_t r = q->q_list[q->q_rear];
-   q->q_rear = (q->q_rear + 1) % q->q_size;
-   if(0 == q->q_head - q->q_rear)
-      q->q_isfull = 0;  //empty
-   pthread_cond_signal(&q->q_not_full);
+      q->q_idle--;
+   }
+   /* do not hoard: leave a fair share for the other idle consumers. */
+   n = ht_util_min(max, q->q_count);
+   if(q->q_idle > 0)
+      n = ht_util_min(n, (q->q_count + q->q_idle) / (q->q_idle + 1));
+   if(n < 1)
+      n = 1;
+   for(k = 0; k < n; k++)
+   {
+      list[k] = q->q_list[q->q_rear];
+      q->q_rear = (q->q_rear + 1) % q->q_size;
+      if(list[k] == NULL)   //a NULL element ends a batch, so every
+      {                     //consumer gets its own stop marker.
+         k++;
+         break;
+      }
+   }
+   q->q_count -= k;
+   if(k > 1)
+      pthread_cond_broadcast(&q->q_not_full);
+   else
+      pthread_cond_signal(&q->q_not_full);
+   ht_tqueue_wakeup(q, q->q_count);
    pthread_mutex_unlock(&q->q_lock);
-   return r;
+   return k;
 }
 
 void
@@ -6,11 +6,11 @@ test1()
 {
    ht_tqueue_t testQ;
    ht_tqueue_init(&testQ, 3);
-   struct ht_st t;
+   struct ht_task_st t;
    ht_tqueue_enqueue(&testQ, &t);
    HT_TEST_ASSERT(1 == ht_tqueue_elements(&testQ),
                   "ht_tqueue_elements did not return expected result.");
-   ht_t r = ht_tqueue_dequeue(&testQ);
+   ht_task_t r = ht_tqueue_dequeue(&testQ);
    HT_TEST_ASSERT(r == &t,
                   "ht_tqueue_dequeue did not return expected result.");
    ht_tqueue_destroy(&testQ);
@@ -79,7 +79,7 @@ void test4()
 {
    ht_tqueue_t q;
    ht_tqueue_init(&q, 2);
-   struct ht_st t;
+   struct ht_task_st t;
    ht_tqueue_enqueue(&q, &t);
    HT_TEST_ASSERT(1 == ht_tqueue_elements(&q), "");
    HT_TEST_ASSERT(&t == ht_tqueue_dequeue(&q), "");
@@ -94,6 +94,48 @@ void test4()
    HT_TEST_ASSERT(0 == ht_tqueue_elements(&q), "");
 }
 
+/* test batch enqueue, batch dequeue and wrap around */
+void test5()
+{
+   ht_tqueue_t q;
+   ht_tqueue_init(&q, 4);
+   struct ht_task_st t[6];
+   ht_task_t in[6], out[6];
+   int i, n;
+   for(i = 0; i < 6; i++)
+      in[i] = &t[i];
+   ht_tqueue_enqueue_n(&q, in, 3);
+   HT_TEST_ASSERT(3 == ht_tqueue_elements(&q), 
+                  "ht_tqueue_enqueue_n did not queue all elements.");
+   n = ht_tqueue_dequeue_n(&q, out, 2);
+   HT_TEST_ASSERT(2 == n && out[0] == in[0] && out[1] == in[1],
+                  "ht_tqueue_dequeue_n did not return expected batch.");
+   ht_tqueue_enqueue_n(&q, in + 3, 3);
+   HT_TEST_ASSERT(4 == ht_tqueue_elements(&q), 
+                  "ht_tqueue_elements wrong after wrap around.");
+   n = ht_tqueue_dequeue_n(&q, out, 6);
+   HT_TEST_ASSERT(4 == n, "ht_tqueue_dequeue_n did not drain the queue.");
+   for(i = 0; i < 4; i++)
+      HT_TEST_ASSERT(out[i] == in[i + 2], 
+                     "ht_tqueue_dequeue_n broke FIFO order.");
+   HT_TEST_ASSERT(0 == ht_tqueue_elements(&q), "");
+   ht_tqueue_destroy(&q);
+}
+
+/* test a NULL element ends a batch */
+void test6()
+{
+   ht_tqueue_t q;
+   ht_tqueue_init(&q, 4);
+   ht_task_t in[3] = { NULL, NULL, NULL };
+   ht_task_t out[3];
+   ht_tqueue_enqueue_n(&q, in, 3);
+   HT_TEST_ASSERT(1 == ht_tqueue_dequeue_n(&q, out, 3),
+                  "ht_tqueue_dequeue_n did not stop at NULL element.");
+   HT_TEST_ASSERT(2 == ht_tqueue_elements(&q), "");
+   ht_tqueue_destroy(&q);
+}
+
 int 
 main()
 {
@@ -101,5 +143,7 @@ main()
    test2();
    test3();
    test4();
+   test5();
+   test6();
    return 0;
 }
@@ -18,6 +18,59 @@ ht_tqueue_t  ht_TQ;         /* queue of tasks request to be exec by worker */
 static int _ht_worker_num = 0;                  /* the number of workers. */
 static pthread_t *_ht_worker_tids = NULL;
 
+#define HT_WORKER_BATCH 4                       /* max tasks taken per dequeue. */
+
+/* the part of the worker's batch not run yet */
+static __thread ht_task_t *_ht_worker_rest = NULL;
+static __thread int _ht_worker_nrest = 0;
+
+/* the worker's kernel thread is about to park or to run a handed-out
+   thread: hand the rest of its batch back to the queue, one of those
+   tasks may be the one to wake us and another worker has to run it
+   meanwhile. */
+void
+ht_worker_release_batch(void)
+{
+   if(_ht_worker_nrest > 0)
+   {
+      ht_tqueue_enqueue_n(&ht_TQ, _ht_worker_rest, _ht_worker_nrest);
+      _ht_worker_nrest = 0;
+   }
+}
+
+/* complete a TASK event and wake up the scheduler for it. */
+void
+ht_worker_task_done(ht_event_t ev)
+{
+   __atomic_store_n(&ev->ev_args.TASK.fini, 1, __ATOMIC_RELEASE);
+   ht_sched_notify();
+}
+
+static void
+_ht_taskgroup_init(ht_taskgroup_t tg, int pending)
+{
+   tg->tg_pending = pending;
+   tg->tg_ev = NULL;
+   pthread_mutex_init(&tg->tg_lock, NULL);
+}
+
+/* run a job and report it to its group; the last one wakes the waiter.
+   The report happens under tg_lock, so a waiter which saw the group
+   drained under the lock knows no job touches the group any more. */
+static void
+_ht_worker_run_job(ht_task_t tk)
+{
+   ht_taskgroup_t tg = tk->tk_group;
+   tk->tk_func(tk->tk_arg);
+   if(tk->tk_owned)
+      free(tk);
+   pthread_mutex_lock(&tg->tg_lock);
+   if(__atomic_sub_fetch(&tg->tg_pending, 1, __ATOMIC_ACQ_REL) == 0
+      && tg->tg_ev != NULL)
+      ht_worker_task_done(tg->tg_ev);
+   pthread_mutex_unlock(&tg->tg_lock);
+}
+
 static 
 void*
 _ht_worker(void * argv)
@@ -29,24 +82,43 @@ _ht_worker(void * argv)
    pthread_cond_signal(&_ht_worker_cond_started);
    pthread_mutex_unlock(&_ht_worker_start_mutex);
    ht_worker_ctx_t worker_ctx;
+   ht_task_t batch[HT_WORKER_BATCH];
+   int i, n;
    pthread_setspecific(_ht_worker_ctx_key, &worker_ctx);
    while(!_ht_worker_stop_flag)
    {
-      ht_t t = ht_tqueue_dequeue(&ht_TQ);
-      if(t != NULL)   //send NULL when kill worker.
+      n = ht_tqueue_dequeue_n(&ht_TQ, batch, HT_WORKER_BATCH);
+      for(i = 0; i < n; i++)
       {
+         if(batch[i] == NULL)   //send NULL when kill worker.
+            continue;
+         _ht_worker_rest = &batch[i + 1];
+         _ht_worker_nrest = n - i - 1;
+         if(batch[i]->tk_tid == NULL)   //plain job, runs on the worker's stack.
+         {
+            _ht_worker_run_job(batch[i]);
+            n = i + 1 + _ht_worker_nrest;   //the rest may have been handed back.
+            continue;
+         }
+         /* a handed-out thread may block natively in a syscall, so only
+            plain jobs keep the batch, the rest goes to other workers */
+         ht_worker_release_batch();
+         ht_t t = batch[i]->tk_tid;
          snprintf(buf, 255, "worker %d switching to thread \"%s\"", 
                    id, t->name);
          ht_debug2("ht_worker: %s", buf); 
          worker_ctx.task = t;
+         ht_current = t;
          swapcontext(&worker_ctx.worker_mctx, &t->mctx.uc);
+         ht_current = NULL;
          snprintf(buf, 255, "worker %d back from thread \"%s\"",
                    id, t->name);
          ht_debug2("ht_worker: %s", buf);
-         t->events->ev_args.TASK.fini = 1;   /* mark the fini flag,
-                                                so scheduler can notice the 
-                                                event and resched the thread.
-                                              */
+         ht_worker_task_done(t->events);   /* mark the fini flag,
+                                              so scheduler can notice the 
+                                              event and resched the thread.
+                                            */
+         n = i + 1 + _ht_worker_nrest;
       }
    }
    ht_debug2("ht_worker: stoping worker %d", id);
@@ -62,8 +134,11 @@ ht_worker_init(int num_worker)
    pthread_mutex_init(&_ht_worker_start_mutex, NULL);
    pthread_cond_init(&_ht_worker_cond_started, NULL);
    /* initialize the task queue */
-   ht_tqueue_init(&ht_TQ, num_worker * 3); //allow 3 waiting tasks for each 
-                                           //worker.
+   ht_tqueue_init(&ht_TQ, num_worker * 3 > HT_TQUEUE_BATCH ?
+                          num_worker * 3 : HT_TQUEUE_BATCH);
+                                           //allow 3 waiting tasks for each 
+                                           //worker, and at least one full
+                                           //scheduler batch.
    /* start worker */
    _ht_worker_tids = (pthread_t *) malloc(sizeof(pthread_t) * num_worker);
    _ht_worker_num = num_worker;
@@ -92,10 +167,12 @@ ht_worker_kill()
    _ht_worker_stop_flag = 1;
    int i = 0;
    /*send signal to make sure worker notic the stop flag.*/
+   ht_task_t stop[_ht_worker_num];
    for(i = 0; i < _ht_worker_num; i++)
    {
-      ht_tqueue_enqueue(&ht_TQ, NULL);
+      stop[i] = NULL;
    }
+   ht_tqueue_enqueue_n(&ht_TQ, stop, _ht_worker_num);
    for(i = 0; i < _ht_worker_num; i++)
    {
       pthread_join(_ht_worker_tids[i], NULL);
@@ -111,10 +188,13 @@ ht_worker_kill()
 int 
 ht_hand_out()
 {
+   if (ht_sched_here != HT_SCHED_NATIVE)
+      return ht_error(-1, EPERM);   /* already handed out */
 	/* make a waiting ring 
 		and link event ring to current thread */
    ht_event_t ev = ht_event(HT_EVENT_TASK); 
    ht_current->events = ev;
+   ht_current->task.tk_tid = ht_current;
    /* set the thread to WAIT_FOR_SCHED_TO_WORKER 
 	  and transfer control to scheduler */
 	ht_current->state = HT_STATE_WAITING_FOR_SCHED_TO_WORKER;
@@ -127,9 +207,198 @@ ht_hand_out()
 int 
 ht_get_back()
 {
+   if (ht_sched_here)
+      return ht_error(-1, EPERM);   /* not handed out */
    ht_worker_ctx_t* worker_ctx = (ht_worker_ctx_t*) pthread_getspecific(_ht_worker_ctx_key);
    ht_t t = worker_ctx->task;
    swapcontext(&t->mctx.uc, &worker_ctx->worker_mctx);
-	ht_event_free(ht_current->events, HT_FREE_ALL);
+   ht_event_free(t->events, HT_FREE_ALL);
+   t->events = NULL;
+   t->task.tk_tid = NULL;
+   /* inherit from the threads which parked on our mutexes meanwhile */
+   ht_mutex_inherit(t);
    return 0;
 }
+
+/*
+ * Fork-join on the worker pool. Jobs run directly on the worker
+ * stacks, no green thread migrates. The thread waiting for a group
+ * parks as an ordinary waiting thread on a TASK event, which the
+ * last job of the group completes.
+ */
+
+ht_taskgroup_t
+ht_taskgroup_create(void)
+{
+   ht_taskgroup_t tg;
+
+   if((tg = (ht_taskgroup_t) malloc(sizeof(struct ht_taskgroup_st))) == NULL)
+      return ht_error((ht_taskgroup_t)NULL, ENOMEM);
+   _ht_taskgroup_init(tg, 0);
+   return tg;
+}
+
+int
+ht_taskgroup_spawn(ht_taskgroup_t tg, void (*func)(void *), void *arg)
+{
+   ht_task_t tk;
+
+   if(tg == NULL || func == NULL)
+      return ht_error(FALSE, EINVAL);
+   if((tk = (ht_task_t) malloc(sizeof(struct ht_task_st))) == NULL)
+      return ht_error(FALSE, ENOMEM);
+   tk->tk_tid   = NULL;
+   tk->tk_func  = func;
+   tk->tk_arg   = arg;
+   tk->tk_group = tg;
+   tk->tk_owned = TRUE;
+   __atomic_add_fetch(&tg->tg_pending, 1, __ATOMIC_ACQ_REL);
+   /* without a worker or with the queue congested the caller
+      runs the job itself, which also throttles the producer. */
+   if(_ht_worker_num == 0 || ht_tqueue_tryenqueue_n(&ht_TQ, &tk, 1) == 0)
+      _ht_worker_run_job(tk);
+   return TRUE;
+}
+
+/* wait for a group; with timed set the thread's deadline bounds the wait */
+static int
+_ht_taskgroup_wait(ht_taskgroup_t tg, int timed)
+{
+   static ht_key_t ev_key = HT_KEY_INIT;
+   ht_event_t ev;
+   int rc;
+
+   if(tg == NULL)
+      return ht_error(FALSE, EINVAL);
+   /* only green threads under the scheduler can park */
+   if(ht_sched_here != HT_SCHED_NATIVE)
+      return ht_error(FALSE, EPERM);
+   if((ev = ht_event(HT_EVENT_TASK|HT_MODE_STATIC, &ev_key)) == NULL)
+      return ht_error(FALSE, errno);
+   pthread_mutex_lock(&tg->tg_lock);
+   if(tg->tg_ev != NULL)
+   {
+      pthread_mutex_unlock(&tg->tg_lock);
+      return ht_error(FALSE, EBUSY);   //somebody else waits already.
+   }
+   if(tg->tg_pending == 0)
+   {
+      pthread_mutex_unlock(&tg->tg_lock);
+      return TRUE;
+   }
+   tg->tg_ev = ev;
+   pthread_mutex_unlock(&tg->tg_lock);
+   rc = ht_event_wait(ev, timed);
+   pthread_mutex_lock(&tg->tg_lock);
+   tg->tg_ev = NULL;
+   pthread_mutex_unlock(&tg->tg_lock);
+   if(rc < 0)
+      return ht_error(FALSE, ETIMEDOUT);
+   return TRUE;
+}
+
+int
+ht_taskgroup_wait(ht_taskgroup_t tg)
+{
+   return _ht_taskgroup_wait(tg, TRUE);
+}
+
+int
+ht_taskgroup_destroy(ht_taskgroup_t tg)
+{
+   int busy;
+
+   if(tg == NULL)
+      return ht_error(FALSE, EINVAL);
+   pthread_mutex_lock(&tg->tg_lock);
+   busy = (tg->tg_pending != 0 || tg->tg_ev != NULL);
+   pthread_mutex_unlock(&tg->tg_lock);
+   if(busy)
+      return ht_error(FALSE, EBUSY);
+   pthread_mutex_destroy(&tg->tg_lock);
+   free(tg);
+   return TRUE;
+}
+
+/* a parallel_for loop: its jobs keep grabbing the next chunk until none is left. */
+typedef struct ht_parallel_for_st ht_parallel_for_t;
+struct ht_parallel_for_st {
+   long        pf_begin;
+   long        pf_end;
+   long        pf_grain;
+   long        pf_chunks;
+   long        pf_next;               /* next chunk to run */
+   void        (*pf_func)(long, long, void *);
+   void        *pf_arg;
+};
+
+static void
+_ht_parallel_for_run(void *_pf)
+{
+   ht_parallel_for_t *pf = (ht_parallel_for_t *)_pf;
+   long k, lo;
+
+   while((k = __atomic_fetch_add(&pf->pf_next, 1, __ATOMIC_RELAXED)) < pf->pf_chunks)
+   {
+      lo = pf->pf_begin + k * pf->pf_grain;
+      pf->pf_func(lo, pf->pf_end - lo > pf->pf_grain ? lo + pf->pf_grain : pf->pf_end,
+                  pf->pf_arg);
+   }
+}
+
+int
+ht_parallel_for(long begin, long end, long grain, 
+                void (*func)(long, long, void *), void *arg)
+{
+   ht_parallel_for_t pf;
+   struct ht_taskgroup_st tg;
+   int nj, k, i, cs;
+
+   if(func == NULL || begin > end)
+      return ht_error(FALSE, EINVAL);
+   if(begin == end)
+      return TRUE;
+
+   /* by default aim at a few chunks per worker, for load balance */
+   if(grain <= 0)
+      grain = ht_util_max((end - begin) / (ht_util_max(_ht_worker_num, 1) * 4), 1);
+   pf.pf_begin  = begin;
+   pf.pf_end    = end;
+   pf.pf_grain  = grain;
+   pf.pf_chunks = (end - begin - 1) / grain + 1;
+   pf.pf_next   = 0;
+   pf.pf_func   = func;
+   pf.pf_arg    = arg;
+
+   /* off the scheduler nobody could park, so just run the loop */
+   nj = ht_util_min(_ht_worker_num, pf.pf_chunks);
+   if(nj <= 1 || ht_sched_here != HT_SCHED_NATIVE)
+   {
+      _ht_parallel_for_run(&pf);
+      return TRUE;
+   }
+
+   /* one job per worker, published at once */
+   struct ht_task_st jobs[nj];
+   ht_task_t list[nj];
+   _ht_taskgroup_init(&tg, nj);
+   for(i = 0; i < nj; i++)
+   {
+      jobs[i].tk_tid   = NULL;
+      jobs[i].tk_func  = _ht_parallel_for_run;
+      jobs[i].tk_arg   = &pf;
+      jobs[i].tk_group = &tg;
+      jobs[i].tk_owned = FALSE;
+      list[i] = &jobs[i];
+   }
+   k = ht_tqueue_tryenqueue_n(&ht_TQ, list, nj);
+   for(i = k; i < nj; i++)   //the queue is congested, help out.
+      _ht_worker_run_job(list[i]);
+   /* the jobs use this stack frame: neither the deadline nor a
+      cancellation may let us leave before the last one is done */
+   ht_cancel_state(HT_CANCEL_DISABLE, &cs);
+   _ht_taskgroup_wait(&tg, FALSE);
+   ht_cancel_state(cs, NULL);
+   pthread_mutex_destroy(&tg.tg_lock);
+   return TRUE;
+}
@@ -4,20 +4,698 @@
 void 
 test1()
 {
-   pthread_t tid = pthread_self();
+   /* not pthread_self(), a const function the compiler may
+      evaluate once for the whole test */
+   pid_t tid = syscall(SYS_gettid);
    ht_hand_out();
-   HT_TEST_ASSERT(tid != pthread_self(), 
+   HT_TEST_ASSERT(tid != syscall(SYS_gettid), 
                   "ht_hand_out() did not dispatch task to worker.");
    ht_get_back();
-   HT_TEST_ASSERT(tid == pthread_self(),
+   HT_TEST_ASSERT(tid == syscall(SYS_gettid),
                   "ht_get_back() did not get back task from worker."); 
 }
 
+static ht_mutex_t test2_mutex = HT_MUTEX_INIT;
+
+static void *
+test2_holder(void *arg)
+{
+   ht_mutex_acquire(&test2_mutex, FALSE, NULL);
+   ht_usleep(50000);
+   ht_mutex_release(&test2_mutex);
+   return NULL;
+}
+
+void
+test2()
+{
+   ht_t self = ht_self();
+   ht_t holder;
+   ht_msgport_t mp;
+   ht_message_t msg;
+   int fds[2];
+   char c = 'x';
+
+   mp = ht_msgport_create("test2");
+   holder = ht_spawn(HT_ATTR_DEFAULT, test2_holder, NULL);
+   while(!(test2_mutex.mx_state & HT_MUTEX_LOCKED))
+      ht_yield(NULL);
+   HT_TEST_ASSERT(pipe(fds) == 0, "pipe() failed.");
+   ht_hand_out();
+   HT_TEST_ASSERT(ht_self() == self,
+                  "ht_self() lost the handed-out thread.");
+   HT_TEST_ASSERT(ht_msgport_put(mp, &msg),
+                  "ht_msgport_put() failed on a worker.");
+   HT_TEST_ASSERT(ht_mutex_acquire(&test2_mutex, FALSE, NULL),
+                  "ht_mutex_acquire() failed on a worker.");
+   HT_TEST_ASSERT(test2_mutex.mx_owner == self,
+                  "ht_mutex_acquire() did not hand the mutex over.");
+   HT_TEST_ASSERT(ht_write(fds[1], &c, 1) == 1 && ht_read(fds[0], &c, 1) == 1,
+                  "ht_read()/ht_write() failed on a worker.");
+   HT_TEST_ASSERT(ht_mutex_release(&test2_mutex),
+                  "ht_mutex_release() failed on a worker.");
+   ht_get_back();
+   HT_TEST_ASSERT(ht_msgport_get(mp) == &msg,
+                  "message put from a worker got lost.");
+   ht_join(holder, NULL);
+   ht_msgport_destroy(mp);
+   close(fds[0]);
+   close(fds[1]);
+}
+
+static char test3_seen[10000];
+
+static void
+test3_body(long lo, long hi, void *arg)
+{
+   long i;
+   for(i = lo; i < hi; i++)
+      test3_seen[i]++;
+}
+
+void
+test3()
+{
+   long i;
+   int once = TRUE;
+
+   HT_TEST_ASSERT(ht_parallel_for(0, 10000, 7, test3_body, NULL),
+                  "ht_parallel_for() failed.");
+   for(i = 0; i < 10000; i++)
+      once = once && test3_seen[i] == 1;
+   HT_TEST_ASSERT(once, "ht_parallel_for() did not run each index once.");
+
+   /* a deadline passing meanwhile does not cut the loop short */
+   HT_TEST_ASSERT(ht_set_deadline(ht_self(), ht_timeout(0, 1)), "ht_set_deadline() failed.");
+   HT_TEST_ASSERT(ht_parallel_for(0, 10000, 7, test3_body, NULL),
+                  "ht_parallel_for() failed under a deadline.");
+   ht_clear_deadline(ht_self());
+   for(i = 0; i < 10000; i++)
+      once = once && test3_seen[i] == 2;
+   HT_TEST_ASSERT(once, "ht_parallel_for() returned before its jobs were done.");
+}
+
+static void
+test4_job(void *arg)
+{
+   __atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+void
+test4()
+{
+   ht_taskgroup_t tg = ht_taskgroup_create();
+   int count = 0;
+   int i;
+
+   for(i = 0; i < 100; i++)
+      ht_taskgroup_spawn(tg, test4_job, &count);
+   HT_TEST_ASSERT(ht_taskgroup_wait(tg), "ht_taskgroup_wait() failed.");
+   HT_TEST_ASSERT(count == 100, "ht_taskgroup_wait() returned too early.");
+   HT_TEST_ASSERT(ht_taskgroup_destroy(tg), "ht_taskgroup_destroy() failed.");
+}
+
+/* run n jobs on the workers next to n joinable green threads, call
+   body (if any) meanwhile, then join the threads and wait for the jobs */
+static void
+test_mixed(int n, void (*job)(void *), void *(*green)(void *), void (*body)(void))
+{
+   ht_taskgroup_t tg = ht_taskgroup_create();
+   ht_attr_t attr = ht_attr_new();
+   ht_t tid[n];
+   int i;
+
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   for(i = 0; i < n; i++)
+      ht_taskgroup_spawn(tg, job, NULL);
+   for(i = 0; i < n; i++)
+      tid[i] = ht_spawn(attr, green, NULL);
+   if(body != NULL)
+      body();
+   for(i = 0; i < n; i++)
+      ht_join(tid[i], NULL);
+   ht_taskgroup_wait(tg);
+   ht_taskgroup_destroy(tg);
+   ht_attr_destroy(attr);
+}
+
+static ht_mutex_t test5_mutex = HT_MUTEX_INIT;
+static long test5_count;
+
+static void
+test5_job(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 20000; i++) {
+      ht_mutex_acquire(&test5_mutex, FALSE, NULL);
+      test5_count++;
+      ht_mutex_release(&test5_mutex);
+   }
+}
+
+static void *
+test5_green(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 200; i++) {
+      ht_mutex_acquire(&test5_mutex, FALSE, NULL);
+      test5_count++;
+      ht_yield(NULL);
+      ht_mutex_release(&test5_mutex);
+   }
+   return NULL;
+}
+
+void
+test5()
+{
+   test_mixed(4, test5_job, test5_green, NULL);
+   HT_TEST_ASSERT(test5_count == 4 * 200 + 4 * 20000,
+                  "ht_mutex_t did not exclude workers and green threads.");
+   HT_TEST_ASSERT(!(test5_mutex.mx_state & HT_MUTEX_LOCKED) && test5_mutex.mx_nwait == 0,
+                  "ht_mutex_t was left locked.");
+}
+
+static ht_mutex_t test6_mutex = HT_MUTEX_INIT;
+static int test6_order[3], test6_n;
+
+static void *
+test6_green(void *arg)
+{
+   ht_mutex_acquire(&test6_mutex, FALSE, NULL);
+   test6_order[test6_n++] = (int)(long)arg;
+   ht_mutex_release(&test6_mutex);
+   return NULL;
+}
+
+void
+test6()
+{
+   ht_attr_t attr = ht_attr_new();
+   ht_t green[3];
+   long i;
+
+   ht_mutex_setfifo(&test6_mutex, TRUE);
+   ht_mutex_acquire(&test6_mutex, FALSE, NULL);
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   for(i = 0; i < 3; i++) {
+      green[i] = ht_spawn(attr, test6_green, (void *)i);
+      while(test6_mutex.mx_nwait < i + 1)
+         ht_yield(NULL);
+   }
+   ht_mutex_release(&test6_mutex);
+   HT_TEST_ASSERT(!ht_mutex_acquire(&test6_mutex, TRUE, NULL) && errno == EBUSY,
+                  "ht_mutex_release() let a FIFO mutex be barged.");
+   for(i = 0; i < 3; i++)
+      ht_join(green[i], NULL);
+   HT_TEST_ASSERT(test6_order[0] == 0 && test6_order[1] == 1 && test6_order[2] == 2,
+                  "FIFO mutex was not handed over in arrival order.");
+   ht_attr_destroy(attr);
+}
+
+static ht_rwlock_t test7_rwlock = HT_RWLOCK_INIT;
+static long test7_a, test7_b;
+static int test7_torn;
+
+static void
+test7_job(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 20000; i++) {
+      if (i % 8 == 0) {
+         ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RW, FALSE, NULL);
+         test7_a++;
+         test7_b++;
+      }
+      else {
+         ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RD, FALSE, NULL);
+         if (test7_a != test7_b)
+            test7_torn = TRUE;
+      }
+      ht_rwlock_release(&test7_rwlock);
+   }
+}
+
+static void *
+test7_writer(void *arg)
+{
+   ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RW, FALSE, NULL);
+   test7_a++;
+   ht_yield(NULL);
+   test7_b++;
+   ht_rwlock_release(&test7_rwlock);
+   return NULL;
+}
+
+void
+test7()
+{
+   ht_attr_t attr = ht_attr_new();
+   ht_t writer;
+
+   /* a waiting writer holds off new readers */
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RD, FALSE, NULL);
+   HT_TEST_ASSERT(ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RD, TRUE, NULL),
+                  "ht_rwlock_acquire() did not share the read lock.");
+   ht_rwlock_release(&test7_rwlock);
+   writer = ht_spawn(attr, test7_writer, NULL);
+   ht_yield(NULL);
+   HT_TEST_ASSERT(!ht_rwlock_acquire(&test7_rwlock, HT_RWLOCK_RD, TRUE, NULL) && errno == EBUSY,
+                  "ht_rwlock_acquire() let a reader overtake a waiting writer.");
+   ht_rwlock_release(&test7_rwlock);
+   ht_join(writer, NULL);
+   HT_TEST_ASSERT(test7_a == 1 && test7_b == 1, "writer did not get the lock.");
+
+   /* readers and writers on green threads and workers */
+   test_mixed(4, test7_job, test7_writer, NULL);
+   HT_TEST_ASSERT(!test7_torn && test7_a == test7_b,
+                  "ht_rwlock_t did not exclude readers from writers.");
+   HT_TEST_ASSERT(test7_rwlock.rw_word == 0, "ht_rwlock_t was left locked.");
+   ht_attr_destroy(attr);
+}
+
+static ht_sem_t test8_sem = HT_SEM_INIT(2);
+static ht_waitgroup_t test8_wg = HT_WAITGROUP_INIT;
+static int test8_inside, test8_over;
+
+static void
+test8_job(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 2000; i++) {
+      ht_sem_acquire(&test8_sem, FALSE, NULL);
+      if (__atomic_add_fetch(&test8_inside, 1, __ATOMIC_RELAXED) > 2)
+         test8_over = TRUE;
+      __atomic_sub_fetch(&test8_inside, 1, __ATOMIC_RELAXED);
+      ht_sem_release(&test8_sem, 1);
+   }
+   ht_waitgroup_done(&test8_wg);
+}
+
+static void *
+test8_green(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 100; i++) {
+      ht_sem_acquire(&test8_sem, FALSE, NULL);
+      if (__atomic_add_fetch(&test8_inside, 1, __ATOMIC_RELAXED) > 2)
+         test8_over = TRUE;
+      ht_yield(NULL);
+      __atomic_sub_fetch(&test8_inside, 1, __ATOMIC_RELAXED);
+      ht_sem_release(&test8_sem, 1);
+   }
+   ht_waitgroup_done(&test8_wg);
+   return NULL;
+}
+
+static void
+test8_body(void)
+{
+   HT_TEST_ASSERT(ht_waitgroup_wait(&test8_wg, NULL), "ht_waitgroup_wait() failed.");
+   HT_TEST_ASSERT(test8_wg.wg_count == 0, "ht_waitgroup_wait() returned early.");
+}
+
+void
+test8()
+{
+   ht_event_t ev;
+
+   /* a timed acquire of an exhausted semaphore */
+   HT_TEST_ASSERT(ht_sem_acquire(&test8_sem, TRUE, NULL) && ht_sem_acquire(&test8_sem, TRUE, NULL),
+                  "ht_sem_acquire() failed.");
+   HT_TEST_ASSERT(!ht_sem_acquire(&test8_sem, TRUE, NULL) && errno == EAGAIN,
+                  "ht_sem_acquire() exceeded the count.");
+   ev = ht_event(HT_EVENT_TIME, ht_timeout(0, 10000));
+   HT_TEST_ASSERT(!ht_sem_acquire(&test8_sem, FALSE, ev) && errno == EINTR,
+                  "ht_sem_acquire() did not time out.");
+   ht_event_free(ev, HT_FREE_THIS);
+   HT_TEST_ASSERT(test8_sem.sm_nwait == 0, "timed out waiter was left queued.");
+   ht_sem_release(&test8_sem, 2);
+
+   /* green threads and workers share the semaphore and the wait group */
+   ht_waitgroup_add(&test8_wg, 8);
+   test_mixed(4, test8_job, test8_green, test8_body);
+   HT_TEST_ASSERT(!test8_over, "ht_sem_t let too many threads in.");
+   HT_TEST_ASSERT(ht_sem_value(&test8_sem) == 2 && test8_sem.sm_nwait == 0,
+                  "ht_sem_t lost units.");
+   HT_TEST_ASSERT(!ht_waitgroup_done(&test8_wg) && errno == EINVAL,
+                  "ht_waitgroup_done() went below zero.");
+}
+
+static ht_mutex_t test9_mutex = HT_MUTEX_INIT;
+static ht_cond_t test9_cond = HT_COND_INIT;
+static int test9_items, test9_taken, test9_done;
+
+static void
+test9_job(void *arg)
+{
+   ht_mutex_acquire(&test9_mutex, FALSE, NULL);
+   for(;;) {
+      while(test9_items == 0 && !test9_done)
+         ht_cond_await(&test9_cond, &test9_mutex, NULL);
+      if (test9_items == 0)
+         break;
+      test9_items--;
+      test9_taken++;
+   }
+   ht_mutex_release(&test9_mutex);
+}
+
+static void *
+test9_green(void *arg)
+{
+   test9_job(arg);
+   return NULL;
+}
+
+/* the producer, notifying each item */
+static void
+test9_body(void)
+{
+   int i;
+
+   while(test9_cond.cn_waiters < 2)
+      ht_yield(NULL);
+   for(i = 0; i < 10000; i++) {
+      ht_mutex_acquire(&test9_mutex, FALSE, NULL);
+      test9_items++;
+      ht_mutex_release(&test9_mutex);
+      ht_cond_notify_n(&test9_cond, 1);
+      if (i % 100 == 0)
+         ht_yield(NULL);
+   }
+   ht_mutex_acquire(&test9_mutex, FALSE, NULL);
+   test9_done = TRUE;
+   ht_mutex_release(&test9_mutex);
+   ht_cond_notify_n(&test9_cond, HT_COND_ALL);
+}
+
+void
+test9()
+{
+   /* consumers on workers and green threads */
+   test_mixed(2, test9_job, test9_green, test9_body);
+   HT_TEST_ASSERT(test9_taken == 10000 && test9_cond.cn_waiters == 0,
+                  "ht_cond_notify_n() lost a wakeup.");
+   HT_TEST_ASSERT(ht_cond_notify_n(&test9_cond, HT_COND_ALL) == 0,
+                  "ht_cond_notify_n() woke a thread which was not waiting.");
+}
+
+static ht_mutex_t test10_mutex = HT_MUTEX_INIT;
+
+static void *
+test10_green(void *arg)
+{
+   ht_mutex_acquire(&test10_mutex, FALSE, NULL);
+   ht_mutex_release(&test10_mutex);
+   return NULL;
+}
+
+static void *
+test10_timed(void *arg)
+{
+   ht_set_deadline(ht_self(), ht_timeout(0, 10000));
+   HT_TEST_ASSERT(!ht_mutex_acquire(&test10_mutex, FALSE, NULL) && errno == ETIMEDOUT,
+                  "ht_mutex_acquire() did not time out.");
+   return NULL;
+}
+
+void
+test10()
+{
+   ht_attr_t attr = ht_attr_new();
+   ht_attr_t self;
+   ht_t high;
+
+   ht_mutex_setinherit(&test10_mutex, TRUE);
+   ht_mutex_acquire(&test10_mutex, FALSE, NULL);
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   ht_attr_set(attr, HT_ATTR_PRIO, HT_PRIO_MAX);
+   high = ht_spawn(attr, test10_green, NULL);
+   while(test10_mutex.mx_nwait == 0)
+      ht_yield(NULL);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_MAX,
+                  "mutex owner did not inherit the waiter priority.");
+   ht_mutex_release(&test10_mutex);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_STD,
+                  "ht_mutex_release() did not restore the owner priority.");
+   ht_join(high, NULL);
+
+   /* a waiter giving up takes back what it lent */
+   ht_mutex_acquire(&test10_mutex, FALSE, NULL);
+   high = ht_spawn(attr, test10_timed, NULL);
+   while(test10_mutex.mx_nwait == 0)
+      ht_yield(NULL);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_MAX,
+                  "mutex owner did not inherit the waiter priority.");
+   ht_join(high, NULL);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_STD,
+                  "a timed out waiter left its priority lent.");
+
+   /* a new priority of a boosted thread only moves its base */
+   high = ht_spawn(attr, test10_green, NULL);
+   while(test10_mutex.mx_nwait == 0)
+      ht_yield(NULL);
+   self = ht_attr_of(ht_self());
+   ht_attr_set(self, HT_ATTR_PRIO, HT_PRIO_MIN);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_MAX,
+                  "HT_ATTR_PRIO overwrote the inherited priority.");
+   ht_mutex_release(&test10_mutex);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_MIN,
+                  "ht_mutex_release() did not fall back to the new base.");
+   ht_attr_set(self, HT_ATTR_PRIO, HT_PRIO_STD);
+   ht_join(high, NULL);
+
+   /* nothing is lent to an owner on a worker until it got back */
+   ht_mutex_acquire(&test10_mutex, FALSE, NULL);
+   high = ht_spawn(attr, test10_green, NULL);
+   ht_hand_out();
+   while(__atomic_load_n(&test10_mutex.mx_nwait, __ATOMIC_ACQUIRE) == 0)
+      usleep(1000);
+   HT_TEST_ASSERT(ht_self()->prio == HT_PRIO_STD,
+                  "a waiter lent its priority to a handed-out owner.");
+   ht_get_back();
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_MAX,
+                  "ht_get_back() did not inherit the waiter priority.");
+   ht_mutex_release(&test10_mutex);
+   HT_TEST_ASSERT(ht_ctrl(HT_CTRL_GETPRIO, ht_self()) == HT_PRIO_STD,
+                  "ht_mutex_release() did not restore the owner priority.");
+   ht_join(high, NULL);
+   ht_attr_destroy(self);
+   ht_attr_destroy(attr);
+}
+
+static ht_mutex_t test11_mutex = HT_MUTEX_INIT;
+
+static void *
+test11_green(void *arg)
+{
+   ht_mutex_acquire(&test11_mutex, FALSE, NULL);
+   ht_mutex_release(&test11_mutex);
+   return NULL;
+}
+
+void
+test11()
+{
+   ht_attr_t attr = ht_attr_new();
+   ht_lockprof_t *lp;
+   ht_mutex_t mutex;
+   ht_t green;
+   FILE *fp;
+   char buf[4096];
+   size_t n;
+
+   /* sites by name and by init call site */
+   ht_mutex_setname(&test11_mutex, "test11");
+   ht_ctrl(HT_CTRL_LOCKPROF, TRUE);
+   ht_mutex_init(&mutex);
+   ht_ctrl(HT_CTRL_LOCKPROF, FALSE);
+   HT_TEST_ASSERT(mutex.mx_prof != NULL, "ht_mutex_init() did not attach a profiler site.");
+   ht_mutex_acquire(&mutex, FALSE, NULL);
+   ht_mutex_release(&mutex);
+
+   /* one contended acquisition */
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   ht_mutex_acquire(&test11_mutex, FALSE, NULL);
+   green = ht_spawn(attr, test11_green, NULL);
+   while(test11_mutex.mx_nwait == 0)
+      ht_yield(NULL);
+   ht_mutex_release(&test11_mutex);
+   ht_join(green, NULL);
+   lp = (ht_lockprof_t *)test11_mutex.mx_prof;
+   HT_TEST_ASSERT(lp->lp_acquires == 2 && lp->lp_contended == 1 && lp->lp_wait_total > 0,
+                  "contention profiler miscounted.");
+
+   fp = tmpfile();
+   ht_ctrl(HT_CTRL_DUMPLOCKPROF, fp);
+   rewind(fp);
+   n = fread(buf, 1, sizeof(buf) - 1, fp);
+   buf[n] = NUL;
+   fclose(fp);
+   HT_TEST_ASSERT(strstr(buf, "test11") != NULL, "contention profile was not dumped.");
+   ht_attr_destroy(attr);
+}
+
+static ht_barrier_t test12_barrier = HT_BARRIER_INIT(4);
+static int test12_arrived[100], test12_early, test12_tail;
+
+static void
+test12_job(void *arg)
+{
+   int i;
+
+   for(i = 0; i < 100; i++) {
+      __atomic_add_fetch(&test12_arrived[i], 1, __ATOMIC_RELAXED);
+      if (ht_barrier_reach(&test12_barrier) == HT_BARRIER_TAILLIGHT)
+         __atomic_add_fetch(&test12_tail, 1, __ATOMIC_RELAXED);
+      if (__atomic_load_n(&test12_arrived[i], __ATOMIC_RELAXED) != 4)
+         test12_early = TRUE;
+   }
+}
+
+static void *
+test12_green(void *arg)
+{
+   test12_job(arg);
+   return NULL;
+}
+
+void
+test12()
+{
+   /* green threads and workers pass the same phases */
+   test_mixed(2, test12_job, test12_green, NULL);
+   HT_TEST_ASSERT(!test12_early, "ht_barrier_reach() released a thread early.");
+   HT_TEST_ASSERT(test12_tail == 100, "ht_barrier_reach() lost a phase.");
+}
+
+/* test two barrier jobs dequeued by the same worker */
+static ht_barrier_t test13_barrier = HT_BARRIER_INIT(2);
+static int test13_busy;
+
+static void
+test13_sleeper(void *arg)
+{
+   __atomic_add_fetch(&test13_busy, 1, __ATOMIC_RELAXED);
+   usleep(20000);
+}
+
+static void
+test13_job(void *arg)
+{
+   ht_barrier_reach(&test13_barrier);
+}
+
+void
+test13()
+{
+   ht_taskgroup_t tg = ht_taskgroup_create();
+   struct ht_task_st jobs[2];
+   ht_task_t list[2];
+   int i;
+
+   /* keep all but one worker busy, so the idle one takes both jobs */
+   for(i = 0; i < 2; i++)
+      ht_taskgroup_spawn(tg, test13_sleeper, NULL);
+   while(__atomic_load_n(&test13_busy, __ATOMIC_RELAXED) < 2)
+      ht_yield(NULL);
+   for(i = 0; i < 2; i++) {
+      jobs[i].tk_tid   = NULL;
+      jobs[i].tk_func  = test13_job;
+      jobs[i].tk_arg   = NULL;
+      jobs[i].tk_group = tg;
+      jobs[i].tk_owned = FALSE;
+      list[i] = &jobs[i];
+   }
+   __atomic_add_fetch(&tg->tg_pending, 2, __ATOMIC_ACQ_REL);
+   HT_TEST_ASSERT(ht_tqueue_tryenqueue_n(&ht_TQ, list, 2) == 2, "ht_tqueue_tryenqueue_n() failed.");
+   HT_TEST_ASSERT(ht_taskgroup_wait(tg), "ht_taskgroup_wait() failed.");
+   ht_taskgroup_destroy(tg);
+}
+
+/* test two handed-out threads dequeued by the same worker, each
+   blocking natively until the other one ran */
+static int test14_pipe[2][2];
+static int test14_busy;
+
+static void
+test14_sleeper(void *arg)
+{
+   __atomic_add_fetch(&test14_busy, 1, __ATOMIC_RELAXED);
+   usleep(20000);
+}
+
+static void *
+test14_green(void *arg)
+{
+   int me = (int)(long)arg;
+   char c = 'x';
+
+   ht_hand_out();
+   if(write(test14_pipe[1 - me][1], &c, 1) != 1
+      || read(test14_pipe[me][0], &c, 1) != 1)
+      c = NUL;
+   ht_get_back();
+   return (void *)(long)(c == 'x');
+}
+
+void
+test14()
+{
+   ht_taskgroup_t tg = ht_taskgroup_create();
+   ht_attr_t attr = ht_attr_new();
+   ht_t tid[2];
+   void *ok;
+   int i;
+
+   for(i = 0; i < 2; i++)
+      HT_TEST_ASSERT(pipe(test14_pipe[i]) == 0, "pipe() failed.");
+   /* keep all but one worker busy, so the idle one takes both threads */
+   for(i = 0; i < 2; i++)
+      ht_taskgroup_spawn(tg, test14_sleeper, NULL);
+   while(__atomic_load_n(&test14_busy, __ATOMIC_RELAXED) < 2)
+      ht_yield(NULL);
+   ht_attr_set(attr, HT_ATTR_JOINABLE, TRUE);
+   for(i = 0; i < 2; i++)
+      tid[i] = ht_spawn(attr, test14_green, (void *)(long)i);
+   for(i = 0; i < 2; i++) {
+      ht_join(tid[i], &ok);
+      HT_TEST_ASSERT(ok != NULL, "handed-out thread did not get its byte.");
+   }
+   ht_taskgroup_wait(tg);
+   ht_taskgroup_destroy(tg);
+   ht_attr_destroy(attr);
+   for(i = 0; i < 2; i++) {
+      close(test14_pipe[i][0]);
+      close(test14_pipe[i][1]);
+   }
+}
+
 int
 main()
 {
    ht_init();
    test1();
+   test2();
+   test3();
+   test4();
+   test5();
+   test6();
+   test7();
+   test8();
+   test9();
+   test10();
+   test11();
+   test12();
+   test13();
+   test14();
    ht_kill();
    return 0;
 }